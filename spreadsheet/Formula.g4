@@ -9,10 +9,17 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | NAME '(' arg (',' arg)* ')'  # Call
     | CELL  # Cell
     | NUMBER  # Literal
     ;
 
+// a cell is taken as a range here, so that functions skip text in it
+arg
+    : CELL (':' CELL)?  # RangeArg
+    | expr  # ExprArg
+    ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -27,4 +34,5 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+NAME: [A-Z]+ ;
 WS: [ \t\n\r]+ -> skip ;
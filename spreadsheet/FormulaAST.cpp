@@ -1,14 +1,23 @@
 #include "FormulaAST.h"
 
+#ifdef SPREADSHEET_ANTLR_ORACLE
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#endif
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <charconv>
 #include <cmath>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
+#include <tuple>
+#include <utility>
 
 namespace ASTImpl {
 
@@ -67,227 +76,381 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
-class Expr {
-public:
-    virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const SheetInterface& sheet) const = 0;
+Instruction Instruction::Number(double value) {
+    Instruction instr;
+    instr.code = OpCode::PushNumber;
+    instr.operand.number = value;
+    return instr;
+}
 
-    // higher is tighter
-    virtual ExprPrecedence GetPrecedence() const = 0;
+Instruction Instruction::Cell(Position pos) {
+    Instruction instr;
+    instr.code = OpCode::LoadCell;
+    instr.operand.cell = pos;
+    return instr;
+}
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                      bool right_child = false) const {
-        auto precedence = GetPrecedence();
-        auto mask = right_child ? PR_RIGHT : PR_LEFT;
-        bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-        if (parens_needed) {
-            out << '(';
-        }
+Instruction Instruction::Operation(OpCode code) {
+    Instruction instr;
+    instr.code = code;
+    return instr;
+}
+
+Instruction Instruction::Range(::Range range) {
+    Instruction instr;
+    instr.code = OpCode::LoadRange;
+    instr.operand.cell = range.first;
+    instr.cols = static_cast<std::uint16_t>(range.last.col - range.first.col + 1);
+    instr.count = static_cast<std::uint32_t>(range.last.row - range.first.row + 1);
+    return instr;
+}
 
-        DoPrintFormula(out, precedence);
+Instruction Instruction::Function(OpCode code, std::uint32_t arg_count) {
+    Instruction instr;
+    instr.code = code;
+    instr.count = arg_count;
+    return instr;
+}
 
-        if (parens_needed) {
-            out << ')';
-        }
+::Range Instruction::GetRange() const {
+    assert(code == OpCode::LoadRange);
+    const Position first = operand.cell;
+    return { first, { first.row + static_cast<int>(count) - 1, first.col + cols - 1 } };
+}
+
+namespace {
+ExprPrecedence GetPrecedence(OpCode code) {
+    switch (code) {
+        case OpCode::Add:
+            return EP_ADD;
+        case OpCode::Subtract:
+            return EP_SUB;
+        case OpCode::Multiply:
+            return EP_MUL;
+        case OpCode::Divide:
+            return EP_DIV;
+        case OpCode::UnaryPlus:
+        case OpCode::UnaryMinus:
+            return EP_UNARY;
+        default:
+            return EP_ATOM;
     }
+}
+
+constexpr std::pair<OpCode, std::string_view> FUNCTIONS[] = {
+    {OpCode::Sum, "SUM"},
+    {OpCode::Average, "AVERAGE"},
+    {OpCode::Min, "MIN"},
+    {OpCode::Max, "MAX"},
+    {OpCode::Count, "COUNT"},
 };
 
-namespace {
-class BinaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        Add = '+',
-        Subtract = '-',
-        Multiply = '*',
-        Divide = '/',
-    };
+bool IsFunction(OpCode code) {
+    return std::any_of(std::begin(FUNCTIONS), std::end(FUNCTIONS), [code](const auto& function) {
+        return function.first == code;
+    });
+}
 
-public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-        : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
-    }
-
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
-        out << ' ';
-        rhs_->Print(out);
-        out << ')';
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-    }
-
-    ExprPrecedence GetPrecedence() const override {
-        switch (type_) {
-            case Add:
-                return EP_ADD;
-            case Subtract:
-                return EP_SUB;
-            case Multiply:
-                return EP_MUL;
-            case Divide:
-                return EP_DIV;
-            default:
-                // have to do this because VC++ has a buggy warning
-                assert(false);
-                return static_cast<ExprPrecedence>(INT_MAX);
+std::string_view GetFunctionName(OpCode code) {
+    for (const auto& [function_code, name] : FUNCTIONS) {
+        if (function_code == code) {
+            return name;
         }
     }
+    assert(false);
+    return {};
+}
 
-        double Evaluate(const SheetInterface& sheet) const override {
+// Number of subexpressions an instruction takes, function arguments
+// included, whichever stack they are on
+int GetArity(const Instruction& instr) {
+    switch (instr.code) {
+        case OpCode::Add:
+        case OpCode::Subtract:
+        case OpCode::Multiply:
+        case OpCode::Divide:
+            return 2;
+        case OpCode::UnaryPlus:
+        case OpCode::UnaryMinus:
+        case OpCode::Collect:
+            return 1;
+        default:
+            return IsFunction(instr.code) ? static_cast<int>(instr.count) : 0;
+    }
+}
 
-            auto arithmetic = [&](std::function<double(double lhs, double rhs)> binary_arithmetic) {
-                if (!std::isfinite(binary_arithmetic(lhs_->Evaluate(sheet), rhs_->Evaluate(sheet)))) {
-                    throw FormulaError(FormulaError::Category::Div0);
-                }
-                return binary_arithmetic(lhs_->Evaluate(sheet), rhs_->Evaluate(sheet));
-            };
+char GetSign(OpCode code) {
+    switch (code) {
+        case OpCode::Add:
+        case OpCode::UnaryPlus:
+            return '+';
+        case OpCode::Subtract:
+        case OpCode::UnaryMinus:
+            return '-';
+        case OpCode::Multiply:
+            return '*';
+        case OpCode::Divide:
+            return '/';
+        default:
+            // have to do this because VC++ has a buggy warning
+            assert(false);
+            return '?';
+    }
+}
 
-            if (type_ == Type::Add) {
-                return arithmetic(std::plus<>());
-            }
-            if (type_ == Type::Multiply) {
-                return arithmetic(std::multiplies<>());
-            }
-            if (type_ == Type::Subtract) {
-                return arithmetic(std::minus<>());
-            }
-            else {
-                return arithmetic(std::divides<>());
-            }
+// Appends pos.ToString() without making a string, pos must be valid
+void AppendPosition(std::string& out, Position pos) {
+    constexpr int LETTERS = 26;
+    constexpr int MAX_LETTER_COUNT = 3;
+
+    char letters[MAX_LETTER_COUNT];
+    char* begin = std::end(letters);
+    for (int col = pos.col; col >= 0; col = col / LETTERS - 1) {
+        *--begin = static_cast<char>('A' + col % LETTERS);
     }
+    out.append(begin, std::end(letters));
 
-private:
-    Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
-};
+    char digits[16];
+    const auto result = std::to_chars(std::begin(digits), std::end(digits), pos.row + 1);
+    out.append(digits, result.ptr);
+}
 
-class UnaryOpExpr final : public Expr {
+// Restores the expression structure of a postfix program:
+// an operation's operands are the subprograms right before it,
+// so it's enough to know where each subprogram starts.
+class ProgramPrinter {
 public:
-    enum Type : char {
-        UnaryPlus = '+',
-        UnaryMinus = '-',
-    };
+    ProgramPrinter(const Program& program, Position anchor)
+        : program_(program)
+        , anchor_(anchor) {
+        // formulas are short, so the starts rarely need the heap
+        if (program_.size() > INLINE_SIZE) {
+            heap_starts_.resize(program_.size());
+            starts_ = heap_starts_.data();
+        }
 
-public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-        : type_(type)
-        , operand_(std::move(operand)) {
+        size_t stack[INLINE_SIZE];
+        std::vector<size_t> heap_stack;
+        size_t* top = stack;
+        if (program_.size() > INLINE_SIZE) {
+            heap_stack.resize(program_.size());
+            top = heap_stack.data();
+        }
+        [[maybe_unused]] const size_t* const bottom = top;
+        for (size_t i = 0; i < program_.size(); ++i) {
+            size_t start = i;
+            for (int arity = GetArity(program_[i]); arity > 0; --arity) {
+                assert(top != bottom);
+                start = *--top;
+            }
+            starts_[i] = start;
+            *top++ = start;
+        }
+        assert(top - bottom == 1);
     }
 
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
-        out << ')';
-    }
+    ProgramPrinter(const ProgramPrinter&) = delete;
+    ProgramPrinter& operator=(const ProgramPrinter&) = delete;
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+    void Print(std::string& out) const {
+        Print(out, program_.size() - 1);
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_UNARY;
+    void PrintFormula(std::string& out) const {
+        PrintFormula(out, program_.size() - 1, EP_ATOM);
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        if (type_ == Type::UnaryMinus) {
-            return -operand_->Evaluate(sheet);
+private:
+    static constexpr size_t INLINE_SIZE = 64;
+
+    void Print(std::string& out, size_t end) const {
+        const Instruction& instr = program_[end];
+        if (instr.code == OpCode::Collect) {
+            Print(out, end - 1);
+            return;
         }
-        else {
-            return operand_->Evaluate(sheet);
+        if (IsFunction(instr.code)) {
+            out += '(';
+            out += GetFunctionName(instr.code);
+            PrintArguments(out, end - 1, instr.count, [this, &out](size_t operand_end) {
+                out += ' ';
+                Print(out, operand_end);
+            });
+            out += ')';
+            return;
+        }
+
+        switch (GetArity(instr)) {
+            case 2:
+                out += '(';
+                out += GetSign(instr.code);
+                out += ' ';
+                Print(out, starts_[end - 1] - 1);
+                out += ' ';
+                Print(out, end - 1);
+                out += ')';
+                break;
+            case 1:
+                out += '(';
+                out += GetSign(instr.code);
+                out += ' ';
+                Print(out, end - 1);
+                out += ')';
+                break;
+            default:
+                PrintAtom(out, instr);
         }
     }
 
-private:
-    Type type_;
-    std::unique_ptr<Expr> operand_;
-};
+    void PrintFormula(std::string& out, size_t end, ExprPrecedence parent_precedence,
+                      bool right_child = false) const {
+        const Instruction& instr = program_[end];
+        if (instr.code == OpCode::Collect) {
+            PrintFormula(out, end - 1, parent_precedence, right_child);
+            return;
+        }
+        if (IsFunction(instr.code)) {
+            out += GetFunctionName(instr.code);
+            out += '(';
+            bool first = true;
+            PrintArguments(out, end - 1, instr.count, [this, &out, &first](size_t operand_end) {
+                if (!first) {
+                    out += ',';
+                }
+                first = false;
+                PrintFormula(out, operand_end, EP_ATOM);
+            });
+            out += ')';
+            return;
+        }
 
-class CellExpr final : public Expr {
-public:
-    explicit CellExpr(const Position* cell)
-        : cell_(cell) {
-    }
+        auto precedence = GetPrecedence(instr.code);
+        auto mask = right_child ? PR_RIGHT : PR_LEFT;
+        bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+        if (parens_needed) {
+            out += '(';
+        }
 
-    void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
-        } else {
-            out << cell_->ToString();
+        switch (GetArity(instr)) {
+            case 2:
+                PrintFormula(out, starts_[end - 1] - 1, precedence);
+                out += GetSign(instr.code);
+                PrintFormula(out, end - 1, precedence, /* right_child = */ true);
+                break;
+            case 1:
+                out += GetSign(instr.code);
+                PrintFormula(out, end - 1, precedence);
+                break;
+            default:
+                PrintAtom(out, instr);
         }
-    }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+        if (parens_needed) {
+            out += ')';
+        }
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+    // Calls print(end) for the ends of the count subprograms computing
+    // the operands, the last of which ends at last_end, in order
+    template <typename PrintOperand>
+    void PrintArguments(std::string& out, size_t last_end, std::uint32_t count, PrintOperand print) const {
+        if (count > 1) {
+            PrintArguments(out, starts_[last_end] - 1, count - 1, print);
+        }
+        print(last_end);
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        auto cell_ptr = sheet.GetCell(*cell_);
-        if (!cell_ptr) {
-            return 0;
-        }
-        auto result = sheet.GetCell(*cell_)->GetValue();
-        if (std::holds_alternative<std::string>(result) && std::get<std::string>(result).empty()) {
-            return 0.0;
-        }
-        if (!std::holds_alternative<double>(result)) {
-            throw FormulaError(FormulaError::Category::Value);
+    void PrintAtom(std::string& out, const Instruction& instr) const {
+        if (instr.code == OpCode::PushNumber) {
+            AppendPrintedNumber(out, instr.operand.number);
+        } else if (instr.code == OpCode::LoadRange) {
+            const Range range = Shift(instr.GetRange(), anchor_);
+            AppendPosition(out, range.first);
+            if (!(range.first == range.last)) {
+                out += ':';
+                AppendPosition(out, range.last);
+            }
+        } else if (!Shift(instr.operand.cell, anchor_).IsValid()) {
+            out += FormulaError(FormulaError::Category::Ref).ToString();
+        } else {
+            AppendPosition(out, Shift(instr.operand.cell, anchor_));
         }
-        return std::get<double>(result);
     }
 
-private:
-    const Position* cell_;
+    const Program& program_;
+    Position anchor_;
+    // starts_[i] is the index of the first instruction
+    // of the subprogram ending at i
+    size_t inline_starts_[INLINE_SIZE];
+    std::vector<size_t> heap_starts_;
+    size_t* starts_ = inline_starts_;
 };
 
-class NumberExpr final : public Expr {
-public:
-    explicit NumberExpr(double value)
-        : value_(value) {
+FormulaAST::Value LoadCellValue(const SheetInterface& sheet, Position pos) {
+    auto cell_ptr = sheet.GetCell(pos);
+    if (!cell_ptr) {
+        return 0.0;
     }
-
-    void Print(std::ostream& out) const override {
-        out << value_;
+    auto result = cell_ptr->GetValue();
+    if (auto* value = std::get_if<double>(&result)) {
+        return *value;
     }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
+    if (auto* error = std::get_if<FormulaError>(&result)) {
+        return *error;
     }
-
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+    if (std::get<std::string>(result).empty()) {
+        return 0.0;
     }
+    return FormulaError(FormulaError::Category::Value);
+}
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        return value_;
+// Replaces the arguments of the function with its result
+double CallFunction(const Instruction& instr, std::vector<RangeStats>& arguments) {
+    assert(arguments.size() >= instr.count);
+    RangeStats stats;
+    for (auto it = arguments.end() - instr.count; it != arguments.end(); ++it) {
+        stats.Merge(*it);
+    }
+    arguments.resize(arguments.size() - instr.count);
+
+    switch (instr.code) {
+        case OpCode::Sum:
+            return stats.sum;
+        case OpCode::Average:
+            // no numbers give NaN, reported as #DIV/0!
+            return stats.sum / static_cast<double>(stats.count);
+        case OpCode::Min:
+            return stats.count ? stats.min : 0.0;
+        case OpCode::Max:
+            return stats.count ? stats.max : 0.0;
+        default:
+            assert(instr.code == OpCode::Count);
+            return static_cast<double>(stats.count);
     }
+}
 
-private:
-    double value_;
-};
+size_t GetStackDepth(const Program& program) {
+    size_t depth = 0;
+    size_t max_depth = 0;
+    for (const Instruction& instr : program) {
+        // function arguments are counted as well, so this is
+        // more than enough for the stack of numbers
+        depth = depth + 1 - GetArity(instr);
+        max_depth = std::max(max_depth, depth);
+    }
+    return max_depth;
+}
 
+#ifdef SPREADSHEET_ANTLR_ORACLE
+// The walker calls exit* in post-order, so the listener lowers
+// the parse tree by simply appending instructions to the program.
 class ParseASTListener final : public FormulaBaseListener {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
-        assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
+    Program MoveProgram() {
+        assert(depth_ == 1);
+        depth_ = 0;
 
-        return root;
+        return std::move(program_);
     }
 
     std::forward_list<Position> MoveCells() {
@@ -296,33 +459,28 @@ public:
 
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-        assert(args_.size() >= 1);
+        assert(depth_ >= 1);
 
-        auto operand = std::move(args_.back());
-
-        UnaryOpExpr::Type type;
+        OpCode code;
         if (ctx->SUB()) {
-            type = UnaryOpExpr::UnaryMinus;
+            code = OpCode::UnaryMinus;
         } else {
             assert(ctx->ADD() != nullptr);
-            type = UnaryOpExpr::UnaryPlus;
+            code = OpCode::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        program_.push_back(Instruction::Operation(code));
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-        double value = 0;
         auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-        std::istringstream in(valueStr);
-        in >> value;
-        if (!in) {
+        std::optional<double> value = ReadNumber(valueStr);
+        if (!value) {
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        program_.push_back(Instruction::Number(*value));
+        ++depth_;
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
@@ -333,32 +491,59 @@ public:
         }
 
         cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        program_.push_back(Instruction::Cell(value));
+        ++depth_;
     }
 
-    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-        assert(args_.size() >= 2);
+    void exitRangeArg(FormulaParser::RangeArgContext* ctx) override {
+        std::vector<Position> corners;
+        for (auto* cell : ctx->CELL()) {
+            auto value_str = cell->getSymbol()->getText();
+            auto value = Position::FromString(value_str);
+            if (!value.IsValid()) {
+                throw FormulaException("Invalid position: " + value_str);
+            }
+            corners.push_back(value);
+        }
+
+        program_.push_back(Instruction::Range(Range::FromCorners(corners.front(), corners.back())));
+        ++depth_;
+    }
+
+    void exitExprArg(FormulaParser::ExprArgContext* /* ctx */) override {
+        program_.push_back(Instruction::Operation(OpCode::Collect));
+    }
 
-        auto rhs = std::move(args_.back());
-        args_.pop_back();
+    void exitCall(FormulaParser::CallContext* ctx) override {
+        auto name = ctx->NAME()->getSymbol()->getText();
+        std::optional<OpCode> code = FindFunction(name);
+        if (!code) {
+            throw ParsingError("Unknown function: " + name);
+        }
 
-        auto lhs = std::move(args_.back());
+        const size_t arg_count = ctx->arg().size();
+        assert(arg_count >= 1 && depth_ >= arg_count);
+        program_.push_back(Instruction::Function(*code, static_cast<std::uint32_t>(arg_count)));
+        depth_ -= arg_count - 1;
+    }
+
+    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+        assert(depth_ >= 2);
 
-        BinaryOpExpr::Type type;
+        OpCode code;
         if (ctx->ADD()) {
-            type = BinaryOpExpr::Add;
+            code = OpCode::Add;
         } else if (ctx->SUB()) {
-            type = BinaryOpExpr::Subtract;
+            code = OpCode::Subtract;
         } else if (ctx->MUL()) {
-            type = BinaryOpExpr::Multiply;
+            code = OpCode::Multiply;
         } else {
             assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
+            code = OpCode::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        program_.push_back(Instruction::Operation(code));
+        --depth_;
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -366,7 +551,9 @@ public:
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
+    Program program_;
+    // number of values the program leaves on the stack
+    size_t depth_ = 0;
     std::forward_list<Position> cells_;
 };
 
@@ -379,11 +566,23 @@ public:
         throw ParsingError("Error when lexing: " + msg);
     }
 };
+#endif
 
 }  // namespace
+
+std::optional<OpCode> FindFunction(std::string_view name) {
+    for (const auto& [code, function_name] : FUNCTIONS) {
+        if (function_name == name) {
+            return code;
+        }
+    }
+    return std::nullopt;
+}
+
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+#ifdef SPREADSHEET_ANTLR_ORACLE
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -404,13 +603,9 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
-}
-
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    return FormulaAST(listener.MoveProgram(), listener.MoveCells());
 }
+#endif
 
 void FormulaAST::PrintCells(std::ostream& out) const {
     for (auto cell : cells_) {
@@ -419,21 +614,240 @@ void FormulaAST::PrintCells(std::ostream& out) const {
 }
 
 void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+    std::string text;
+    ASTImpl::ProgramPrinter(program_, ABSOLUTE).Print(text);
+    out << text;
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position anchor) const {
+    std::string text;
+    AppendFormula(text, anchor);
+    out << text;
+}
+
+void FormulaAST::AppendFormula(std::string& out, Position anchor) const {
+    ASTImpl::ProgramPrinter(program_, anchor).PrintFormula(out);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void AppendPrintedNumber(std::string& out, double number) {
+    // the general format with a precision is that of printf("%g")
+    char buffer[32];
+    const auto result = std::to_chars(std::begin(buffer), std::end(buffer), number,
+                                      std::chars_format::general, PRINTED_NUMBER_PRECISION);
+    out.append(buffer, result.ptr);
 }
 
-double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+namespace {
+
+// from_chars reports both overflows and underflows as out of range,
+// numbers that far from one are told apart by the decimal exponent
+// of their leading digit
+bool IsBelowOne(std::string_view number) {
+    const size_t exponent_pos = number.find_first_of("eE");
+    const std::string_view mantissa = number.substr(0, exponent_pos);
+    const size_t point = std::min(mantissa.find('.'), mantissa.size());
+    const size_t leading = mantissa.find_first_not_of("0.");
+    if (leading == std::string_view::npos) {
+        return true;
+    }
+    long long exponent = leading < point
+        ? static_cast<long long>(point - leading) - 1
+        : -static_cast<long long>(leading - point);
+    if (exponent_pos != std::string_view::npos) {
+        std::string_view written = number.substr(exponent_pos + 1);
+        const bool negative = !written.empty() && written.front() == '-';
+        if (!written.empty() && (written.front() == '-' || written.front() == '+')) {
+            written.remove_prefix(1);
+        }
+        long long value = 0;
+        if (std::from_chars(written.data(), written.data() + written.size(), value).ec != std::errc()) {
+            // no mantissa is long enough to outweigh it
+            return negative;
+        }
+        exponent += negative ? -value : value;
+    }
+    return exponent < 0;
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
+}  // namespace
+
+std::optional<double> ReadNumber(std::string_view text) {
+    // operator>> skips whitespace and takes a sign, from_chars
+    // only takes '-' and also reads "inf" and "nan"
+    text.remove_prefix(std::min(text.find_first_not_of(" \t\n\v\f\r"), text.size()));
+    const bool positive = !text.empty() && text.front() == '+';
+    if (positive) {
+        text.remove_prefix(1);
+    }
+    const bool negative = !positive && !text.empty() && text.front() == '-';
+    const size_t first = negative ? 1 : 0;
+    if (first == text.size() || !(std::isdigit(static_cast<unsigned char>(text[first])) || text[first] == '.')) {
+        return std::nullopt;
+    }
+
+    double value = 0;
+    const char* end = text.data() + text.size();
+    const auto [read_end, error] = std::from_chars(text.data(), end, value);
+    if (read_end != end) {
+        return std::nullopt;
+    }
+    if (error == std::errc::result_out_of_range) {
+        // underflows are read as zero, overflows fail
+        if (!IsBelowOne(text.substr(first))) {
+            return std::nullopt;
+        }
+        return negative ? -0.0 : 0.0;
+    }
+    if (error != std::errc()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+FormulaAST::Value FormulaAST::Execute(const SheetInterface& sheet, Position anchor) const {
+    using ASTImpl::OpCode;
+
+    // formulas are short, so the stack rarely needs the heap
+    constexpr size_t INLINE_STACK_SIZE = 64;
+    double inline_stack[INLINE_STACK_SIZE];
+    std::vector<double> heap_stack;
+    double* stack = inline_stack;
+    if (stack_depth_ > INLINE_STACK_SIZE) {
+        heap_stack.resize(stack_depth_);
+        stack = heap_stack.data();
+    }
+
+    // points past the top of the stack
+    double* top = stack;
+    // arguments of aggregate functions
+    std::vector<RangeStats> arguments;
+    for (const ASTImpl::Instruction& instr : program_) {
+        switch (instr.code) {
+            case OpCode::PushNumber:
+                *top++ = instr.operand.number;
+                break;
+            case OpCode::LoadCell: {
+                Value value = ASTImpl::LoadCellValue(sheet, ASTImpl::Shift(instr.operand.cell, anchor));
+                if (auto* error = std::get_if<FormulaError>(&value)) {
+                    // the first error is the result, no need to go on
+                    return *error;
+                }
+                *top++ = std::get<double>(value);
+                break;
+            }
+            case OpCode::Add:
+                --top;
+                top[-1] += top[0];
+                break;
+            case OpCode::Subtract:
+                --top;
+                top[-1] -= top[0];
+                break;
+            case OpCode::Multiply:
+                --top;
+                top[-1] *= top[0];
+                break;
+            case OpCode::Divide:
+                --top;
+                top[-1] /= top[0];
+                break;
+            case OpCode::UnaryPlus:
+                break;
+            case OpCode::UnaryMinus:
+                top[-1] = -top[-1];
+                break;
+            case OpCode::LoadRange: {
+                RangeStats stats = sheet.GetRangeStats(ASTImpl::Shift(instr.GetRange(), anchor));
+                if (stats.error) {
+                    return *stats.error;
+                }
+                arguments.push_back(stats);
+                // the stack of numbers is left as it was
+                continue;
+            }
+            case OpCode::Collect:
+                arguments.emplace_back().Add(*--top);
+                continue;
+            default:
+                *top++ = ASTImpl::CallFunction(instr, arguments);
+                break;
+        }
+
+        // operands are always finite, so this only catches
+        // an overflow or a division by zero just made
+        if (!std::isfinite(top[-1])) {
+            return FormulaError(FormulaError::Category::Div0);
+        }
+    }
+
+    assert(top == stack + 1);
+    return stack[0];
+}
+
+FormulaAST::FormulaAST(ASTImpl::Program program, std::forward_list<Position> cells)
+    : program_(std::move(program))
+    , stack_depth_(ASTImpl::GetStackDepth(program_))
     , cells_(std::move(cells)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    cells_.unique();
+
+    for (const ASTImpl::Instruction& instruction : program_) {
+        if (instruction.code == ASTImpl::OpCode::LoadRange) {
+            ranges_.push_front(instruction.GetRange());
+        }
+    }
+    ranges_.sort([](const Range& lhs, const Range& rhs) {
+        return std::tie(lhs.first, lhs.last) < std::tie(rhs.first, rhs.last);
+    });
+    ranges_.unique();
+}
+
+void FormulaAST::Rebase(Position anchor) {
+    const Position offset{ -anchor.row, -anchor.col };
+    for (ASTImpl::Instruction& instr : program_) {
+        if (instr.code == ASTImpl::OpCode::LoadCell || instr.code == ASTImpl::OpCode::LoadRange) {
+            instr.operand.cell = ASTImpl::Shift(instr.operand.cell, offset);
+        }
+    }
+    for (Position& cell : cells_) {
+        cell = ASTImpl::Shift(cell, offset);
+    }
+    for (Range& range : ranges_) {
+        range = ASTImpl::Shift(range, offset);
+    }
+}
+
+bool FormulaAST::IsValidAt(Position anchor) const {
+    for (const Position& cell : GetCells(anchor)) {
+        if (!cell.IsValid()) {
+            return false;
+        }
+    }
+    for (const Range& range : GetRanges(anchor)) {
+        if (!range.IsValid()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<Position> FormulaAST::GetReferencedCells(Position anchor) const {
+    const AnchoredList<Position> anchored_cells = GetCells(anchor);
+    std::vector<Position> cells(anchored_cells.begin(), anchored_cells.end());
+    if (ranges_.empty()) {
+        return cells;
+    }
+
+    for (const Range& range : GetRanges(anchor)) {
+        for (int row = range.first.row; row <= range.last.row; ++row) {
+            for (int col = range.first.col; col <= range.last.col; ++col) {
+                cells.push_back({ row, col });
+            }
+        }
+    }
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    return cells;
 }
 
 FormulaAST::~FormulaAST() = default;
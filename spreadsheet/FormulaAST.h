@@ -1,49 +1,260 @@
 #pragma once
 
-#include "FormulaLexer.h"
 #include "common.h"
 
+#include <cstdint>
 #include <forward_list>
 #include <functional>
+#include <istream>
+#include <iterator>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl {
-class Expr;
+
+// Operations of the postfix program a formula is compiled into.
+// Operands are taken from the top of the evaluation stack,
+// the result is pushed back.
+//
+// Arguments of aggregate functions are kept on a separate stack
+// of RangeStats, a function call replaces its arguments with a number.
+enum class OpCode : std::uint8_t {
+    PushNumber,  // pushes operand.number
+    LoadCell,    // pushes the numeric value of operand.cell
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    UnaryPlus,
+    UnaryMinus,
+    LoadRange,   // pushes an argument with the values of a range
+    Collect,     // pops a number and pushes it as an argument
+    Sum,         // the functions take count arguments
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+struct Instruction {
+    OpCode code;
+    // LoadRange: number of columns, the range starts at operand.cell
+    std::uint16_t cols = 0;
+    // LoadRange: number of rows; functions: number of arguments
+    std::uint32_t count = 0;
+    union Operand {
+        double number;
+        Position cell;
+
+        Operand()
+            : number(0) {
+        }
+    } operand;
+
+    static Instruction Number(double value);
+    static Instruction Cell(Position pos);
+    static Instruction Operation(OpCode code);
+    static Instruction Range(::Range range);
+    static Instruction Function(OpCode code, std::uint32_t arg_count);
+
+    ::Range GetRange() const;
+};
+
+using Program = std::vector<Instruction>;
+
+// Aggregate function called by the name, nullopt for unknown names
+std::optional<OpCode> FindFunction(std::string_view name);
+
+inline Position Shift(Position pos, Position anchor) {
+    return { pos.row + anchor.row, pos.col + anchor.col };
 }
 
+inline ::Range Shift(::Range range, Position anchor) {
+    return { Shift(range.first, anchor), Shift(range.last, anchor) };
+}
+
+}  // namespace ASTImpl
+
+// Positions of a list kept relative to an anchor, read as absolute ones
+template <typename T>
+class AnchoredList {
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = T;
+
+        Iterator(typename std::forward_list<T>::const_iterator it, Position anchor)
+            : it_(it)
+            , anchor_(anchor) {
+        }
+
+        T operator*() const {
+            return ASTImpl::Shift(*it_, anchor_);
+        }
+
+        Iterator& operator++() {
+            ++it_;
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator old = *this;
+            ++it_;
+            return old;
+        }
+
+        bool operator==(const Iterator& rhs) const {
+            return it_ == rhs.it_;
+        }
+
+        bool operator!=(const Iterator& rhs) const {
+            return it_ != rhs.it_;
+        }
+
+    private:
+        typename std::forward_list<T>::const_iterator it_;
+        Position anchor_;
+    };
+
+    AnchoredList(const std::forward_list<T>& items, Position anchor)
+        : items_(&items)
+        , anchor_(anchor) {
+    }
+
+    Iterator begin() const {
+        return { items_->begin(), anchor_ };
+    }
+
+    Iterator end() const {
+        return { items_->end(), anchor_ };
+    }
+
+    bool empty() const {
+        return items_->empty();
+    }
+
+private:
+    const std::forward_list<T>* items_;
+    Position anchor_;
+};
+
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+// Positions in a formula are kept relative to an anchor, the cell
+// the formula is in: formulas filled down a column refer to cells at
+// the same offsets, so they compile to one FormulaAST. The parser gives
+// absolute positions, which are relative to the anchor A1 (ABSOLUTE).
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    using Value = std::variant<double, FormulaError>;
+
+    static constexpr Position ABSOLUTE{ 0, 0 };
+
+    explicit FormulaAST(ASTImpl::Program program, std::forward_list<Position> cells);
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(const SheetInterface& sheet) const;
+    // Makes the positions relative to the anchor
+    void Rebase(Position anchor);
+    // Whether the positions are in the sheet with the anchor
+    bool IsValidAt(Position anchor) const;
+
+    // Returns the value of the formula or the first error
+    // encountered, never throws FormulaError.
+    Value Execute(const SheetInterface& sheet, Position anchor) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void PrintFormula(std::ostream& out, Position anchor) const;
+    // The same appended to out, which saves allocations for callers
+    // reusing a buffer
+    void AppendFormula(std::string& out, Position anchor) const;
 
-    std::forward_list<Position>& GetCells() {
+    // relative to the anchor
+    const std::forward_list<Position>& GetCells() const {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    AnchoredList<Position> GetCells(Position anchor) const {
+        return { cells_, anchor };
+    }
+
+    // relative to the anchor
+    const std::forward_list<Range>& GetRanges() const {
+        return ranges_;
+    }
+
+    AnchoredList<Range> GetRanges(Position anchor) const {
+        return { ranges_, anchor };
+    }
+
+    // Cells referred to on their own or through ranges, sorted
+    // and without repetitions. Ranges are expanded cell by cell,
+    // so this is only for callers asking for the full list.
+    std::vector<Position> GetReferencedCells(Position anchor) const;
+
+    const ASTImpl::Program& GetProgram() const {
+        return program_;
     }
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // the formula in postfix order: operands precede
+    // their operation, the last instruction produces the result
+    ASTImpl::Program program_;
+    // max number of values on the stack during Execute
+    size_t stack_depth_ = 0;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
-    // the whole AST
+    // the whole program, sorted and without repetitions;
+    // cells of ranges aren't included
     std::forward_list<Position> cells_;
+    // ranges of function arguments, a range is kept as a whole
+    // however many cells it covers
+    std::forward_list<Range> ranges_;
 };
 
+// Both throw ParsingError on syntax errors and FormulaException
+// on positions out of the sheet.
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+FormulaAST ParseFormulaAST(std::string_view in_str);
+
+// The expression of a formula in the cell at anchor, with the cells
+// written relative to it in R1C1 style, R[-1]C[0] for the cell above,
+// and without spaces. Expressions with the same relative form compile
+// to the same FormulaAST, the form is found without parsing. Throws
+// like ParseFormulaAST if the expression can't be split into tokens
+// or refers to positions out of the sheet.
+std::string ToRelativeForm(std::string_view expression, Position anchor);
+// The same appended to form, which saves an allocation for callers
+// reusing a buffer
+void AppendRelativeForm(std::string& form, std::string_view expression, Position anchor);
+
+// Digits std::ostream prints numbers with by default
+inline constexpr int PRINTED_NUMBER_PRECISION = 6;
+
+// Appends the number the way std::ostream prints it by default, as
+// values and numbers of formulas are printed; texts of numbers use
+// the shortest form read back as the same number instead
+void AppendPrintedNumber(std::string& out, double number);
+
+// Reads the whole text as a double the way std::istream does in
+// the C locale, leading whitespace and a sign included: overflows
+// fail and underflows are read as zero. Doesn't allocate.
+std::optional<double> ReadNumber(std::string_view text);
+
+#ifdef SPREADSHEET_ANTLR_ORACLE
+// The parser generated from Formula.g4, kept to check
+// the hand-written one against the grammar.
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in);
+#endif
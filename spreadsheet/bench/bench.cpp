@@ -0,0 +1,597 @@
+// Benchmarks of the sheet's hot paths. Every scenario builds its input
+// from a fixed seed, so runs are comparable, and is timed REPETITIONS
+// times keeping the fastest run. The results are written to stdout
+// as JSON:
+//   ns_per_op        wall time of the fastest run per operation
+//   allocs_per_op    calls of operator new in that run per operation,
+//                    aligned and nothrow ones included
+//   peak_heap_bytes  most bytes allocated at once during the runs,
+//                    counting what the scenario had before them
+//   peak_rss_kb      peak resident size of the process so far
+//
+// Usage: spreadsheet_bench [--scale=X] [scenario...]
+// --scale multiplies the sizes of the scenarios, names pick some of them;
+// an unknown name is an error.
+
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+std::atomic<size_t> allocation_count{ 0 };
+std::atomic<size_t> live_bytes{ 0 };
+std::atomic<size_t> peak_bytes{ 0 };
+
+// allocations carry their size in front, in a header keeping
+// the alignment of new, or the one asked for if it is larger
+constexpr size_t HEADER_SIZE = alignof(std::max_align_t);
+
+size_t GetHeaderSize(size_t alignment) {
+    return std::max(alignment, HEADER_SIZE);
+}
+
+void* AllocateBlock(size_t size, size_t alignment) {
+    if (alignment <= HEADER_SIZE) {
+        return std::malloc(size);
+    }
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    // aligned_alloc wants a multiple of the alignment
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+}
+
+void FreeBlock(void* block, size_t alignment) {
+#ifdef _WIN32
+    if (alignment > HEADER_SIZE) {
+        _aligned_free(block);
+        return;
+    }
+#endif
+    static_cast<void>(alignment);
+    std::free(block);
+}
+
+void* Allocate(size_t size, size_t alignment = HEADER_SIZE) {
+    const size_t header = GetHeaderSize(alignment);
+    void* block = AllocateBlock(size + header, alignment);
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    char* ptr = static_cast<char*>(block) + header;
+    reinterpret_cast<size_t*>(ptr)[-1] = size;
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    const size_t live = live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+    size_t peak = peak_bytes.load(std::memory_order_relaxed);
+    while (live > peak && !peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+    return ptr;
+}
+
+void* AllocateNoThrow(size_t size, size_t alignment = HEADER_SIZE) noexcept {
+    try {
+        return Allocate(size, alignment);
+    }
+    catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void Deallocate(void* ptr, size_t alignment = HEADER_SIZE) {
+    if (!ptr) {
+        return;
+    }
+    live_bytes.fetch_sub(reinterpret_cast<size_t*>(ptr)[-1], std::memory_order_relaxed);
+    FreeBlock(static_cast<char*>(ptr) - GetHeaderSize(alignment), alignment);
+}
+
+}  // namespace
+
+// the array forms call these by default
+
+void* operator new(size_t size) {
+    return Allocate(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return AllocateNoThrow(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    return Allocate(size, static_cast<size_t>(alignment));
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return AllocateNoThrow(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept {
+    Deallocate(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    Deallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    Deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t alignment) noexcept {
+    Deallocate(ptr, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t alignment) noexcept {
+    Deallocate(ptr, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* ptr, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    Deallocate(ptr, static_cast<size_t>(alignment));
+}
+
+namespace {
+
+constexpr int REPETITIONS = 3;
+constexpr unsigned SEED = 2023;
+
+long GetPeakRssKb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return static_cast<long>(counters.PeakWorkingSetSize / 1024);
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+struct Result {
+    std::string name;
+    size_t ops = 0;
+    double ns_per_op = std::numeric_limits<double>::infinity();
+    double allocs_per_op = 0;
+    size_t peak_heap_bytes = 0;
+    long peak_rss_kb = 0;
+};
+
+// Handed to a scenario to time the operations it runs, the setup
+// before and the checks after aren't counted
+class Meter {
+public:
+    explicit Meter(Result& result)
+        : result_(result) {
+    }
+
+    template <typename Func>
+    void Measure(size_t ops, Func func) {
+        peak_bytes = live_bytes.load();
+        const size_t allocations = allocation_count.load();
+        const auto start = std::chrono::steady_clock::now();
+        func();
+        const auto finish = std::chrono::steady_clock::now();
+        const double ns = std::chrono::duration<double, std::nano>(finish - start).count() / ops;
+        // the counts of the fastest run go together
+        if (ns < result_.ns_per_op) {
+            result_.ns_per_op = ns;
+            result_.allocs_per_op = static_cast<double>(allocation_count.load() - allocations) / ops;
+        }
+        result_.ops = ops;
+        result_.peak_heap_bytes = std::max(result_.peak_heap_bytes, peak_bytes.load());
+    }
+
+private:
+    Result& result_;
+};
+
+struct Scenario {
+    const char* name;
+    // size is the number of operations before --scale
+    int size;
+    std::function<void(Meter&, int size)> run;
+};
+
+int Pick(std::mt19937& random, int count) {
+    return std::uniform_int_distribution<int>(0, count - 1)(random);
+}
+
+std::string CellName(int row, int col) {
+    return Position{ row, col }.ToString();
+}
+
+// Keeps the result of an operation from being optimized away
+void Consume(const CellInterface::Value& value) {
+    static volatile size_t sink;
+    sink = sink + value.index();
+}
+
+void Consume(double value) {
+    static volatile double sink;
+    sink = sink + value;
+}
+
+// Texts read as numbers in the forms a table may have them: padded,
+// signed, with an exponent
+std::string RandomNumericText(std::mt19937& random) {
+    std::string text = std::to_string(Pick(random, 100000)) + "." + std::to_string(Pick(random, 1000));
+    switch (Pick(random, 4)) {
+        case 0:
+            return " " + text;
+        case 1:
+            return "-" + text;
+        case 2:
+            return "+" + text + "e" + std::to_string(Pick(random, 20) - 10);
+        default:
+            return text;
+    }
+}
+
+// Formulas over cells of the rows before row, a column per cell
+std::string RandomFormula(std::mt19937& random, int row, int cols) {
+    std::string formula = "=";
+    const int terms = 1 + Pick(random, 3);
+    for (int i = 0; i < terms; ++i) {
+        if (i > 0) {
+            formula += "+-*"[Pick(random, 3)];
+        }
+        formula += CellName(Pick(random, row), Pick(random, cols));
+    }
+    return formula;
+}
+
+// Numbers in the first column, formulas referring to the one on their
+// left in each of the next ones
+void FillGrid(Sheet& sheet, int rows, int cols) {
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell({ row, 0 }, std::to_string(row));
+        for (int col = 1; col < cols; ++col) {
+            sheet.SetCell({ row, col }, "=" + CellName(row, col - 1) + "*2");
+        }
+    }
+}
+
+const std::vector<Scenario>& GetScenarios() {
+    static const std::vector<Scenario> scenarios = {
+        { "set_numbers", 100000, [](Meter& meter, int size) {
+            std::mt19937 random(SEED);
+            std::vector<std::string> texts(size);
+            for (std::string& text : texts) {
+                text = std::to_string(Pick(random, 1000000)) + "." + std::to_string(Pick(random, 100));
+            }
+            Sheet sheet;
+            meter.Measure(size, [&]() {
+                for (int i = 0; i < size; ++i) {
+                    sheet.SetCell({ i / 16, i % 16 }, std::move(texts[i]));
+                }
+            });
+        } },
+        { "set_texts", 100000, [](Meter& meter, int size) {
+            std::mt19937 random(SEED);
+            std::vector<std::string> texts(size);
+            for (std::string& text : texts) {
+                text.resize(4 + Pick(random, 20));
+                for (char& c : text) {
+                    c = static_cast<char>('a' + Pick(random, 26));
+                }
+            }
+            Sheet sheet;
+            meter.Measure(size, [&]() {
+                for (int i = 0; i < size; ++i) {
+                    sheet.SetCell({ i / 16, i % 16 }, std::move(texts[i]));
+                }
+            });
+        } },
+        { "set_numeric_texts", 100000, [](Meter& meter, int size) {
+            std::mt19937 random(SEED);
+            std::vector<std::string> texts(size);
+            for (std::string& text : texts) {
+                text = RandomNumericText(random);
+            }
+            Sheet sheet;
+            meter.Measure(size, [&]() {
+                for (int i = 0; i < size; ++i) {
+                    sheet.SetCell({ i / 16, i % 16 }, std::move(texts[i]));
+                }
+            });
+        } },
+        { "get_number", 200000, [](Meter& meter, int size) {
+            // the text of a numeric text cell read again
+            std::mt19937 random(SEED);
+            Sheet sheet;
+            std::vector<const Cell*> cells(size);
+            for (int i = 0; i < size; ++i) {
+                sheet.SetCell({ i / 16, i % 16 }, RandomNumericText(random));
+                cells[i] = static_cast<const Cell*>(sheet.GetCell({ i / 16, i % 16 }));
+            }
+            meter.Measure(size, [&]() {
+                for (const Cell* cell : cells) {
+                    Consume(cell->GetNumber().value_or(0));
+                }
+            });
+        } },
+        { "position_from_string", 1000000, [](Meter& meter, int size) {
+            std::mt19937 random(SEED);
+            std::vector<std::string> names(size);
+            for (std::string& name : names) {
+                name = CellName(Pick(random, Position::MAX_ROWS), Pick(random, Position::MAX_COLS));
+            }
+            meter.Measure(size, [&]() {
+                for (const std::string& name : names) {
+                    const Position pos = Position::FromString(name);
+                    Consume(pos.row + pos.col);
+                }
+            });
+        } },
+        { "set_formulas", 50000, [](Meter& meter, int size) {
+            // formulas over a block of numbers, each one new to the interner
+            constexpr int cols = 16;
+            std::mt19937 random(SEED);
+            Sheet sheet;
+            const int rows = std::max(size / cols, 1);
+            for (int row = 0; row < rows; ++row) {
+                sheet.SetCell({ row, 0 }, std::to_string(row));
+            }
+            std::vector<std::string> formulas(size);
+            for (int i = 0; i < size; ++i) {
+                formulas[i] = RandomFormula(random, std::max(i / cols, 1), 1);
+            }
+            meter.Measure(size, [&]() {
+                for (int i = 0; i < size; ++i) {
+                    sheet.SetCell({ i / cols, 1 + i % cols }, std::move(formulas[i]));
+                }
+            });
+        } },
+        { "chain_update", 10000, [](Meter& meter, int size) {
+            // A1 and a chain of formulas each adding one to the cell above
+            Sheet sheet;
+            sheet.SetCell({ 0, 0 }, "0");
+            for (int row = 1; row < size; ++row) {
+                sheet.SetCell({ row, 0 }, "=" + CellName(row - 1, 0) + "+1");
+            }
+            Consume(sheet.GetCell({ size - 1, 0 })->GetValue());
+            // an update of the head re-evaluates every formula of the chain
+            constexpr int updates = 20;
+            meter.Measure(updates * size, [&]() {
+                for (int i = 1; i <= updates; ++i) {
+                    sheet.SetCell({ 0, 0 }, std::to_string(i));
+                    Consume(sheet.GetCell({ size - 1, 0 })->GetValue());
+                }
+            });
+        } },
+        { "diamond_update", 10000, [](Meter& meter, int size) {
+            // layers of width formulas, each referring to two of the layer above
+            constexpr int width = 16;
+            const int layers = std::max(size / width, 1);
+            Sheet sheet;
+            for (int col = 0; col < width; ++col) {
+                sheet.SetCell({ 0, col }, std::to_string(col));
+            }
+            for (int row = 1; row < layers; ++row) {
+                for (int col = 0; col < width; ++col) {
+                    sheet.SetCell({ row, col }, "=" + CellName(row - 1, col) + "+" + CellName(row - 1, (col + 1) % width));
+                }
+            }
+            sheet.SetCell({ layers, 0 }, "=SUM(" + CellName(layers - 1, 0) + ":" + CellName(layers - 1, width - 1) + ")");
+            Consume(sheet.GetCell({ layers, 0 })->GetValue());
+            constexpr int updates = 20;
+            meter.Measure(updates * layers * width, [&]() {
+                for (int i = 1; i <= updates; ++i) {
+                    sheet.SetCell({ 0, 0 }, std::to_string(i));
+                    Consume(sheet.GetCell({ layers, 0 })->GetValue());
+                }
+            });
+        } },
+        { "fan_out_invalidate", 50000, [](Meter& meter, int size) {
+            // size formulas referring to A1, an edit of A1 outdates them all
+            constexpr int cols = 64;
+            Sheet sheet;
+            sheet.SetCell({ 0, 0 }, "0");
+            for (int i = 0; i < size; ++i) {
+                sheet.SetCell({ 1 + i / cols, i % cols }, "=A1*2");
+            }
+            sheet.Recalculate();
+            constexpr int updates = 20;
+            meter.Measure(updates * size, [&]() {
+                for (int i = 1; i <= updates; ++i) {
+                    sheet.SetCell({ 0, 0 }, std::to_string(i));
+                    sheet.Recalculate();
+                }
+            });
+        } },
+        { "get_value_hot", 1000000, [](Meter& meter, int size) {
+            // values read back from up to date caches
+            constexpr int rows = 1000;
+            constexpr int cols = 10;
+            Sheet sheet;
+            FillGrid(sheet, rows, cols);
+            sheet.Recalculate();
+            std::mt19937 random(SEED);
+            std::vector<Position> reads(size);
+            for (Position& pos : reads) {
+                pos = { Pick(random, rows), 1 + Pick(random, cols - 1) };
+            }
+            meter.Measure(size, [&]() {
+                for (const Position& pos : reads) {
+                    Consume(sheet.GetCell(pos)->GetValue());
+                }
+            });
+        } },
+        { "get_value_cold", 20000, [](Meter& meter, int size) {
+            // each read follows an edit outdating the formulas of its row
+            constexpr int cols = 10;
+            Sheet sheet;
+            FillGrid(sheet, size, cols);
+            sheet.Recalculate();
+            meter.Measure(size, [&]() {
+                for (int row = 0; row < size; ++row) {
+                    sheet.SetCell({ row, 0 }, std::to_string(row + 1));
+                    Consume(sheet.GetCell({ row, cols - 1 })->GetValue());
+                }
+            });
+        } },
+        { "publish_edit", 1000, [](Meter& meter, int size) {
+            // a cell edited and published at a time in a sheet of many tiles
+            const int rows = 200 * size;
+            Sheet sheet;
+            for (int row = 0; row < rows; ++row) {
+                sheet.SetCell({ row, 0 }, std::to_string(row));
+            }
+            sheet.Publish();
+            std::mt19937 random(SEED);
+            meter.Measure(size, [&]() {
+                for (int i = 0; i < size; ++i) {
+                    sheet.SetCell({ Pick(random, rows), 0 }, std::to_string(i));
+                    sheet.Publish();
+                }
+            });
+        } },
+        { "clear_shrink", 100000, [](Meter& meter, int size) {
+            // cleared from the bottom right, the printable area shrinks each time
+            constexpr int cols = 10;
+            const int rows = std::max(size / cols, 1);
+            Sheet sheet;
+            FillGrid(sheet, rows, cols);
+            meter.Measure(rows * cols, [&]() {
+                for (int row = rows - 1; row >= 0; --row) {
+                    for (int col = cols - 1; col >= 0; --col) {
+                        sheet.ClearCell({ row, col });
+                    }
+                }
+            });
+        } },
+        { "print_values", 200000, [](Meter& meter, int size) {
+            constexpr int cols = 20;
+            const int rows = std::max(size / cols, 1);
+            Sheet sheet;
+            FillGrid(sheet, rows, cols);
+            sheet.Recalculate();
+            std::ostringstream output;
+            meter.Measure(rows * cols, [&]() {
+                sheet.PrintValues(output);
+            });
+        } },
+        { "print_texts", 200000, [](Meter& meter, int size) {
+            constexpr int cols = 20;
+            const int rows = std::max(size / cols, 1);
+            Sheet sheet;
+            FillGrid(sheet, rows, cols);
+            std::ostringstream output;
+            meter.Measure(rows * cols, [&]() {
+                sheet.PrintTexts(output);
+            });
+        } },
+        { "parse_formula", 100000, [](Meter& meter, int size) {
+            std::mt19937 random(SEED);
+            std::vector<std::string> expressions(size);
+            for (std::string& expression : expressions) {
+                expression = RandomFormula(random, 1000, 26).substr(1);
+                if (Pick(random, 4) == 0) {
+                    expression = "SUM(" + expression + "," + CellName(Pick(random, 100), 0) + ":" + CellName(100 + Pick(random, 100), 3) + ")";
+                }
+            }
+            meter.Measure(size, [&]() {
+                for (const std::string& expression : expressions) {
+                    ParseFormula(expression);
+                }
+            });
+        } },
+    };
+    return scenarios;
+}
+
+void WriteJson(std::ostream& output, const std::vector<Result>& results, double scale) {
+    output << "{\n  \"seed\": " << SEED << ",\n  \"scale\": " << scale << ",\n  \"scenarios\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& result = results[i];
+        output << (i > 0 ? "," : "") << "\n    {"
+               << "\"name\": \"" << result.name << "\", "
+               << "\"ops\": " << result.ops << ", "
+               << "\"ns_per_op\": " << result.ns_per_op << ", "
+               << "\"allocs_per_op\": " << result.allocs_per_op << ", "
+               << "\"peak_heap_bytes\": " << result.peak_heap_bytes << ", "
+               << "\"peak_rss_kb\": " << result.peak_rss_kb << "}";
+    }
+    output << "\n  ]\n}\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    double scale = 1;
+    std::vector<std::string> names;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg.rfind("--scale=", 0) == 0) {
+            scale = std::atof(arg.c_str() + 8);
+        }
+        else {
+            names.push_back(arg);
+        }
+    }
+    if (!(scale > 0)) {
+        std::cerr << "--scale has to be positive" << std::endl;
+        return 1;
+    }
+
+    const std::vector<Scenario>& scenarios = GetScenarios();
+    for (const std::string& name : names) {
+        const bool known = std::any_of(scenarios.begin(), scenarios.end(), [&name](const Scenario& scenario) {
+            return name == scenario.name;
+        });
+        if (!known) {
+            std::cerr << "Unknown scenario " << name << ", the scenarios are:";
+            for (const Scenario& scenario : scenarios) {
+                std::cerr << " " << scenario.name;
+            }
+            std::cerr << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    for (const Scenario& scenario : scenarios) {
+        if (!names.empty() && std::find(names.begin(), names.end(), scenario.name) == names.end()) {
+            continue;
+        }
+        Result result;
+        result.name = scenario.name;
+        const int size = std::max(static_cast<int>(scenario.size * scale), 1);
+        for (int i = 0; i < REPETITIONS; ++i) {
+            Meter meter(result);
+            scenario.run(meter, size);
+        }
+        result.peak_rss_kb = GetPeakRssKb();
+        results.push_back(result);
+        std::cerr << scenario.name << " done" << std::endl;
+    }
+    WriteJson(std::cout, results, scale);
+    return 0;
+}
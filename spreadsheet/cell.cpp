@@ -1,171 +1,373 @@
 #include "cell.h"
 #include "sheet.h"
+#include "FormulaAST.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <cmath>
+#include <iterator>
 #include <iostream>
+#include <new>
 #include <string>
 #include <optional>
-#include <sstream>
+#include <string_view>
+#include <variant>
+
+struct Cell::FormulaData {
+	explicit FormulaData(std::shared_ptr<const FormulaAST> ast)
+		:ast(std::move(ast))
+	{
+	}
+
+	// shared by the cells with the same relative formula,
+	// its positions are relative to the cell
+	std::shared_ptr<const FormulaAST> ast;
+	std::optional<FormulaInterface::Value> cache;
+	Revision computed_at = 0;
+	bool outdated = false;
+};
+
+namespace {
+
+// The shortest text read back as the same number
+void AppendNumberText(std::string& out, double number) {
+	char buffer[32];
+	auto result = std::to_chars(std::begin(buffer), std::end(buffer), number);
+	out.append(buffer, result.ptr);
+}
+
+}  // namespace
+
+std::optional<double> Cell::ParseNumber(std::string_view text) {
+	double number;
+	const char* end = text.data() + text.size();
+	auto result = std::from_chars(text.data(), end, number);
+	if (result.ec != std::errc{} || result.ptr != end || !std::isfinite(number)) {
+		return std::nullopt;
+	}
+	char buffer[32];
+	auto printed = std::to_chars(std::begin(buffer), std::end(buffer), number);
+	if (std::string_view(buffer, printed.ptr - buffer) != text) {
+		return std::nullopt;
+	}
+	return number;
+}
 
 //   
-Cell::Cell(Sheet& sheet)
-	:impl_(std::make_unique<EmptyImpl>()), sheet_(sheet)
+Cell::Cell(Sheet& sheet, Position pos)
+	:sheet_(sheet), pos_(pos), changed_at_(0), kind_(Kind::Empty), number_(0)
 {
 }
 
-Cell::~Cell() {}
+Cell::~Cell() {
+	ResetContent();
+}
+
+void Cell::ResetContent() {
+	if (kind_ == Kind::NumericText || kind_ == Kind::Text) {
+		text_.~basic_string();
+	}
+	else if (kind_ == Kind::Formula) {
+		delete formula_;
+	}
+	kind_ = Kind::Empty;
+}
 
 void Cell::Set(std::string text = ""s) {
-	if (text.empty()) {
-		impl_ = std::make_unique<EmptyImpl>();
+	// parsing may throw, the old content is kept then
+	std::unique_ptr<FormulaData> formula;
+	std::optional<double> number;
+	if (!text.empty() && text.front() == FORMULA_SIGN && text.length() > 1) {
+		try {
+			formula = std::make_unique<FormulaData>(
+				sheet_.GetFormulas().Intern(std::string_view(text).substr(1), pos_));
+		}
+		catch (...) {
+			throw FormulaException("Incorrect formula!");
+		}
 	}
-	else if (text.front() == FORMULA_SIGN && text.length() > 1) {
-		impl_ = std::make_unique<FormulaImpl>(text.substr(1), sheet_, cache_);
+	else if (!text.empty()) {
+		number = ParseNumber(text);
 	}
-	else {
-		impl_ = std::make_unique<TextImpl>(text);
+
+	ResetContent();
+	if (formula) {
+		formula_ = formula.release();
+		kind_ = Kind::Formula;
+	}
+	else if (number) {
+		number_ = *number;
+		kind_ = Kind::Number;
+	}
+	else if (!text.empty()) {
+		// classified once, the value is kept in the sheet's numeric columns
+		kind_ = text.front() != ESCAPE_SIGN && ReadNumber(text) ? Kind::NumericText : Kind::Text;
+		new (&text_) std::string(std::move(text));
 	}
-	std::vector<Position> ref_cells = impl_->GetReferencedCells();
-	parent_cells_ = std::set<Position>(std::make_move_iterator(ref_cells.begin()), std::make_move_iterator(ref_cells.end()));
+	changed_at_ = sheet_.GetRevision();
+}
+
+void Cell::SetFormula(std::shared_ptr<const FormulaAST> ast) {
+	ResetContent();
+	formula_ = new FormulaData(std::move(ast));
+	kind_ = Kind::Formula;
+	changed_at_ = sheet_.GetRevision();
+}
+
+void Cell::SetNumber(double number) {
+	ResetContent();
+	number_ = number;
+	kind_ = Kind::Number;
+	changed_at_ = sheet_.GetRevision();
+}
+
+void Cell::SetText(std::string text, bool numeric) {
+	ResetContent();
+	new (&text_) std::string(std::move(text));
+	kind_ = numeric ? Kind::NumericText : Kind::Text;
+	changed_at_ = sheet_.GetRevision();
 }
 
 void Cell::Clear() {
 	ClearCache();
-	child_cells_.clear();
 	Set();
 }
 
 bool Cell::IsEmpty() const {
-	return !impl_ || impl_->GetText() == std::string{};
+	return kind_ == Kind::Empty;
 }
 
-Cell::Value Cell::GetValue() const {
-	return impl_->GetValue();
+bool Cell::IsFormula() const {
+	return kind_ == Kind::Formula;
 }
-std::string Cell::GetText() const {
-	if (!IsEmpty()) {
-		return impl_->GetText();
-	}
-	else {
-		return {};
-	}
+
+bool Cell::IsNumber() const {
+	return kind_ == Kind::Number;
 }
 
-Cell::TextImpl::TextImpl(std::string text)
-	:text_(text)
-{
+bool Cell::IsText() const {
+	return kind_ == Kind::Text;
 }
 
-Cell::FormulaImpl::FormulaImpl(std::string text, Sheet& sheet, std::optional<Value>& cache)
-	:formula_(ParseFormula(text)), sheet_(sheet), cache_(cache)
-{
+std::optional<double> Cell::GetNumber() const {
+	if (kind_ == Kind::Number) {
+		return number_;
+	}
+	else if (kind_ == Kind::NumericText) {
+		return ReadNumber(text_);
+	}
+	return std::nullopt;
 }
 
-std::string Cell::TextImpl::GetText() const {
-	return text_;
+Cell::FormulaData* Cell::GetFormula() const {
+	return kind_ == Kind::Formula ? formula_ : nullptr;
 }
 
-std::optional<double> StringToDouble(const std::string& str) {
-	std::stringstream str_d(str);
-	double res;
-	if (str_d >> res && str_d.eof()) {
-		return res;
+Cell::Value Cell::GetValue() const {
+	if (IsDirty()) {
+		sheet_.RecalculateCell(pos_);
 	}
-	else {
-		return std::nullopt;
+	else if (kind_ == Kind::Formula) {
+		sheet_.GetStatCounters().Add(StatCounters::CACHE_HITS);
 	}
-}
 
-Cell::Value Cell::TextImpl::GetValue() const {
-	if (!text_.empty() && text_.front() == ESCAPE_SIGN) {
-		return text_.substr(1);
+	if (kind_ == Kind::Number) {
+		return number_;
 	}
-	else if (std::optional<double> result = StringToDouble(text_)) {
-		return result.value();
+	else if (kind_ == Kind::NumericText) {
+		return sheet_.GetNumbers().Get(pos_).value();
 	}
-	else {
-		return GetText();
+	else if (kind_ == Kind::Text) {
+		if (text_.front() == ESCAPE_SIGN) {
+			return text_.substr(1);
+		}
+		return text_;
+	}
+	else if (const FormulaData* formula = GetFormula()) {
+		assert(formula->cache);
+		return std::visit([](const auto& value) -> Value {
+			return value;
+			}, *formula->cache);
 	}
+	return {};
 }
 
-std::string Cell::FormulaImpl::GetText() const {
-	return FORMULA_SIGN + formula_->GetExpression();
+std::string Cell::GetText() const {
+	if (kind_ == Kind::NumericText || kind_ == Kind::Text) {
+		return text_;
+	}
+	std::string text;
+	AppendText(text);
+	return text;
 }
 
-Cell::Value Cell::FormulaImpl::GetValue() const {
-	if (cache_) {
-		CellInterface::Value val = *cache_;
-		if (std::holds_alternative<double>(val)) {
-			return std::get<double>(val);
+void Cell::AppendValue(std::string& out) const {
+	// cache hits are counted by the sheet for the rows it prints
+	if (IsDirty()) {
+		sheet_.RecalculateCell(pos_);
+	}
+
+	if (kind_ == Kind::Number) {
+		AppendPrintedNumber(out, number_);
+	}
+	else if (kind_ == Kind::NumericText) {
+		AppendPrintedNumber(out, sheet_.GetNumbers().Get(pos_).value());
+	}
+	else if (kind_ == Kind::Text) {
+		out.append(text_, text_.front() == ESCAPE_SIGN ? 1 : 0);
+	}
+	else if (const FormulaData* formula = GetFormula()) {
+		assert(formula->cache);
+		if (const double* number = std::get_if<double>(&*formula->cache)) {
+			AppendPrintedNumber(out, *number);
 		}
 		else {
-			return std::get<FormulaError>(val);
+			out += std::get<FormulaError>(*formula->cache).ToString();
 		}
 	}
+}
 
-	auto res = formula_->Evaluate(sheet_);
-	if (std::holds_alternative<double>(res)) {
-		cache_ = std::get<double>(res);
-		return std::get<double>(res);
+void Cell::AppendText(std::string& out) const {
+	if (kind_ == Kind::Number) {
+		AppendNumberText(out, number_);
 	}
-	else {
-		cache_ = std::get<FormulaError>(res);
-		return std::get<FormulaError>(res);
+	else if (kind_ == Kind::NumericText || kind_ == Kind::Text) {
+		out += text_;
+	}
+	else if (const FormulaData* formula = GetFormula()) {
+		out += FORMULA_SIGN;
+		formula->ast->AppendFormula(out, pos_);
 	}
 }
 
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-	return formula_->GetReferencedCells();
+std::vector<Position> Cell::GetReferencedCells() const {
+	const FormulaData* formula = GetFormula();
+	return formula ? formula->ast->GetReferencedCells(pos_) : std::vector<Position>{};
 }
 
-std::vector<Position> Cell::TextImpl::GetReferencedCells() const {
-	return {};
+void Cell::ClearChildrenCache() const {
+	sheet_.InvalidateDependents(pos_);
 }
 
-std::vector<Position> Cell::EmptyImpl::GetReferencedCells() const {
-	return {};
+void Cell::ClearCache() {
+	Invalidate();
+	ClearChildrenCache();
 }
 
-std::string Cell::EmptyImpl::GetText() const {
-	return {};
+bool Cell::CheckCacheValid() {
+	return !IsDirty();
 }
 
-Cell::Value Cell::EmptyImpl::GetValue() const {
-	return {};
+bool Cell::Invalidate() {
+	FormulaData* formula = GetFormula();
+	if (!formula || IsDirty()) {
+		return false;
+	}
+	// the old value is kept: if the formula gives it again,
+	// the dependents don't have to be evaluated
+	formula->outdated = true;
+	return true;
 }
 
-std::vector<Position> Cell::GetReferencedCells() const {
-	return std::vector<Position>(parent_cells_.begin(), parent_cells_.end());
+bool Cell::IsDirty() const {
+	const FormulaData* formula = GetFormula();
+	return formula && (!formula->cache || formula->outdated);
 }
 
-bool Cell::IsReferenced() const {
-	return !child_cells_.empty();
+bool Cell::HasChangedPrecedents() const {
+	const FormulaData* formula = GetFormula();
+	// values in ranges aren't tracked one by one, the formula
+	// is only outdated if one of them may have changed
+	if (!formula->ast->GetRanges().empty()) {
+		return true;
+	}
+	const Revision computed_at = formula->computed_at;
+	for (const Position& parent_pos : GetParentCells()) {
+		const Cell* parent = sheet_.FindCell(parent_pos);
+		// a missing cell may have been cleared and removed
+		if (!parent || parent->GetChangeRevision() > computed_at) {
+			return true;
+		}
+	}
+	return false;
 }
 
-void Cell::ClearChildrenCache() const {
-	for (const Position child_cell : child_cells_) {
-		sheet_.ClearCellCache(child_cell);
+void Cell::Evaluate() {
+	FormulaData* formula = GetFormula();
+	assert(formula);
+
+	const Revision revision = sheet_.GetRevision();
+	if (!formula->cache || HasChangedPrecedents()) {
+		FormulaInterface::Value value = formula->ast->Execute(sheet_, pos_);
+		sheet_.GetStatCounters().Add(StatCounters::EVALUATIONS);
+		if (!(formula->cache == value)) {
+			formula->cache = value;
+			changed_at_ = revision;
+		}
 	}
+	formula->outdated = false;
+	formula->computed_at = revision;
 }
 
-void Cell::ClearCache() {
-	cache_.reset();
-	ClearChildrenCache();
+Cell::Revision Cell::GetChangeRevision() const {
+	return changed_at_;
 }
 
-bool Cell::CheckCacheValid() {
-	return cache_.has_value();
+bool Cell::IsDependentOn(const Position cell) const {
+	const AnchoredList<Position> cells = GetParentCells();
+	return std::find(cells.begin(), cells.end(), cell) != cells.end();
 }
 
-void Cell::SetParentCell(const Position cell) {
-	parent_cells_.insert(cell);
+AnchoredList<Position> Cell::GetParentCells() const {
+	static const std::forward_list<Position> no_cells;
+	const FormulaData* formula = GetFormula();
+	return formula ? formula->ast->GetCells(pos_) : AnchoredList<Position>(no_cells, pos_);
 }
 
-void Cell::SetChildCell(const Position cell) {
-	child_cells_.insert(cell);
+AnchoredList<Range> Cell::GetRanges() const {
+	static const std::forward_list<Range> no_ranges;
+	const FormulaData* formula = GetFormula();
+	return formula ? formula->ast->GetRanges(pos_) : AnchoredList<Range>(no_ranges, pos_);
 }
 
-bool Cell::IsDependentOn(const Position cell) const {
-	return parent_cells_.count(cell);
+const FormulaAST* Cell::GetFormulaAST() const {
+	const FormulaData* formula = GetFormula();
+	return formula ? formula->ast.get() : nullptr;
+}
+
+std::shared_ptr<const FormulaAST> Cell::GetSharedFormulaAST() const {
+	const FormulaData* formula = GetFormula();
+	return formula ? formula->ast : nullptr;
 }
 
+std::optional<FormulaInterface::Value> Cell::GetCachedValue() const {
+	if (IsDirty()) {
+		return std::nullopt;
+	}
+	const FormulaData* formula = GetFormula();
+	return formula ? formula->cache : std::nullopt;
+}
+
+void Cell::SetCachedValue(FormulaInterface::Value value) {
+	FormulaData* formula = GetFormula();
+	assert(formula);
+	formula->cache = value;
+	formula->outdated = false;
+	formula->computed_at = sheet_.GetRevision();
+}
+
+void Cell::CopyFrom(const Cell& other) {
+	ResetContent();
+	if (other.kind_ == Kind::NumericText || other.kind_ == Kind::Text) {
+		new (&text_) std::string(other.text_);
+	}
+	else if (other.kind_ == Kind::Formula) {
+		formula_ = new FormulaData(*other.formula_);
+	}
+	else {
+		number_ = other.number_;
+	}
+	kind_ = other.kind_;
+	changed_at_ = other.changed_at_;
+}
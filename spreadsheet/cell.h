@@ -1,92 +1,121 @@
 #pragma once
 
+#include "FormulaAST.h"
 #include "common.h"
 #include "formula.h"
 
+#include <cstdint>
+#include <forward_list>
 #include <functional>
-#include <unordered_set>
-#include <set>
+#include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
 
 class Sheet;
 
 class Cell : public CellInterface {
 public:
-    Cell(Sheet& sheet);
+    // Sheet edits are numbered, cells remember when their value
+    // last changed and when it was last known to be up to date.
+    using Revision = std::uint64_t;
+
+    Cell(Sheet& sheet, Position pos);
     ~Cell();
 
     void Set(std::string text);
+    // Set with content prepared elsewhere: a formula compiled
+    // for this cell or a number given by ParseNumber
+    void SetFormula(std::shared_ptr<const FormulaAST> ast);
+    void SetNumber(double number);
+    // a text other than a formula or a number kept as double,
+    // numeric if it is read as a number
+    void SetText(std::string text, bool numeric);
     void Clear();
 
+    // The number a text other than a formula is kept as:
+    // one printed back as the same text
+    static std::optional<double> ParseNumber(std::string_view text);
+
     Value GetValue() const override;
     std::string GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
-
-    bool IsReferenced() const;
+    // GetValue and GetText as printed by the sheet, appended to out
+    void AppendValue(std::string& out) const;
+    void AppendText(std::string& out) const;
 
     bool IsEmpty() const;
+    bool IsFormula() const;
+    // A number kept as double rather than as text
+    bool IsNumber() const;
+    // A text whose value is the text itself, but for the escape sign
+    bool IsText() const;
+    // The number the cell holds if it isn't a formula
+    std::optional<double> GetNumber() const;
 
     void ClearCache();
     bool CheckCacheValid();
-
-    void SetParentCell(const Position cell);
-    void SetChildCell(const Position cell);
+    // Marks the formula value outdated. Returns false if there was
+    // nothing to mark: the cell isn't a formula or is already outdated,
+    // so its dependents are outdated too.
+    bool Invalidate();
+
+    // Formula whose cached value is missing or outdated
+    bool IsDirty() const;
+    // Brings the formula value up to date, the cells it refers
+    // to must already have up to date values. The formula is only
+    // evaluated if one of them has changed since the last time.
+    void Evaluate();
+    Revision GetChangeRevision() const;
 
     bool IsDependentOn(const Position cell) const;
+    // Cells the formula refers to on their own, sorted, without repetitions
+    AnchoredList<Position> GetParentCells() const;
+    // Ranges the formula refers to, their cells aren't parent cells.
+    // Cells referring to this one are kept by the sheet.
+    AnchoredList<Range> GetRanges() const;
+
+    // The compiled formula, nullptr if the cell isn't a formula
+    const FormulaAST* GetFormulaAST() const;
+    // The same, sharing it with the cells and the interner
+    std::shared_ptr<const FormulaAST> GetSharedFormulaAST() const;
+    // The value of a formula if it is up to date
+    std::optional<FormulaInterface::Value> GetCachedValue() const;
+    // Restores what GetCachedValue gave for a cell saved in a snapshot
+    void SetCachedValue(FormulaInterface::Value value);
+    // Makes the cell a copy of the same cell of another sheet:
+    // its content and cached value
+    void CopyFrom(const Cell& other);
 private:
-    class Impl;
-    class EmptyImpl;
-    class TextImpl;
-    class FormulaImpl;
-
-	class Impl {
-	public:
-		virtual Value GetValue() const = 0;
-		virtual  std::string GetText() const = 0;
-		virtual std::vector<Position> GetReferencedCells() const = 0;
-		virtual ~Impl() = default;
+	// Parsed formula with its cached value, the only
+	// content that doesn't fit into the cell itself
+	struct FormulaData;
+
+	// Numbers are kept as double if their text can be restored
+	// from the value exactly, other texts are kept as is. Values
+	// of numeric texts are taken from the sheet's numeric columns.
+	enum class Kind : std::uint8_t {
+		Empty,
+		Number,
+		NumericText,
+		Text,
+		Formula,
 	};
 
-	class EmptyImpl : public Impl {
-	public:
-		Value GetValue() const override;
-		std::string GetText() const override;
-		std::vector<Position> GetReferencedCells() const override;
-	};
-
-	class TextImpl : public Impl {
-	public:
-		explicit TextImpl(std::string text);
-
-		Value GetValue() const override;
-		std::string GetText() const override;
-		std::vector<Position> GetReferencedCells() const override;
-
-	private:
+	Sheet& sheet_;
+	Position pos_;
+	// the kind takes the top bits of the revision word
+	Revision changed_at_ : 56;
+	Kind kind_ : 8;
+	union {
+		double number_;
 		std::string text_;
+		FormulaData* formula_;  // owned
 	};
 
-	class FormulaImpl : public Impl {
-	public:
-		explicit FormulaImpl(std::string text, Sheet& sheet, std::optional<Value>& cache);
-
-		Value GetValue() const override;
-		std::string GetText() const override;
-		std::vector<Position> GetReferencedCells() const override;
-
-	private:
-		std::unique_ptr<FormulaInterface> formula_;
-		Sheet& sheet_;
-		std::optional<Value>& cache_;
-	};
-
-	std::unique_ptr<Impl> impl_;
-	Sheet& sheet_;
-
-	std::set<Position> parent_cells_;
-	std::set<Position> child_cells_;
-
-	mutable std::optional<Value> cache_;
-
+	void ResetContent();
+	FormulaData* GetFormula() const;
 	void ClearChildrenCache() const;
+	bool HasChangedPrecedents() const;
 };
\ No newline at end of file
@@ -0,0 +1,90 @@
+#include "cell_storage.h"
+
+#include <utility>
+
+CellStorage::TileKey CellStorage::GetTileKey(int tile_row, int tile_col) {
+    return (static_cast<TileKey>(tile_row) << 32) | static_cast<std::uint32_t>(tile_col);
+}
+
+Position CellStorage::GetTileOrigin(TileKey key) {
+    return { static_cast<int>(key >> 32) * TILE_SIZE, static_cast<int>(key & 0xFFFFFFFF) * TILE_SIZE };
+}
+
+CellStorage::Deleter::Deleter(ObjectPool<Cell>& pool)
+    : pool_(&pool) {
+}
+
+void CellStorage::Deleter::operator()(Cell* cell) const {
+    pool_->Delete(cell);
+}
+
+CellStorage::~CellStorage() {
+    Clear();
+}
+
+CellStorage::CellPtr CellStorage::MakeCell(Sheet& sheet, Position pos) {
+    return CellPtr(pool_.New(sheet, pos), Deleter(pool_));
+}
+
+Cell* CellStorage::Get(Position pos) const {
+    const Tile* tile = FindTile(pos.row / TILE_SIZE, pos.col / TILE_SIZE);
+    return tile ? tile->Get(pos.row % TILE_SIZE, pos.col % TILE_SIZE) : nullptr;
+}
+
+CellStorage::CellPtr CellStorage::Put(Position pos, CellPtr cell) {
+    if (!cell) {
+        return Take(pos);
+    }
+
+    auto& tile = tiles_[GetTileKey(pos.row / TILE_SIZE, pos.col / TILE_SIZE)];
+    if (!tile) {
+        tile = std::make_unique<Tile>();
+    }
+
+    Cell*& slot = tile->cells_[(pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE];
+    if (!slot) {
+        ++tile->cell_count_;
+    }
+    CellPtr old_cell(slot, Deleter(pool_));
+    slot = cell.release();
+    return old_cell;
+}
+
+CellStorage::CellPtr CellStorage::Take(Position pos) {
+    auto it = tiles_.find(GetTileKey(pos.row / TILE_SIZE, pos.col / TILE_SIZE));
+    if (it == tiles_.end()) {
+        return CellPtr(nullptr, Deleter(pool_));
+    }
+
+    Tile& tile = *it->second;
+    CellPtr cell(std::exchange(tile.cells_[(pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE], nullptr),
+        Deleter(pool_));
+    if (cell && --tile.cell_count_ == 0) {
+        tiles_.erase(it);
+    }
+    return cell;
+}
+
+void CellStorage::Clear() {
+    for (auto& [key, tile] : tiles_) {
+        for (Cell* cell : tile->cells_) {
+            if (cell) {
+                pool_.Delete(cell);
+            }
+        }
+    }
+    tiles_.clear();
+}
+
+const CellStorage::Tile* CellStorage::FindTile(int tile_row, int tile_col) const {
+    auto it = tiles_.find(GetTileKey(tile_row, tile_col));
+    return it != tiles_.end() ? it->second.get() : nullptr;
+}
+
+size_t CellStorage::GetTileCount() const {
+    return tiles_.size();
+}
+
+size_t CellStorage::GetMemoryUsage() const {
+    return tiles_.size() * sizeof(Tile) + pool_.GetMemoryUsage();
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "pool.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+// Sparse table of cells made of fixed-size square tiles found through
+// a directory. Memory grows with the number of tiles that hold cells,
+// while neighbouring cells of a row stay next to each other in a tile.
+// The cells themselves are allocated from a pool owned by the storage.
+class CellStorage {
+public:
+    static constexpr int TILE_SIZE = 64;
+
+    // Returns a cell to the pool of the storage that made it
+    class Deleter {
+    public:
+        Deleter() = default;
+        explicit Deleter(ObjectPool<Cell>& pool);
+
+        void operator()(Cell* cell) const;
+
+    private:
+        ObjectPool<Cell>* pool_ = nullptr;
+    };
+
+    using CellPtr = std::unique_ptr<Cell, Deleter>;
+
+    class Tile {
+    public:
+        // row and col are relative to the tile
+        Cell* Get(int row, int col) const {
+            return cells_[row * TILE_SIZE + col];
+        }
+
+    private:
+        friend class CellStorage;
+
+        std::array<Cell*, TILE_SIZE * TILE_SIZE> cells_{};
+        int cell_count_ = 0;
+    };
+
+    CellStorage() = default;
+    CellStorage(const CellStorage&) = delete;
+    CellStorage& operator=(const CellStorage&) = delete;
+    ~CellStorage();
+
+    // Makes an empty cell which isn't in the table yet
+    CellPtr MakeCell(Sheet& sheet, Position pos);
+
+    Cell* Get(Position pos) const;
+    // Puts the cell at pos and returns the one it replaces
+    CellPtr Put(Position pos, CellPtr cell);
+    CellPtr Take(Position pos);
+    void Clear();
+
+    // Tile holding rows [tile_row * TILE_SIZE, (tile_row + 1) * TILE_SIZE)
+    // and the same range of columns, nullptr if it has no cells
+    const Tile* FindTile(int tile_row, int tile_col) const;
+    size_t GetTileCount() const;
+    // Bytes of the tiles and of the pool of cells, without what
+    // the cells allocate themselves
+    size_t GetMemoryUsage() const;
+
+    // Calls func(Position, Cell&) for every cell, in no particular order
+    template <typename Func>
+    void ForEach(Func func) const {
+        for (const auto& [key, tile] : tiles_) {
+            Position origin = GetTileOrigin(key);
+            for (int i = 0; i < TILE_SIZE * TILE_SIZE; ++i) {
+                if (Cell* cell = tile->cells_[i]) {
+                    func(Position{ origin.row + i / TILE_SIZE, origin.col + i % TILE_SIZE }, *cell);
+                }
+            }
+        }
+    }
+
+private:
+    using TileKey = std::uint64_t;
+
+    static TileKey GetTileKey(int tile_row, int tile_col);
+    static Position GetTileOrigin(TileKey key);
+
+    ObjectPool<Cell> pool_;
+    std::unordered_map<TileKey, std::unique_ptr<Tile>> tiles_;
+};
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstddef>
 #include <iosfwd>
+#include <limits>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -21,11 +24,27 @@ struct Position {
 
 	static Position FromString(std::string_view str);
 
-	static const int MAX_ROWS = 16384;
+	static const int MAX_ROWS = 1048576;
 	static const int MAX_COLS = 16384;
 	static const Position NONE;
 };
 
+// Rectangle of cells between two corners, both included
+struct Range {
+	Position first;  // top left
+	Position last;   // bottom right
+
+	bool operator==(Range rhs) const;
+
+	bool IsValid() const;
+	bool Contains(Position pos) const;
+	// "A1:B2", a single cell is written as a position
+	std::string ToString() const;
+
+	// Range with the given corners in any order
+	static Range FromCorners(Position a, Position b);
+};
+
 struct Size {
 	int rows = 0;
 	int cols = 0;
@@ -74,6 +93,20 @@ private:
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe);
 
+// What aggregate functions need to know about the values of a range.
+// Numbers are counted, text and empty cells are skipped.
+struct RangeStats {
+	double sum = 0;
+	double min = std::numeric_limits<double>::infinity();
+	double max = -std::numeric_limits<double>::infinity();
+	size_t count = 0;
+	// an error found in the range, the rest of it may be skipped then
+	std::optional<FormulaError> error;
+
+	void Add(double value);
+	void Merge(const RangeStats& other);
+};
+
 // Исключение, выбрасываемое при попытке передать в метод некорректную позицию
 class InvalidPositionException : public std::out_of_range {
 public:
@@ -161,6 +194,10 @@ public:
 	// соответственно. Пустая ячейка представляется пустой строкой в любом случае.
 	virtual void PrintValues(std::ostream& output) const = 0;
 	virtual void PrintTexts(std::ostream& output) const = 0;
+
+	// Collects the values of the range for aggregate functions.
+	// Goes through GetCell() cell by cell, sheets may do it faster.
+	virtual RangeStats GetRangeStats(Range range) const;
 };
 
 // Создаёт готовую к работе пустую таблицу.
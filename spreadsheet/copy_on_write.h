@@ -0,0 +1,15 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+
+// The object ptr points to, to be changed. If other pointers share it,
+// it is copied first and ptr points to the copy, so they keep seeing it
+// as it was. An object ptr alone points to is changed in place.
+template <typename T>
+T& Unshare(std::shared_ptr<T>& ptr) {
+    if (ptr.use_count() > 1) {
+        ptr = std::make_shared<T>(std::as_const(*ptr));
+    }
+    return *ptr;
+}
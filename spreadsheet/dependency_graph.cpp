@@ -0,0 +1,200 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <utility>
+
+DependencyGraph::Key DependencyGraph::GetKey(Position pos) {
+    return (static_cast<Key>(pos.row) << 32) | static_cast<std::uint32_t>(pos.col);
+}
+
+Position DependencyGraph::GetPosition(Key key) {
+    return { static_cast<int>(key >> 32), static_cast<int>(key & 0xFFFFFFFF) };
+}
+
+size_t DependencyGraph::FindId(const Rows& rows, Position pos) {
+    if (pos.row < 0 || static_cast<size_t>(pos.row) + 1 >= rows.row_starts.size()) {
+        return NO_ID;
+    }
+    const auto first = rows.cols.begin() + rows.row_starts[pos.row];
+    const auto last = rows.cols.begin() + rows.row_starts[pos.row + 1];
+    const auto it = std::lower_bound(first, last, pos.col);
+    return it != last && *it == pos.col ? static_cast<size_t>(it - rows.cols.begin()) : NO_ID;
+}
+
+DependencyGraph::Dependents DependencyGraph::GetRow(const Rows& rows, size_t id) {
+    const Position* targets = rows.targets.data();
+    return { targets + rows.offsets[id], targets + rows.offsets[id + 1] };
+}
+
+void DependencyGraph::AppendRow(Rows& rows, Position pos, Dependents dependents) {
+    if (dependents.empty()) {
+        return;
+    }
+    const std::uint32_t id = static_cast<std::uint32_t>(rows.cols.size());
+    // rows skipped since the last position start and end there
+    rows.row_starts.resize(std::max<size_t>(rows.row_starts.size(), pos.row + 2), id);
+    rows.row_starts.back() = id + 1;
+    rows.cols.push_back(pos.col);
+    rows.targets.insert(rows.targets.end(), dependents.begin(), dependents.end());
+    rows.offsets.push_back(static_cast<std::uint32_t>(rows.targets.size()));
+}
+
+DependencyGraph::Dependents DependencyGraph::GetList(const List& list) const {
+    const Position* first = log_.data() + list.offset;
+    return { first, first + list.size };
+}
+
+DependencyGraph::Dependents DependencyGraph::Get(Position pos) const {
+    const Key key = GetKey(pos);
+    if (const List* list = delta_.Find(key)) {
+        return GetList(*list);
+    }
+    const size_t id = FindId(*rows_, pos);
+    return id != NO_ID ? GetRow(*rows_, id) : Dependents{};
+}
+
+DependencyGraph::List& DependencyGraph::GetDeltaList(Key key) {
+    auto [list, inserted] = delta_.Insert(key, {});
+    if (inserted) {
+        list->offset = static_cast<std::uint32_t>(log_.size());
+        if (const size_t id = FindId(*rows_, GetPosition(key)); id != NO_ID) {
+            const Dependents row = GetRow(*rows_, id);
+            log_.insert(log_.end(), row.begin(), row.end());
+            list->size = static_cast<std::uint32_t>(row.size());
+            list->capacity = list->size;
+        }
+    }
+    return *list;
+}
+
+void DependencyGraph::Grow(List& list) {
+    const std::uint32_t offset = static_cast<std::uint32_t>(log_.size());
+    const std::uint32_t capacity = std::max<std::uint32_t>(2 * list.capacity, 2);
+    log_.resize(log_.size() + capacity);
+    std::copy_n(log_.begin() + list.offset, list.size, log_.begin() + offset);
+    list.offset = offset;
+    list.capacity = capacity;
+}
+
+void DependencyGraph::Add(Position pos, Position dependent) {
+    List& list = GetDeltaList(GetKey(pos));
+    auto first = log_.begin() + list.offset;
+    auto it = std::lower_bound(first, first + list.size, dependent);
+    if (it != first + list.size && *it == dependent) {
+        return;
+    }
+    const auto index = it - first;
+    if (list.size == list.capacity) {
+        Grow(list);
+        first = log_.begin() + list.offset;
+    }
+    std::copy_backward(first + index, first + list.size, first + list.size + 1);
+    first[index] = dependent;
+    ++list.size;
+    CompactIfNeeded();
+}
+
+void DependencyGraph::Remove(Position pos, Position dependent) {
+    // rows without the dependent aren't copied into the delta
+    const Dependents current = Get(pos);
+    if (!std::binary_search(current.begin(), current.end(), dependent)) {
+        return;
+    }
+    List& list = GetDeltaList(GetKey(pos));
+    const auto first = log_.begin() + list.offset;
+    const auto it = std::lower_bound(first, first + list.size, dependent);
+    std::copy(it + 1, first + list.size, it);
+    --list.size;
+    CompactIfNeeded();
+}
+
+void DependencyGraph::CompactIfNeeded() {
+    if (log_.size() > std::max(MIN_LOG_SIZE, rows_->targets.size() / 2)) {
+        Compact();
+    }
+}
+
+void DependencyGraph::Compact() {
+    if (delta_.IsEmpty()) {
+        return;
+    }
+
+    std::vector<std::pair<Key, List>> changed;
+    changed.reserve(delta_.GetSize());
+    size_t changed_size = 0;
+    delta_.ForEach([&](Key key, const List& list) {
+        changed.emplace_back(key, list);
+        changed_size += list.size;
+    });
+    std::sort(changed.begin(), changed.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    // keys are in the order of rows and columns, as ids are,
+    // so the rows and the changed lists are merged
+    auto rows = std::make_shared<Rows>();
+    rows->row_starts.reserve(rows_->row_starts.size());
+    rows->cols.reserve(rows_->cols.size() + changed.size());
+    rows->offsets.reserve(rows_->offsets.size() + changed.size());
+    rows->targets.reserve(rows_->targets.size() + changed_size);
+    auto next = changed.begin();
+    auto append_changed = [&](Key until) {
+        for (; next != changed.end() && next->first < until; ++next) {
+            AppendRow(*rows, GetPosition(next->first), GetList(next->second));
+        }
+    };
+    ForEachRow(*rows_, [&](Position pos, Dependents dependents) {
+        const Key key = GetKey(pos);
+        append_changed(key);
+        if (next != changed.end() && next->first == key) {
+            AppendRow(*rows, pos, GetList(next->second));
+            ++next;
+        }
+        else {
+            AppendRow(*rows, pos, dependents);
+        }
+    });
+    append_changed(NO_KEY);
+
+    rows_ = std::move(rows);
+    delta_.Clear();
+    log_ = {};
+}
+
+size_t DependencyGraph::GetMemoryUsage() const {
+    return rows_->row_starts.capacity() * sizeof(std::uint32_t)
+        + rows_->cols.capacity() * sizeof(int)
+        + rows_->offsets.capacity() * sizeof(std::uint32_t)
+        + rows_->targets.capacity() * sizeof(Position)
+        + delta_.GetMemoryUsage()
+        + log_.capacity() * sizeof(Position);
+}
+
+void DependencyGraph::Builder::Add(Position pos, std::vector<Position> dependents) {
+    if (dependents.empty()) {
+        return;
+    }
+    std::sort(dependents.begin(), dependents.end());
+    dependents.erase(std::unique(dependents.begin(), dependents.end()), dependents.end());
+    const std::uint32_t first = static_cast<std::uint32_t>(targets_.size());
+    targets_.insert(targets_.end(), dependents.begin(), dependents.end());
+    entries_.push_back({ pos, first, static_cast<std::uint32_t>(targets_.size()) });
+}
+
+DependencyGraph DependencyGraph::Builder::Build() {
+    std::sort(entries_.begin(), entries_.end(), [](const Entry& lhs, const Entry& rhs) {
+        return lhs.pos < rhs.pos;
+    });
+    auto rows = std::make_shared<Rows>();
+    rows->cols.reserve(entries_.size());
+    rows->offsets.reserve(entries_.size() + 1);
+    rows->targets.reserve(targets_.size());
+    for (const Entry& entry : entries_) {
+        AppendRow(*rows, entry.pos, { targets_.data() + entry.first, targets_.data() + entry.last });
+    }
+
+    DependencyGraph graph;
+    graph.rows_ = std::move(rows);
+    *this = Builder();
+    return graph;
+}
@@ -0,0 +1,262 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Formulas referring to cells on their own, by the positions they refer
+// to, whether there is a cell or not. Formulas referring through ranges
+// are kept by RangeIndex.
+//
+// Positions with dependents get dense ids in the order of rows and
+// columns and their dependents are kept in compressed sparse rows: those
+// of id i are sorted in targets[offsets[i], offsets[i + 1]), one array
+// for the whole sheet. The ids of a sheet row are found through the
+// starts of the rows, then by a binary search over their columns.
+// Changes don't touch the rows. A changed position gets a list of its
+// own in the delta, which stands for its row: lists are slices of one
+// log, a list outgrowing its slice moves to the end of the log. Once the
+// log holds half as many positions as the rows, the rows are merged
+// with it, so that costs amortized O(1) per change and most dependents
+// stay in the rows. Nothing is allocated per position or per list.
+//
+// Copies share the rows and copy the delta, see Sheet::Fork.
+class DependencyGraph {
+public:
+    // Sorted dependents of a position, valid until the graph changes
+    class Dependents {
+    public:
+        Dependents() = default;
+        Dependents(const Position* begin, const Position* end)
+            : begin_(begin)
+            , end_(end) {
+        }
+
+        const Position* begin() const {
+            return begin_;
+        }
+        const Position* end() const {
+            return end_;
+        }
+        size_t size() const {
+            return end_ - begin_;
+        }
+        bool empty() const {
+            return begin_ == end_;
+        }
+
+    private:
+        const Position* begin_ = nullptr;
+        const Position* end_ = nullptr;
+    };
+
+    class Builder;
+
+    static constexpr size_t MIN_LOG_SIZE = 4096;
+
+    Dependents Get(Position pos) const;
+    void Add(Position pos, Position dependent);
+    void Remove(Position pos, Position dependent);
+
+    // Calls func(pos, dependents) for every position with dependents,
+    // in no particular order
+    template <typename Func>
+    void ForEach(Func func) const {
+        ForEachRow(*rows_, [&](Position pos, Dependents dependents) {
+            if (!delta_.Find(GetKey(pos))) {
+                func(pos, dependents);
+            }
+        });
+        delta_.ForEach([&](Key key, const List& list) {
+            if (list.size > 0) {
+                func(GetPosition(key), GetList(list));
+            }
+        });
+    }
+
+    // Builds the rows again with the lists of the delta
+    void Compact();
+
+    // Bytes of the rows, shared ones included, and of the delta
+    size_t GetMemoryUsage() const;
+
+private:
+    using Key = std::uint64_t;
+
+    // no position packs into it
+    static constexpr Key NO_KEY = ~Key{ 0 };
+
+    // Open addressing table with linear probing, entries are never
+    // removed one by one
+    template <typename Value>
+    class Table {
+    public:
+        const Value* Find(Key key) const {
+            if (slots_.empty()) {
+                return nullptr;
+            }
+            for (size_t i = GetSlot(key);; i = (i + 1) & (slots_.size() - 1)) {
+                if (slots_[i].key == key) {
+                    return &slots_[i].value;
+                }
+                if (slots_[i].key == NO_KEY) {
+                    return nullptr;
+                }
+            }
+        }
+
+        Value* Find(Key key) {
+            return const_cast<Value*>(static_cast<const Table&>(*this).Find(key));
+        }
+
+        // The value of the key, value if there was none.
+        // Returns whether it was inserted.
+        std::pair<Value*, bool> Insert(Key key, Value value) {
+            if (2 * (size_ + 1) > slots_.size()) {
+                Rehash(std::max<size_t>(2 * slots_.size(), 16));
+            }
+            for (size_t i = GetSlot(key);; i = (i + 1) & (slots_.size() - 1)) {
+                if (slots_[i].key == key) {
+                    return { &slots_[i].value, false };
+                }
+                if (slots_[i].key == NO_KEY) {
+                    slots_[i] = { key, value };
+                    ++size_;
+                    return { &slots_[i].value, true };
+                }
+            }
+        }
+
+        void Reserve(size_t size) {
+            size_t capacity = 16;
+            while (capacity < 2 * size) {
+                capacity *= 2;
+            }
+            if (capacity > slots_.size()) {
+                Rehash(capacity);
+            }
+        }
+
+        void Clear() {
+            slots_.clear();
+            size_ = 0;
+        }
+
+        bool IsEmpty() const {
+            return size_ == 0;
+        }
+        size_t GetSize() const {
+            return size_;
+        }
+        size_t GetMemoryUsage() const {
+            return slots_.capacity() * sizeof(Slot);
+        }
+
+        // Calls func(key, value) for every entry
+        template <typename Func>
+        void ForEach(Func func) const {
+            for (const Slot& slot : slots_) {
+                if (slot.key != NO_KEY) {
+                    func(slot.key, slot.value);
+                }
+            }
+        }
+
+    private:
+        struct Slot {
+            Key key = NO_KEY;
+            Value value{};
+        };
+
+        size_t GetSlot(Key key) const {
+            // Fibonacci hashing, the high bits are the best mixed
+            return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> 32) & (slots_.size() - 1);
+        }
+
+        void Rehash(size_t capacity) {
+            std::vector<Slot> slots(capacity);
+            slots.swap(slots_);
+            size_ = 0;
+            for (const Slot& slot : slots) {
+                if (slot.key != NO_KEY) {
+                    Insert(slot.key, slot.value);
+                }
+            }
+        }
+
+        std::vector<Slot> slots_;
+        size_t size_ = 0;
+    };
+
+    struct Rows {
+        // the first id of each sheet row up to the last one with
+        // dependents, and one past the last id
+        std::vector<std::uint32_t> row_starts{ 0 };
+        // by id
+        std::vector<int> cols;
+        std::vector<std::uint32_t> offsets{ 0 };
+        std::vector<Position> targets;
+    };
+
+    // A slice of the log
+    struct List {
+        std::uint32_t offset = 0;
+        std::uint32_t size = 0;
+        std::uint32_t capacity = 0;
+    };
+
+    static constexpr size_t NO_ID = ~size_t{ 0 };
+
+    static Key GetKey(Position pos);
+    static Position GetPosition(Key key);
+    static size_t FindId(const Rows& rows, Position pos);
+    static Dependents GetRow(const Rows& rows, size_t id);
+    // Adds a position after those in the rows, unless it has no dependents
+    static void AppendRow(Rows& rows, Position pos, Dependents dependents);
+    Dependents GetList(const List& list) const;
+
+    // Calls func(pos, dependents) for the rows in the order of ids
+    template <typename Func>
+    static void ForEachRow(const Rows& rows, Func func) {
+        for (size_t row = 0; row + 1 < rows.row_starts.size(); ++row) {
+            for (size_t id = rows.row_starts[row]; id < rows.row_starts[row + 1]; ++id) {
+                func(Position{ static_cast<int>(row), rows.cols[id] }, GetRow(rows, id));
+            }
+        }
+    }
+
+    // The list of the delta for the position, made from its row
+    List& GetDeltaList(Key key);
+    // Moves the list to the end of the log with room for more
+    void Grow(List& list);
+    void CompactIfNeeded();
+
+    std::shared_ptr<const Rows> rows_ = std::make_shared<const Rows>();
+    // lists of positions changed since the rows were built
+    Table<List> delta_;
+    std::vector<Position> log_;
+};
+
+// Builds the rows of a graph at once, see Sheet::ReadSnapshot
+class DependencyGraph::Builder {
+public:
+    // Adds the dependents of a position not added yet, if there are any
+    void Add(Position pos, std::vector<Position> dependents);
+
+    DependencyGraph Build();
+
+private:
+    struct Entry {
+        Position pos;
+        // of the dependents in targets_
+        std::uint32_t first;
+        std::uint32_t last;
+    };
+
+    std::vector<Entry> entries_;
+    std::vector<Position> targets_;
+};
@@ -23,23 +23,17 @@ namespace {
         }
 
         Value Evaluate(const SheetInterface& sheet) const override {
-            try {
-                return ast_.Execute(sheet);
-            }
-            catch (const FormulaError& f_error) {
-                return f_error;
-            }
+            return ast_.Execute(sheet, FormulaAST::ABSOLUTE);
         }
 
         std::string GetExpression() const override {
             std::stringstream ss;
-            ast_.PrintFormula(ss);
+            ast_.PrintFormula(ss, FormulaAST::ABSOLUTE);
             return ss.str();
         }
 
         std::vector<Position> GetReferencedCells() const override {
-            std::set<Position> ref_cells(ast_.GetCells().begin(), ast_.GetCells().end());
-            return std::vector<Position>(std::make_move_iterator(ref_cells.begin()), std::make_move_iterator(ref_cells.end()));
+            return ast_.GetReferencedCells(FormulaAST::ABSOLUTE);
         }
 
     private:
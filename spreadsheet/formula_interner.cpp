@@ -0,0 +1,119 @@
+#include "formula_interner.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <utility>
+
+FormulaInterner::FormulaInterner(size_t capacity)
+    : capacity_(capacity) {
+}
+
+FormulaInterner::FormulaPtr FormulaInterner::Intern(std::string_view expression, Position anchor) {
+    form_.clear();
+    AppendRelativeForm(form_, expression, anchor);
+    auto it = formulas_.find(form_);
+    if (it != formulas_.end()) {
+        if (FormulaPtr formula = it->second.formula.lock()) {
+            // the form was made of valid positions at this anchor
+            assert(formula->IsValidAt(anchor));
+            ++hits_;
+            MakeRecent(it->second, formula);
+            return formula;
+        }
+    }
+
+    const auto parse_start = std::chrono::steady_clock::now();
+    FormulaAST ast = ParseFormulaAST(expression);
+    ast.Rebase(anchor);
+    ++parsed_;
+    parse_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - parse_start).count();
+    return Intern(form_, std::make_shared<const FormulaAST>(std::move(ast)));
+}
+
+FormulaInterner::FormulaPtr FormulaInterner::Intern(const std::string& form, FormulaPtr formula) {
+    auto it = formulas_.find(form);
+    if (it == formulas_.end()) {
+        it = formulas_.emplace(form, Entry{ {}, recent_.end() }).first;
+    }
+    else if (FormulaPtr kept = it->second.formula.lock()) {
+        ++hits_;
+        MakeRecent(it->second, kept);
+        return kept;
+    }
+
+    ++misses_;
+    it->second.formula = formula;
+    MakeRecent(it->second, formula);
+
+    if (formulas_.size() >= sweep_size_) {
+        RemoveUnused();
+        sweep_size_ = std::max(MIN_SWEEP_SIZE, 2 * formulas_.size());
+    }
+    return formula;
+}
+
+void FormulaInterner::MakeRecent(Entry& entry, const FormulaPtr& formula) {
+    if (entry.recent != recent_.end()) {
+        recent_.splice(recent_.begin(), recent_, entry.recent);
+        return;
+    }
+    if (capacity_ == 0) {
+        return;
+    }
+
+    recent_.emplace_front(&entry, formula);
+    entry.recent = recent_.begin();
+    if (recent_.size() > capacity_) {
+        // the formula stays in the table while cells use it
+        recent_.back().first->recent = recent_.end();
+        recent_.pop_back();
+    }
+}
+
+void FormulaInterner::SetCapacity(size_t capacity) {
+    capacity_ = capacity;
+    while (recent_.size() > capacity_) {
+        recent_.back().first->recent = recent_.end();
+        recent_.pop_back();
+    }
+}
+
+size_t FormulaInterner::GetSize() const {
+    return formulas_.size();
+}
+
+size_t FormulaInterner::GetHits() const {
+    return hits_;
+}
+
+size_t FormulaInterner::GetMisses() const {
+    return misses_;
+}
+
+size_t FormulaInterner::GetParsed() const {
+    return parsed_;
+}
+
+std::uint64_t FormulaInterner::GetParseNanoseconds() const {
+    return parse_ns_;
+}
+
+void FormulaInterner::ResetCounters() {
+    hits_ = 0;
+    misses_ = 0;
+    parsed_ = 0;
+    parse_ns_ = 0;
+}
+
+void FormulaInterner::RemoveUnused() {
+    for (auto it = formulas_.begin(); it != formulas_.end();) {
+        // recent formulas are alive, so they are never removed
+        if (it->second.formula.expired()) {
+            it = formulas_.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
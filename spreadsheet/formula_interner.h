@@ -0,0 +1,91 @@
+#pragma once
+
+#include "FormulaAST.h"
+#include "common.h"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Compiled formulas of a sheet by their relative form. Cells whose
+// formulas differ only by where they are, like =B2*C2 in D2 and =B3*C3
+// in D3, share one immutable FormulaAST; each cell is its anchor.
+//
+// Formulas in use are always found. Besides, the last `capacity`
+// formulas looked up are kept alive, so a formula set again after
+// its cells were cleared or overwritten isn't parsed again either.
+// Entries of formulas neither in use nor recent are dropped once the
+// table has doubled since the last sweep, so they cost amortized O(1)
+// per lookup.
+class FormulaInterner {
+public:
+    using FormulaPtr = std::shared_ptr<const FormulaAST>;
+
+    static constexpr size_t DEFAULT_CAPACITY = 4096;
+
+    explicit FormulaInterner(size_t capacity = DEFAULT_CAPACITY);
+
+    // The formula of the expression in the cell at anchor, parsed only
+    // if no formula with the same relative form is in use or recent.
+    // Throws like ParseFormulaAST.
+    FormulaPtr Intern(std::string_view expression, Position anchor);
+    // The same for a formula compiled elsewhere with its relative form,
+    // see ToRelativeForm: the formula kept for the form is returned
+    // if there is one, otherwise the given one is kept.
+    FormulaPtr Intern(const std::string& form, FormulaPtr formula);
+
+    // Calls func(form, formula) for the formulas in use or recent
+    template <typename Func>
+    void ForEach(Func func) const {
+        for (const auto& [form, entry] : formulas_) {
+            if (FormulaPtr formula = entry.formula.lock()) {
+                func(form, formula);
+            }
+        }
+    }
+
+    // Number of recent formulas kept alive, 0 keeps only those in use
+    void SetCapacity(size_t capacity);
+
+    // Number of entries, including those of formulas not in use
+    // since the last sweep
+    size_t GetSize() const;
+    // Lookups that found a formula and that had to parse
+    size_t GetHits() const;
+    size_t GetMisses() const;
+    // Expressions parsed by lookups and the time parsing them took
+    size_t GetParsed() const;
+    std::uint64_t GetParseNanoseconds() const;
+    void ResetCounters();
+
+private:
+    static constexpr size_t MIN_SWEEP_SIZE = 1024;
+
+    struct Entry;
+    // recent formulas with their entries, the most recent first;
+    // entries are nodes of the table, so they don't move
+    using RecentList = std::list<std::pair<Entry*, FormulaPtr>>;
+
+    struct Entry {
+        std::weak_ptr<const FormulaAST> formula;
+        // recent_.end() if the formula isn't recent
+        RecentList::iterator recent;
+    };
+
+    void MakeRecent(Entry& entry, const FormulaPtr& formula);
+    void RemoveUnused();
+
+    std::unordered_map<std::string, Entry> formulas_;
+    RecentList recent_;
+    size_t capacity_;
+    size_t sweep_size_ = MIN_SWEEP_SIZE;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    size_t parsed_ = 0;
+    std::uint64_t parse_ns_ = 0;
+    // reused for the relative forms of lookups
+    std::string form_;
+};
@@ -0,0 +1,410 @@
+#include "FormulaAST.h"
+
+#include <charconv>
+#include <iterator>
+#include <string>
+#include <system_error>
+
+// Hand-written parser of the language described by Formula.g4.
+//
+// The lexer takes the longest match at each point like the generated
+// one does, tokens are views of the text. Expressions are parsed by
+// precedence climbing: unary operators bind tighter than binary ones,
+// binary ones are left-associative. The program is emitted in postfix
+// order while parsing, so no tree is built.
+
+namespace ASTImpl {
+namespace {
+
+enum class TokenType {
+    Number,
+    Cell,
+    Name,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    LeftParen,
+    RightParen,
+    Colon,
+    Comma,
+    End,
+};
+
+struct Token {
+    TokenType type = TokenType::End;
+    std::string_view text;
+};
+
+bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+bool IsUpper(char c) {
+    return c >= 'A' && c <= 'Z';
+}
+
+bool IsSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+class Lexer {
+public:
+    explicit Lexer(std::string_view text)
+        : text_(text) {
+    }
+
+    Token Next() {
+        while (pos_ < text_.size() && IsSpace(text_[pos_])) {
+            ++pos_;
+        }
+        if (pos_ == text_.size()) {
+            return { TokenType::End, {} };
+        }
+
+        const char c = text_[pos_];
+        if (IsUpper(c)) {
+            const size_t digits = Skip(pos_, IsUpper);
+            const size_t end = Skip(digits, IsDigit);
+            return Take(end == digits ? TokenType::Name : TokenType::Cell, end);
+        }
+        if (IsDigit(c) || c == '.') {
+            return LexNumber();
+        }
+
+        switch (c) {
+            case '+':
+                return Take(TokenType::Add, pos_ + 1);
+            case '-':
+                return Take(TokenType::Sub, pos_ + 1);
+            case '*':
+                return Take(TokenType::Mul, pos_ + 1);
+            case '/':
+                return Take(TokenType::Div, pos_ + 1);
+            case '(':
+                return Take(TokenType::LeftParen, pos_ + 1);
+            case ')':
+                return Take(TokenType::RightParen, pos_ + 1);
+            case ':':
+                return Take(TokenType::Colon, pos_ + 1);
+            case ',':
+                return Take(TokenType::Comma, pos_ + 1);
+            default:
+                throw ParsingError("Error when lexing: token recognition error at: '" + std::string(1, c) + "'");
+        }
+    }
+
+private:
+    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    Token LexNumber() {
+        size_t end = Skip(pos_, IsDigit);
+        if (end + 1 < text_.size() && text_[end] == '.' && IsDigit(text_[end + 1])) {
+            end = Skip(end + 1, IsDigit);
+        }
+        else if (end == pos_) {
+            throw ParsingError("Error when lexing: token recognition error at: '.'");
+        }
+
+        // the exponent is only a part of the number if it has digits
+        if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E')) {
+            size_t exponent = end + 1;
+            if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                ++exponent;
+            }
+            if (exponent < text_.size() && IsDigit(text_[exponent])) {
+                end = Skip(exponent, IsDigit);
+            }
+        }
+        return Take(TokenType::Number, end);
+    }
+
+    template <typename Predicate>
+    size_t Skip(size_t pos, Predicate predicate) const {
+        while (pos < text_.size() && predicate(text_[pos])) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    Token Take(TokenType type, size_t end) {
+        Token token{ type, text_.substr(pos_, end - pos_) };
+        pos_ = end;
+        return token;
+    }
+
+    std::string_view text_;
+    size_t pos_ = 0;
+};
+
+class Parser {
+public:
+    explicit Parser(std::string_view text)
+        : lexer_(text) {
+        Advance();
+    }
+
+    FormulaAST Parse() {
+        ParseExpression(0);
+        if (token_.type != TokenType::End) {
+            ThrowUnexpected();
+        }
+
+        // The generated parser checks the tokens once the whole text
+        // is parsed, so syntax errors take precedence.
+        switch (error_) {
+            case Error::None:
+                break;
+            case Error::InvalidPosition:
+                throw FormulaException("Invalid position: " + std::string(error_text_));
+            case Error::InvalidNumber:
+                throw ParsingError("Invalid number: " + std::string(error_text_));
+            case Error::UnknownFunction:
+                throw ParsingError("Unknown function: " + std::string(error_text_));
+        }
+        return FormulaAST(std::move(program_), std::move(cells_));
+    }
+
+private:
+    enum class Error {
+        None,
+        InvalidPosition,
+        InvalidNumber,
+        UnknownFunction,
+    };
+
+    // 0 for tokens that can't follow an operand
+    static int GetBindingPower(TokenType type) {
+        switch (type) {
+            case TokenType::Add:
+            case TokenType::Sub:
+                return 1;
+            case TokenType::Mul:
+            case TokenType::Div:
+                return 2;
+            default:
+                return 0;
+        }
+    }
+
+    static OpCode GetBinaryOperation(TokenType type) {
+        switch (type) {
+            case TokenType::Add:
+                return OpCode::Add;
+            case TokenType::Sub:
+                return OpCode::Subtract;
+            case TokenType::Mul:
+                return OpCode::Multiply;
+            default:
+                return OpCode::Divide;
+        }
+    }
+
+    // Parses binary operations binding tighter than min_power
+    void ParseExpression(int min_power) {
+        ParseOperand();
+        for (;;) {
+            const TokenType type = token_.type;
+            const int power = GetBindingPower(type);
+            if (power <= min_power) {
+                return;
+            }
+            Advance();
+            ParseExpression(power);
+            program_.push_back(Instruction::Operation(GetBinaryOperation(type)));
+        }
+    }
+
+    void ParseOperand() {
+        const Token token = token_;
+        switch (token.type) {
+            case TokenType::Number:
+                Advance();
+                if (std::optional<double> value = ReadNumber(token.text)) {
+                    program_.push_back(Instruction::Number(*value));
+                }
+                else {
+                    RecordError(Error::InvalidNumber, token.text);
+                }
+                break;
+            case TokenType::Cell:
+                Advance();
+                cells_.push_front(ReadPosition(token.text));
+                program_.push_back(Instruction::Cell(cells_.front()));
+                break;
+            case TokenType::Add:
+            case TokenType::Sub:
+                Advance();
+                ParseOperand();
+                program_.push_back(Instruction::Operation(
+                    token.type == TokenType::Sub ? OpCode::UnaryMinus : OpCode::UnaryPlus));
+                break;
+            case TokenType::LeftParen:
+                Advance();
+                ParseExpression(0);
+                Expect(TokenType::RightParen);
+                break;
+            case TokenType::Name:
+                ParseCall();
+                break;
+            default:
+                ThrowUnexpected();
+        }
+    }
+
+    // NAME '(' arg (',' arg)* ')'
+    void ParseCall() {
+        const std::string_view name = token_.text;
+        Advance();
+        Expect(TokenType::LeftParen);
+        std::uint32_t arg_count = 0;
+        do {
+            ParseArgument();
+            ++arg_count;
+        } while (Accept(TokenType::Comma));
+        Expect(TokenType::RightParen);
+
+        if (std::optional<OpCode> code = FindFunction(name)) {
+            program_.push_back(Instruction::Function(*code, arg_count));
+        }
+        else {
+            RecordError(Error::UnknownFunction, name);
+        }
+    }
+
+    // A cell followed by the end of the argument is taken as a range,
+    // the way the grammar resolves the ambiguity.
+    void ParseArgument() {
+        if (token_.type == TokenType::Cell) {
+            const TokenType next = Lexer(lexer_).Next().type;
+            if (next == TokenType::Colon || next == TokenType::Comma || next == TokenType::RightParen) {
+                ParseRange();
+                return;
+            }
+        }
+        ParseExpression(0);
+        program_.push_back(Instruction::Operation(OpCode::Collect));
+    }
+
+    // CELL (':' CELL)?
+    void ParseRange() {
+        const std::string_view first_text = token_.text;
+        Advance();
+        std::string_view last_text = first_text;
+        if (Accept(TokenType::Colon)) {
+            if (token_.type != TokenType::Cell) {
+                ThrowUnexpected();
+            }
+            last_text = token_.text;
+            Advance();
+        }
+
+        const Position first = ReadPosition(first_text);
+        const Position last = ReadPosition(last_text);
+        program_.push_back(Instruction::Range(Range::FromCorners(first, last)));
+    }
+
+    Position ReadPosition(std::string_view text) {
+        const Position pos = Position::FromString(text);
+        if (!pos.IsValid()) {
+            RecordError(Error::InvalidPosition, text);
+        }
+        return pos;
+    }
+
+    void RecordError(Error error, std::string_view text) {
+        if (error_ == Error::None) {
+            error_ = error;
+            error_text_ = text;
+        }
+    }
+
+    void Advance() {
+        token_ = lexer_.Next();
+    }
+
+    bool Accept(TokenType type) {
+        if (token_.type != type) {
+            return false;
+        }
+        Advance();
+        return true;
+    }
+
+    void Expect(TokenType type) {
+        if (!Accept(type)) {
+            ThrowUnexpected();
+        }
+    }
+
+    [[noreturn]] void ThrowUnexpected() const {
+        if (token_.type == TokenType::End) {
+            throw ParsingError("Error when parsing: unexpected end of formula");
+        }
+        throw ParsingError("Error when parsing: unexpected '" + std::string(token_.text) + "'");
+    }
+
+    Lexer lexer_;
+    Token token_;
+    Program program_;
+    std::forward_list<Position> cells_;
+    // the first error found in a well-formed formula
+    Error error_ = Error::None;
+    std::string_view error_text_;
+};
+
+bool IsWord(TokenType type) {
+    return type == TokenType::Number || type == TokenType::Cell || type == TokenType::Name;
+}
+
+void AppendNumber(std::string& out, int number) {
+    char buffer[16];
+    const auto result = std::to_chars(std::begin(buffer), std::end(buffer), number);
+    out.append(buffer, result.ptr);
+}
+
+}  // namespace
+}  // namespace ASTImpl
+
+std::string ToRelativeForm(std::string_view expression, Position anchor) {
+    std::string form;
+    form.reserve(expression.size() + 8);
+    AppendRelativeForm(form, expression, anchor);
+    return form;
+}
+
+void AppendRelativeForm(std::string& form, std::string_view expression, Position anchor) {
+    using namespace ASTImpl;
+
+    Lexer lexer(expression);
+    TokenType previous = TokenType::End;
+    for (Token token = lexer.Next(); token.type != TokenType::End; token = lexer.Next()) {
+        // words are kept apart, other tokens are single characters
+        if (IsWord(previous) && IsWord(token.type)) {
+            form += ' ';
+        }
+        previous = token.type;
+        if (token.type != TokenType::Cell) {
+            form += token.text;
+            continue;
+        }
+
+        const Position pos = Position::FromString(token.text);
+        if (!pos.IsValid()) {
+            throw FormulaException("Invalid position: " + std::string(token.text));
+        }
+        form += "R[";
+        AppendNumber(form, pos.row - anchor.row);
+        form += "]C[";
+        AppendNumber(form, pos.col - anchor.col);
+        form += ']';
+    }
+}
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    const std::string text(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaAST(std::string_view(text));
+}
+
+FormulaAST ParseFormulaAST(std::string_view in_str) {
+    return ASTImpl::Parser(in_str).Parse();
+}
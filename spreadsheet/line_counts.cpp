@@ -0,0 +1,55 @@
+#include "line_counts.h"
+
+#include "copy_on_write.h"
+
+#include <algorithm>
+
+void LineCounts::Add(int line, int count) {
+    auto& chunks = Unshare(chunks_);
+    const int index = line / CHUNK_LINES;
+    if (index >= static_cast<int>(chunks.size())) {
+        chunks.resize(index + 1);
+    }
+    if (!chunks[index]) {
+        chunks[index] = std::make_shared<Chunk>();
+    }
+    Chunk& chunk = Unshare(chunks[index]);
+    int& line_count = chunk.counts[line % CHUNK_LINES];
+    if (line_count == 0) {
+        ++chunk.lines;
+    }
+    line_count += count;
+    end_ = std::max(end_, line + 1);
+}
+
+void LineCounts::Remove(int line) {
+    auto& chunks = Unshare(chunks_);
+    const int index = line / CHUNK_LINES;
+    Chunk& chunk = Unshare(chunks[index]);
+    if (--chunk.counts[line % CHUNK_LINES] > 0) {
+        return;
+    }
+    if (--chunk.lines == 0) {
+        chunks[index].reset();
+    }
+    if (line + 1 == end_) {
+        end_ = FindEnd(index);
+    }
+}
+
+int LineCounts::GetEnd() const {
+    return end_;
+}
+
+int LineCounts::FindEnd(int last_chunk) const {
+    for (int index = last_chunk; index >= 0; --index) {
+        if (const Chunk* chunk = (*chunks_)[index].get()) {
+            for (int i = CHUNK_LINES - 1; i >= 0; --i) {
+                if (chunk->counts[i] > 0) {
+                    return index * CHUNK_LINES + i + 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <vector>
+
+// Numbers of cells in the rows or in the columns of a sheet, to find
+// its printable size. Counts are kept in chunks of CHUNK_LINES lines,
+// allocated once a line of theirs has cells. Copies share the chunks
+// until they change them, so copying costs O(1).
+class LineCounts {
+public:
+    static constexpr int CHUNK_LINES = 1024;
+
+    void Add(int line, int count = 1);
+    // The line must have cells
+    void Remove(int line);
+    // One past the last line with cells, 0 if there are none
+    int GetEnd() const;
+
+private:
+    struct Chunk {
+        std::array<int, CHUNK_LINES> counts{};
+        // lines with cells
+        int lines = 0;
+    };
+
+    int FindEnd(int last_chunk) const;
+
+    // chunks are nullptr until they hold a line with cells
+    std::shared_ptr<std::vector<std::shared_ptr<Chunk>>> chunks_ = std::make_shared<std::vector<std::shared_ptr<Chunk>>>();
+    int end_ = 0;
+};
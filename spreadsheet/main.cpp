@@ -1,9 +1,26 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
 #include <limits>
 #include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <system_error>
+#include <thread>
 
+#include "FormulaAST.h"
 #include "common.h"
 #include "formula.h"
+#include "parallel.h"
+#include "position_map.h"
+#include "sheet.h"
+#include "sheet_history.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
+#include "text_import.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -17,15 +34,6 @@ inline std::ostream& operator<<(std::ostream& output, Size size) {
     return output << "(" << size.rows << ", " << size.cols << ")";
 }
 
-inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
-    std::visit(
-        [&](const auto& x) {
-            output << x;
-        },
-        value);
-    return output;
-}
-
 namespace {
 
     void TestPositionAndStringConversion() {
@@ -51,7 +59,7 @@ namespace {
         testSingle(Position{ 0, 701 }, "ZZ1");
         testSingle(Position{ 0, 702 }, "AAA1");
         testSingle(Position{ 136, 2 }, "C137");
-        testSingle(Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }, "XFD16384");
+        testSingle(Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }, "XFD1048576");
     }
 
     void TestPositionToStringInvalid() {
@@ -70,7 +78,7 @@ namespace {
         ASSERT(!Position::FromString("A+1").IsValid());
         ASSERT(!Position::FromString("R2D2").IsValid());
         ASSERT(!Position::FromString("C3PO").IsValid());
-        ASSERT(!Position::FromString("XFD16385").IsValid());
+        ASSERT(!Position::FromString("XFD1048577").IsValid());
         ASSERT(!Position::FromString("XFE16384").IsValid());
         ASSERT(!Position::FromString("A1234567890123456789").IsValid());
         ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
@@ -136,6 +144,177 @@ namespace {
         sheet->ClearCell("J10"_pos);
     }
 
+    void TestGetCellDoesNotCreateCells() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=C3");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+        ASSERT(sheet.GetCell("C3"_pos) == nullptr);
+
+        sheet.SetCell("D4"_pos, "x");
+        const Sheet& const_sheet = sheet;
+        const CellInterface* empty = const_sheet.GetCell("B2"_pos);
+        ASSERT(empty != nullptr);
+        ASSERT_EQUAL(empty->GetText(), "");
+        ASSERT_EQUAL(empty->GetValue(), CellInterface::Value(""s));
+        ASSERT_EQUAL(const_sheet.GetCell("C3"_pos), empty);
+        ASSERT(!sheet.FindCell("B2"_pos));
+        ASSERT(!sheet.FindCell("C3"_pos));
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        // formulas referring to an empty position follow the cells set there
+        sheet.SetCell("C3"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+        sheet.ClearCell("C3"_pos);
+        ASSERT(!sheet.FindCell("C3"_pos));
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+        sheet.SetCell("C3"_pos, "7");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(7.0));
+
+        sheet.SetCell("A1"_pos, "1");
+        sheet.ClearCell("C3"_pos);
+        sheet.SetCell("C3"_pos, "=A1");
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value(1.0));
+    }
+
+    void TestNumberTexts() {
+        auto sheet = CreateSheet();
+        auto checkCell = [&](Position pos, std::string text, double value) {
+            sheet->SetCell(pos, text);
+            ASSERT_EQUAL(sheet->GetCell(pos)->GetText(), text);
+            ASSERT_EQUAL(sheet->GetCell(pos)->GetValue(), CellInterface::Value(value));
+        };
+
+        checkCell("A1"_pos, "1.5", 1.5);
+        checkCell("A2"_pos, "1.50", 1.5);
+        checkCell("A3"_pos, "1e5", 1e5);
+        checkCell("A4"_pos, "-0.1", -0.1);
+        checkCell("A5"_pos, "123456789012", 123456789012.0);
+        checkCell("A6"_pos, "+7", 7.0);
+
+        sheet->SetCell("A7"_pos, "inf");
+        ASSERT_EQUAL(sheet->GetCell("A7"_pos)->GetValue(), CellInterface::Value("inf"s));
+    }
+
+    void TestReadNumberMatchesStreams() {
+        auto read_with_stream = [](const std::string& text) -> std::optional<double> {
+            std::istringstream in(text);
+            double value;
+            if (in >> value && in.eof()) {
+                return value;
+            }
+            return std::nullopt;
+        };
+        auto check = [&](const std::string& text) {
+            const std::optional<double> expected = read_with_stream(text);
+            const std::optional<double> value = ReadNumber(text);
+            ASSERT_EQUAL(value.has_value(), expected.has_value());
+            if (value) {
+                ASSERT_EQUAL(*value, *expected);
+                ASSERT_EQUAL(std::signbit(*value), std::signbit(*expected));
+            }
+        };
+
+        for (const char* text : { "1", " 1", "\t\n-1.5", "1 ", "+1", "+-1", "-+1", "--1", ".5", "-.5", "5.", ".",
+                                  "1e5", "1e", "1e+", "1E-5", "0x10", "inf", "-nan", "1e400", "-1e400", "1e-400",
+                                  "-1e-400", "0.0001e-320", "1000e-330", "0e999999999999999999999", "2e-324",
+                                  "1e99999999999999999999", "1e-99999999999999999999", "" }) {
+            check(text);
+        }
+
+        std::mt19937 random(19);
+        const std::string alphabet = "0123456789.+-eE x";
+        for (int i = 0; i < 20000; ++i) {
+            std::string text(random() % 8, ' ');
+            for (char& c : text) {
+                c = alphabet[random() % alphabet.size()];
+            }
+            check(text);
+        }
+
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, " 2.5");
+        sheet->SetCell("A2"_pos, "1e-400");
+        sheet->SetCell("A3"_pos, "1e400");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.5));
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(0.0));
+        ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value("1e400"s));
+    }
+
+    void TestNumericColumns() {
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "1.5");
+        sheet.SetCell("B2"_pos, "2.50");
+        sheet.SetCell("B3"_pos, "text");
+        sheet.SetCell("B4"_pos, "'4");
+        sheet.SetCell("B5"_pos, "=B1+B2");
+        sheet.SetCell("B5000"_pos, "7");
+
+        const NumericColumns& numbers = sheet.GetNumbers();
+        ASSERT_EQUAL(numbers.Get("B1"_pos).value(), 1.5);
+        ASSERT_EQUAL(numbers.Get("B2"_pos).value(), 2.5);
+        ASSERT(!numbers.Get("B3"_pos));
+        ASSERT(!numbers.Get("B4"_pos));
+        ASSERT(!numbers.Get("B5"_pos));
+        ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), CellInterface::Value(4.0));
+
+        std::vector<std::pair<int, double>> column;
+        numbers.ForEach(1, 0, Position::MAX_ROWS - 1, [&column](int row, double value) {
+            column.push_back({ row, value });
+        });
+        ASSERT((column == std::vector<std::pair<int, double>>{ { 0, 1.5 }, { 1, 2.5 }, { 4999, 7.0 } }));
+
+        sheet.SetCell("B1"_pos, "one");
+        sheet.ClearCell("B2"_pos);
+        ASSERT(!numbers.Get("B1"_pos));
+        ASSERT(!numbers.Get("B2"_pos));
+        ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(numbers.FindBlock(1, 0)->count, 1);
+    }
+
+    void TestPositionMap() {
+        // random edits of positions crowded into a few rows, so that
+        // slots collide, checked against std::map
+        PositionMap<int> positions;
+        std::map<Position, int> expected;
+        std::mt19937 random(7);
+        auto random_position = [&random]() {
+            return Position{ static_cast<int>(random() % 8) * 1000, static_cast<int>(random() % 300) };
+        };
+        for (int i = 0; i < 20000; ++i) {
+            const Position pos = random_position();
+            switch (random() % 4) {
+                case 0:
+                case 1: {
+                    auto [value, added] = positions.Insert(pos);
+                    ASSERT_EQUAL(added, expected.count(pos) == 0);
+                    *value = i;
+                    expected[pos] = i;
+                    break;
+                }
+                case 2:
+                    ASSERT_EQUAL(positions.Erase(pos), expected.erase(pos) == 1);
+                    break;
+                default: {
+                    const int* value = positions.Find(pos);
+                    auto it = expected.find(pos);
+                    ASSERT_EQUAL(value != nullptr, it != expected.end());
+                    ASSERT(!value || *value == it->second);
+                }
+            }
+            if (i % 5000 == 4999) {
+                std::map<Position, int> all;
+                positions.ForEach([&all](Position pos, int value) {
+                    all[pos] = value;
+                });
+                ASSERT(all == expected);
+                positions.Clear();
+                expected.clear();
+            }
+            ASSERT_EQUAL(positions.GetSize(), expected.size());
+        }
+        ASSERT(!positions.Contains(random_position()));
+    }
+
     void TestFormulaArithmetic() {
         auto sheet = CreateSheet();
         auto evaluate = [&](std::string expr) {
@@ -182,6 +361,20 @@ namespace {
         ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
     }
 
+    void TestFormulaNestedExpressionFormatting() {
+        auto reformat = [](std::string expr) {
+            return ParseFormula(std::move(expr))->GetExpression();
+        };
+
+        ASSERT_EQUAL(reformat("-(1+2)"), "-(1+2)");
+        ASSERT_EQUAL(reformat("-(1*2)"), "-1*2");
+        ASSERT_EQUAL(reformat("+(A1+B2)/C3"), "+(A1+B2)/C3");
+        ASSERT_EQUAL(reformat("1-(2-3)"), "1-(2-3)");
+        ASSERT_EQUAL(reformat("1+(2+3)"), "1+2+3");
+        ASSERT_EQUAL(reformat("(1/2)/(3*4)"), "1/2/(3*4)");
+        ASSERT_EQUAL(reformat("((A1-B1)*(C1+D1))/-E1"), "(A1-B1)*(C1+D1)/-E1");
+    }
+
     void TestFormulaReferencedCells() {
         ASSERT(ParseFormula("1")->GetReferencedCells().empty());
 
@@ -250,12 +443,996 @@ namespace {
         }
     }
 
+    void TestErrorPropagation() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=1/0");
+        sheet->SetCell("B1"_pos, "=A1+1");
+        sheet->SetCell("C1"_pos, "=2*B1");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Div0));
+
+        sheet->SetCell("A1"_pos, "text");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Value));
+    }
+
+    void TestDeeplyNestedFormula() {
+        auto sheet = CreateSheet();
+        std::string expr = "A1";
+        for (int i = 0; i < 60; ++i) {
+            expr = "(" + expr + "+1)";
+        }
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=" + expr);
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(61.0));
+    }
+
+    void TestRecalculateChain() {
+        // a running total long enough to overflow the stack if evaluated recursively
+        Sheet sheet;
+        constexpr int length = 100000;
+        constexpr int height = 10000;
+        auto pos = [](int i) {
+            return Position{ i % height, i / height };
+        };
+        sheet.SetCell(pos(0), "1");
+        for (int i = 1; i < length; ++i) {
+            sheet.SetCell(pos(i), "=" + pos(i - 1).ToString() + "+1");
+        }
+        ASSERT_EQUAL(sheet.GetCell(pos(length - 1))->GetValue(),
+            CellInterface::Value(static_cast<double>(length)));
+
+        sheet.SetCell(pos(0), "10");
+        sheet.Recalculate();
+        for (int i = 0; i < length; i += 997) {
+            ASSERT_EQUAL(sheet.GetCell(pos(i))->GetValue(),
+                CellInterface::Value(static_cast<double>(i + 10)));
+        }
+    }
+
+    void TestParallelRecalculate() {
+        auto fill = [](Sheet& sheet) {
+            constexpr int rows = 3000;
+            for (int row = 0; row < rows; ++row) {
+                std::string n = std::to_string(row + 1);
+                sheet.SetCell(Position{ row, 0 }, std::to_string(row % 17));
+                sheet.SetCell(Position{ row, 1 }, "=A" + n + "*2");
+                sheet.SetCell(Position{ row, 2 }, "=B" + n + "/(A" + n + "-3)");
+                sheet.SetCell(Position{ row, 3 }, row == 0 ? "=C1" : "=C" + n + "+B" + std::to_string(row));
+            }
+        };
+
+        Sheet serial;
+        fill(serial);
+        serial.Recalculate();
+
+        Sheet parallel;
+        parallel.SetRecalculationThreads(4, 0);
+        fill(parallel);
+        parallel.Recalculate();
+
+        std::ostringstream serial_values;
+        serial.PrintValues(serial_values);
+        std::ostringstream parallel_values;
+        parallel.PrintValues(parallel_values);
+        ASSERT_EQUAL(serial_values.str(), parallel_values.str());
+
+        parallel.SetCell("A4"_pos, "5");
+        parallel.Recalculate();
+        ASSERT_EQUAL(parallel.GetCell("D4"_pos)->GetValue(), CellInterface::Value(10.0 / 2 + 4));
+
+        // levels and print rounds reuse the threads of the pool
+        parallel.SetPrintThreads(4);
+        const size_t thread_count = WorkerPool::Get().GetThreadCount();
+        ASSERT(thread_count >= std::min<size_t>(3, WorkerPool::GetMaxThreadCount()));
+        for (int i = 0; i < 20; ++i) {
+            parallel.SetCell("A1"_pos, std::to_string(i));
+            parallel.Recalculate();
+            std::ostringstream values;
+            parallel.PrintValues(values);
+        }
+        ASSERT_EQUAL(WorkerPool::Get().GetThreadCount(), thread_count);
+
+        // asking for more threads than the hardware runs starts no more
+        parallel.SetRecalculationThreads(512, 0);
+        parallel.SetCell("A1"_pos, "100");
+        parallel.Recalculate();
+        ASSERT(WorkerPool::Get().GetThreadCount() <= WorkerPool::GetMaxThreadCount());
+    }
+
+    void TestPublishedVersions() {
+        auto print = [](const auto& sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            sheet.PrintValues(out);
+            return out.str();
+        };
+
+        Sheet sheet;
+        ASSERT_EQUAL(sheet.GetPublished()->GetPrintableSize(), (Size{ 0, 0 }));
+        for (int row = 0; row < 200; ++row) {
+            const std::string n = std::to_string(row + 1);
+            sheet.SetCell({ row, 0 }, std::to_string(row % 7));
+            sheet.SetCell({ row, 70 }, "=A" + n + "*2");
+            sheet.SetCell({ row, 71 }, "=1/A" + n);
+        }
+        sheet.SetCell("B1"_pos, "'=text");
+        sheet.SetCell("B2"_pos, "=SUM(A1:A200)");
+        sheet.Publish();
+        const std::shared_ptr<const SheetVersion> first = sheet.GetPublished();
+        const std::string first_print = print(sheet);
+        ASSERT_EQUAL(print(*first), first_print);
+        ASSERT_EQUAL(first->GetPrintableSize(), sheet.GetPrintableSize());
+        ASSERT_EQUAL(first->GetCell("B1"_pos)->GetValue(), CellInterface::Value("=text"s));
+        ASSERT_EQUAL(first->GetCell("B2"_pos)->GetValue(), CellInterface::Value(594.0));
+        ASSERT_EQUAL(first->GetCell("BT2"_pos)->GetReferencedCells(), std::vector{ "A2"_pos });
+        ASSERT_EQUAL(first->GetCell("B2"_pos)->GetReferencedCells().size(), 200u);
+        ASSERT_EQUAL(first->GetCell("C3"_pos)->GetText(), "");
+        ASSERT(first->GetCell("A201"_pos) == nullptr);
+
+        // dependents of the edits change in the next version only
+        sheet.SetCell("A1"_pos, "10");
+        sheet.ClearCell("A200"_pos);
+        sheet.ClearCell("BS200"_pos);
+        sheet.ClearCell("BT200"_pos);
+        sheet.SetCell("C3"_pos, "=A1+1");
+        sheet.Publish();
+        const std::shared_ptr<const SheetVersion> second = sheet.GetPublished();
+        ASSERT_EQUAL(print(*second), print(sheet));
+        ASSERT_EQUAL(second->GetPrintableSize(), (Size{ 199, 72 }));
+        ASSERT_EQUAL(second->GetCell("BS1"_pos)->GetValue(), CellInterface::Value(20.0));
+        ASSERT_EQUAL(second->GetCell("C3"_pos)->GetValue(), CellInterface::Value(11.0));
+        ASSERT(second->GetRevision() > first->GetRevision());
+        ASSERT_EQUAL(print(*first), first_print);
+        ASSERT_EQUAL(first->GetCell("BT1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+
+        // cells in blocks of tiles far below, which go away again
+        sheet.SetCell({ 5000, 300 }, "=C3*2");
+        sheet.SetCell({ 1100, 0 }, "far");
+        sheet.Publish();
+        const std::shared_ptr<const SheetVersion> third = sheet.GetPublished();
+        ASSERT_EQUAL(print(*third), print(sheet));
+        ASSERT_EQUAL(third->GetCell({ 5000, 300 })->GetValue(), CellInterface::Value(22.0));
+        sheet.ClearCell({ 5000, 300 });
+        sheet.ClearCell({ 1100, 0 });
+        sheet.Publish();
+        ASSERT_EQUAL(print(*sheet.GetPublished()), print(sheet));
+        ASSERT_EQUAL(print(*second), print(*sheet.GetPublished()));
+        ASSERT_EQUAL(third->GetCell({ 1100, 0 })->GetText(), "far");
+
+        // a sheet read from a snapshot publishes all of its cells
+        std::ostringstream snapshot;
+        sheet.SaveSnapshot(snapshot);
+        const std::string data = snapshot.str();
+        std::unique_ptr<Sheet> copy = Sheet::ReadSnapshot(data);
+        copy->Publish();
+        ASSERT_EQUAL(print(*copy->GetPublished()), print(sheet));
+    }
+
+    void TestConcurrentReaders() {
+        // C1 = A1 + B1 and B1 = A1 + 1, so C1 is 2 * A1 + 1 in every version
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.SetCell("C1"_pos, "=A1+B1");
+        sheet.Publish();
+
+        constexpr int edits = 300;
+        std::atomic<bool> done = false;
+        std::atomic<int> failures = 0;
+        std::vector<std::thread> readers;
+        for (int i = 0; i < 3; ++i) {
+            readers.emplace_back([&]() {
+                Cell::Revision last_revision = 0;
+                while (!done) {
+                    const std::shared_ptr<const SheetVersion> version = sheet.GetPublished();
+                    const CellInterface::Value a = version->GetCell("A1"_pos)->GetValue();
+                    const double a_number = std::holds_alternative<double>(a) ? std::get<double>(a) : 0.0;
+                    std::ostringstream values;
+                    version->PrintValues(values);
+                    if (!(version->GetCell("C1"_pos)->GetValue() == CellInterface::Value(2 * a_number + 1))
+                        || version->GetRevision() < last_revision || values.str().empty()) {
+                        ++failures;
+                    }
+                    last_revision = version->GetRevision();
+                }
+            });
+        }
+        for (int i = 1; i <= edits; ++i) {
+            sheet.SetCell("A1"_pos, std::to_string(i));
+            sheet.SetCell({ i, 0 }, "=A" + std::to_string(i) + "+1");
+            sheet.Publish();
+        }
+        done = true;
+        for (std::thread& reader : readers) {
+            reader.join();
+        }
+        ASSERT_EQUAL(failures.load(), 0);
+        ASSERT_EQUAL(sheet.GetPublished()->GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0 * edits + 1));
+    }
+
+    void TestForks() {
+        auto print = [](const Sheet& sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            sheet.PrintValues(out);
+            return out.str();
+        };
+        auto copy = [](const Sheet& sheet) {
+            std::ostringstream snapshot;
+            sheet.SaveSnapshot(snapshot);
+            const std::string data = snapshot.str();
+            return Sheet::ReadSnapshot(data);
+        };
+
+        auto sheet = std::make_unique<Sheet>();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "=A1+1");
+        sheet->SetCell("A3"_pos, "=A2*10");
+        sheet->SetCell("B1"_pos, "=SUM(A1:A3)");
+        sheet->SetCell("B2"_pos, "=C5+1");
+        sheet->SetCell("C1"_pos, "1.50");
+        try {
+            Sheet::Fork(std::shared_ptr<const Sheet>(copy(*sheet)));
+            ASSERT(false);
+        }
+        catch (const std::invalid_argument&) {
+        }
+        const std::shared_ptr<const Sheet> base = Sheet::Freeze(std::move(sheet));
+        const std::string base_print = print(*base);
+
+        // forks see the base and their own edits, not each other's
+        std::unique_ptr<Sheet> first = Sheet::Fork(base);
+        std::unique_ptr<Sheet> second = Sheet::Fork(base);
+        ASSERT_EQUAL(print(*first), base_print);
+        first->SetCell("A1"_pos, "2");
+        first->SetCell("C5"_pos, "=C1*2");
+        second->ClearCell("A2"_pos);
+        second->SetCell("D4"_pos, "x");
+        ASSERT_EQUAL(first->GetCell("A3"_pos)->GetValue(), CellInterface::Value(30.0));
+        ASSERT_EQUAL(first->GetCell("B1"_pos)->GetValue(), CellInterface::Value(35.0));
+        ASSERT_EQUAL(first->GetCell("B2"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(first->GetPrintableSize(), (Size{ 5, 3 }));
+        ASSERT_EQUAL(second->GetCell("A3"_pos)->GetValue(), CellInterface::Value(0.0));
+        ASSERT_EQUAL(second->GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT_EQUAL(second->GetPrintableSize(), (Size{ 4, 4 }));
+        ASSERT_EQUAL(print(*base), base_print);
+        ASSERT_EQUAL(base->GetCell("A3"_pos)->GetValue(), CellInterface::Value(20.0));
+
+        // a frozen fork is forked again, and saved with its base's cells
+        const std::shared_ptr<const Sheet> frozen = Sheet::Freeze(std::move(first));
+        std::unique_ptr<Sheet> third = Sheet::Fork(frozen);
+        third->ClearCell("C1"_pos);
+        third->SetCell("A1"_pos, "=C1");
+        ASSERT_EQUAL(third->GetCell("C5"_pos)->GetValue(), CellInterface::Value(0.0));
+        ASSERT_EQUAL(third->GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.0));
+        ASSERT_EQUAL(print(*copy(*third)), print(*third));
+        ASSERT_EQUAL(frozen->GetCell("B1"_pos)->GetValue(), CellInterface::Value(35.0));
+        third->Publish();
+        ASSERT_EQUAL(third->GetPublished()->GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.0));
+
+        // random edits of forks on threads give what they give on copies
+        auto edit = [](Sheet& sheet, std::mt19937& random) {
+            auto pick = [&random](int count) {
+                return std::uniform_int_distribution<int>(0, count - 1)(random);
+            };
+            auto name = [&pick]() {
+                return Position{ pick(8), pick(5) }.ToString();
+            };
+            const Position pos{ pick(8), pick(5) };
+            try {
+                switch (pick(6)) {
+                    case 0:
+                        sheet.ClearCell(pos);
+                        break;
+                    case 1:
+                        sheet.SetCell(pos, std::to_string(pick(100)));
+                        break;
+                    case 2:
+                        sheet.SetCell(pos, pick(2) ? "text" : "0.50");
+                        break;
+                    case 3:
+                        sheet.SetCell(pos, "=SUM(" + name() + ":" + name() + ")");
+                        break;
+                    default:
+                        sheet.SetCell(pos, "=" + name() + "+" + name());
+                }
+            }
+            catch (const CircularDependencyException&) {
+            }
+        };
+        std::mt19937 random(22);
+        auto model = std::make_unique<Sheet>();
+        for (int i = 0; i < 60; ++i) {
+            edit(*model, random);
+        }
+        const std::shared_ptr<const Sheet> model_base = Sheet::Freeze(std::move(model));
+        const std::string model_print = print(*model_base);
+        std::atomic<int> failures = 0;
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 3; ++i) {
+            threads.emplace_back([&, i]() {
+                std::mt19937 thread_random(i);
+                std::unique_ptr<Sheet> fork = Sheet::Fork(model_base);
+                std::unique_ptr<Sheet> expected = copy(*model_base);
+                for (int j = 0; j < 200; ++j) {
+                    std::mt19937 fork_random = thread_random;
+                    edit(*fork, fork_random);
+                    edit(*expected, thread_random);
+                    if (j % 50 == 49) {
+                        fork = Sheet::Fork(Sheet::Freeze(std::move(fork)));
+                    }
+                    if (print(*fork) != print(*expected) || !(fork->GetPrintableSize() == expected->GetPrintableSize())) {
+                        ++failures;
+                    }
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        ASSERT_EQUAL(failures.load(), 0);
+        ASSERT_EQUAL(print(*model_base), model_print);
+    }
+
+    void TestSheetHistory() {
+        SheetHistory history;
+        ASSERT(!history.Undo());
+        history.GetSheet().SetCell("A1"_pos, "1");
+        history.GetSheet().SetCell("A2"_pos, "=A1*2");
+        history.Checkpoint();
+        history.GetSheet().SetCell("A1"_pos, "5");
+        history.Checkpoint();
+        history.GetSheet().ClearCell("A2"_pos);
+        ASSERT(!history.Redo());
+
+        // edits since the last checkpoint are dropped first
+        ASSERT(history.Undo());
+        ASSERT_EQUAL(history.GetSheet().GetCell("A2"_pos)->GetValue(), CellInterface::Value(10.0));
+        ASSERT(history.Undo());
+        ASSERT_EQUAL(history.GetSheet().GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT(history.Undo());
+        ASSERT_EQUAL(history.GetSheet().GetPrintableSize(), (Size{ 0, 0 }));
+        ASSERT(!history.Undo());
+        ASSERT(history.Redo());
+        ASSERT(history.Redo());
+        ASSERT_EQUAL(history.GetSheet().GetCell("A2"_pos)->GetValue(), CellInterface::Value(10.0));
+        ASSERT(!history.Redo());
+
+        // a checkpoint after an undo drops the checkpoints undone
+        ASSERT(history.Undo());
+        history.GetSheet().SetCell("B1"_pos, "=A2+1");
+        history.Checkpoint();
+        ASSERT(!history.Redo());
+        ASSERT_EQUAL(history.GetSheet().GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+        ASSERT(history.Undo());
+        ASSERT(history.GetSheet().GetCell("B1"_pos) == nullptr);
+
+        // edits rejected or changing nothing aren't changes: no checkpoint
+        // is taken for them and the one undone can still be redone
+        try {
+            history.GetSheet().SetCell("F6"_pos, "=A1+");
+            ASSERT(false);
+        }
+        catch (const FormulaException&) {
+        }
+        history.GetSheet().ClearCell("F6"_pos);
+        history.Checkpoint();
+        ASSERT(history.Redo());
+        ASSERT_EQUAL(history.GetSheet().GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+        ASSERT(history.Undo());
+
+        // many checkpoints keep the chain of forks short
+        constexpr int checkpoints = 500;
+        auto edit = [](Sheet& sheet, int i) {
+            sheet.SetCell({ i % 50, 0 }, std::to_string(i));
+            sheet.SetCell({ i, 1 }, "=A" + std::to_string(i % 50 + 1) + "+SUM(A1:A50)");
+            if (i % 7 == 0) {
+                sheet.ClearCell({ (i + 13) % 50, 0 });
+            }
+        };
+        auto print = [](const Sheet& sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            sheet.PrintValues(out);
+            return out.str();
+        };
+        SheetHistory long_history;
+        Sheet expected;
+        for (int i = 0; i < checkpoints; ++i) {
+            edit(long_history.GetSheet(), i);
+            long_history.Checkpoint();
+            ASSERT(long_history.GetSheet().GetForkDepth() <= Sheet::MAX_FORK_DEPTH + 1);
+            if (i + 1 < checkpoints) {
+                edit(expected, i);
+            }
+        }
+        long_history.GetSheet().SetCell("A1"_pos, "1000");
+        ASSERT(long_history.Undo());
+        ASSERT(long_history.Undo());
+        ASSERT_EQUAL(print(long_history.GetSheet()), print(expected));
+        ASSERT(long_history.Redo());
+        edit(expected, checkpoints - 1);
+        ASSERT_EQUAL(print(long_history.GetSheet()), print(expected));
+    }
+
     void TestEmptyCellTreatedAsZero() {
         auto sheet = CreateSheet();
         sheet->SetCell("A1"_pos, "=B2");
         ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
     }
 
+    void TestAggregateFunctions() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "2.50");
+        sheet->SetCell("A3"_pos, "text");
+        sheet->SetCell("B1"_pos, "=A1*4");
+        sheet->SetCell("B3"_pos, "'7");
+        auto evaluate = [&](Position pos, std::string expr) {
+            sheet->SetCell(pos, std::move(expr));
+            return sheet->GetCell(pos)->GetValue();
+        };
+
+        ASSERT_EQUAL(evaluate("C1"_pos, "=SUM(A1:B3)"), CellInterface::Value(7.5));
+        ASSERT_EQUAL(evaluate("C2"_pos, "=COUNT(B3:A1)"), CellInterface::Value(3.0));
+        ASSERT_EQUAL(evaluate("C3"_pos, "=MIN(A1:B3, 0.5)"), CellInterface::Value(0.5));
+        ASSERT_EQUAL(evaluate("C4"_pos, "=MAX(A1:A3) + AVERAGE(A1, B1, 4)"), CellInterface::Value(5.5));
+        ASSERT_EQUAL(evaluate("C5"_pos, "=SUM(A3)"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(evaluate("C6"_pos, "=MAX(D1:D9)"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(evaluate("C7"_pos, "=AVERAGE(D1:D9)"), CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(evaluate("C8"_pos, "=SUM(A3+1)"), CellInterface::Value(FormulaError::Category::Value));
+
+        sheet->SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(12.5));
+        sheet->SetCell("A3"_pos, "=1/0");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+
+        ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetText(), "=COUNT(A1:B3)");
+        ASSERT_EQUAL(sheet->GetCell("C4"_pos)->GetText(), "=MAX(A1:A3)+AVERAGE(A1,B1,4)");
+        ASSERT((sheet->GetCell("C3"_pos)->GetReferencedCells()
+            == std::vector{ "A1"_pos, "B1"_pos, "A2"_pos, "B2"_pos, "A3"_pos, "B3"_pos }));
+        ASSERT_EQUAL(ParseFormula("SUM((1+2)*3,A1:A1,-MIN(B2))")->GetExpression(), "SUM((1+2)*3,A1,-MIN(B2))");
+
+        auto is_incorrect = [&](std::string expr) {
+            try {
+                sheet->SetCell("E1"_pos, std::move(expr));
+            }
+            catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(is_incorrect("=SUM()"));
+        ASSERT(is_incorrect("=SQRT(A1)"));
+        ASSERT(is_incorrect("=A1:A2"));
+        ASSERT(is_incorrect("=SUM(A1:)"));
+        ASSERT(is_incorrect("=SUM(A1:XFD1048577)"));
+
+        try {
+            sheet->SetCell("A2"_pos, "=SUM(C1:C3)");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+    }
+
+    void TestAggregateLongColumn() {
+        Sheet sheet;
+        constexpr int size = 10000;
+        for (int row = 0; row < size; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string(row % 2 ? row : -row));
+            if (row % 3 == 0) {
+                sheet.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*2");
+            }
+        }
+
+        for (Range range : { Range{ { 0, 0 }, { size - 1, 1 } }, Range{ { 5, 0 }, { 8190, 0 } },
+                 Range{ { 4097, 1 }, { 4098, 1 } } }) {
+            const RangeStats stats = sheet.GetRangeStats(range);
+            const RangeStats expected = sheet.SheetInterface::GetRangeStats(range);
+            ASSERT_EQUAL(stats.sum, expected.sum);
+            ASSERT_EQUAL(stats.min, expected.min);
+            ASSERT_EQUAL(stats.max, expected.max);
+            ASSERT_EQUAL(stats.count, expected.count);
+        }
+
+        sheet.SetCell("C1"_pos, "=SUM(A1:A10000)/COUNT(A1:A10000)");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.5));
+    }
+
+    void TestLargeRanges() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=SUM(B1:XFD1048576)");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+        // cells of the range aren't created
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1, 1 }));
+
+        sheet->SetCell("B50000"_pos, "5");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+        sheet->SetCell("ZZ99999"_pos, "=B50000*2");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(15.0));
+        sheet->SetCell("B50000"_pos, "1");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+        try {
+            sheet->SetCell("B50000"_pos, "=A1");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        try {
+            sheet->SetCell("A2"_pos, "=MAX(A1, B2)");
+            sheet->SetCell("C3"_pos, "=COUNT(A2:A3)");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+
+        sheet->ClearCell("B50000"_pos);
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+        sheet->SetCell("A1"_pos, "=SUM(B1:B2)");
+        sheet->SetCell("ZZ99999"_pos, "7");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+        sheet->SetCell("B2"_pos, "=ZZ99999");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(7.0));
+    }
+
+    void TestRelativeFormulas() {
+        Sheet sheet;
+        constexpr int size = 1000;
+        sheet.SetCell("B1"_pos, "=A1");
+        for (int row = 0; row < size; ++row) {
+            const std::string number = std::to_string(row + 1);
+            sheet.SetCell({ row, 0 }, number);
+            if (row > 0) {
+                sheet.SetCell({ row, 1 }, "=A" + number + " * 2 + B" + std::to_string(row));
+            }
+        }
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A2*2+B1");
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(5.0));
+        ASSERT_EQUAL(sheet.GetCell("B1000"_pos)->GetText(), "=A1000*2+B999");
+        ASSERT_EQUAL(sheet.GetCell("B1000"_pos)->GetValue(), CellInterface::Value(1000.0 * 1001 - 1));
+        ASSERT_EQUAL(sheet.GetCell("B1000"_pos)->GetReferencedCells(), (std::vector{ "B999"_pos, "A1000"_pos }));
+
+        sheet.SetCell("A999"_pos, "0");
+        ASSERT_EQUAL(sheet.GetCell("B1000"_pos)->GetValue(), CellInterface::Value(1000.0 * 1001 - 1 - 2 * 999));
+
+        FormulaInterner& formulas = sheet.GetFormulas();
+        const auto c2 = formulas.Intern("A2 + SUM(B1:B3)", "C2"_pos);
+        ASSERT(c2 == formulas.Intern("A3+SUM(B2:B4)", "C3"_pos));
+        ASSERT(c2 != formulas.Intern("A3+SUM(B2:B4)", "C2"_pos));
+        ASSERT_EQUAL(ToRelativeForm("A3 + SUM(B2:B4)", "C3"_pos), "R[0]C[-2]+SUM(R[-1]C[-1]:R[1]C[-1])");
+
+        std::ostringstream text;
+        c2->PrintFormula(text, "XFD1000"_pos);
+        ASSERT_EQUAL(text.str(), "XFB1000+SUM(XFC999:XFC1001)");
+        try {
+            formulas.Intern("XFD1+1", "A2"_pos);
+            formulas.Intern("XFE2+1", "B3"_pos);
+            ASSERT(false);
+        }
+        catch (const FormulaException&) {
+        }
+    }
+
+    void TestFormulaCache() {
+        Sheet sheet;
+        FormulaInterner& formulas = sheet.GetFormulas();
+        sheet.SetCell("A1"_pos, "=B1+1");
+        ASSERT_EQUAL(formulas.GetMisses(), 1u);
+
+        // the formula is kept while it is recent
+        sheet.ClearCell("A1"_pos);
+        sheet.SetCell("A1"_pos, "=B1 + 1");
+        sheet.SetCell("A2"_pos, "=B2+1");
+        ASSERT_EQUAL(formulas.GetHits(), 2u);
+        ASSERT_EQUAL(formulas.GetMisses(), 1u);
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=B2+1");
+
+        formulas.ResetCounters();
+        formulas.SetCapacity(1);
+        sheet.SetCell("C1"_pos, "=1/2");
+        sheet.ClearCell("A1"_pos);
+        sheet.ClearCell("A2"_pos);
+        sheet.SetCell("A1"_pos, "=B1+1");
+        sheet.SetCell("C1"_pos, "=1/2");
+        ASSERT_EQUAL(formulas.GetHits(), 1u);
+        ASSERT_EQUAL(formulas.GetMisses(), 2u);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+        formulas.SetCapacity(0);
+        sheet.ClearCell("A1"_pos);
+        sheet.SetCell("A1"_pos, "=B1+1");
+        ASSERT_EQUAL(formulas.GetMisses(), 3u);
+    }
+
+    void TestSheetStats() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.SetCell("C1"_pos, "=B1*2");
+        // the formula of C1 one column to the right
+        sheet.SetCell("D1"_pos, "=C1*2");
+        SheetStats stats = sheet.GetStats();
+        ASSERT_EQUAL(stats.formulas_parsed, 2u);
+        ASSERT_EQUAL(stats.cycle_check_nodes, 3u);
+        ASSERT_EQUAL(stats.evaluations, 0u);
+        ASSERT(stats.storage_bytes > 0);
+
+        // evaluating C1 and D1 reads B1 and C1 up to date
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(8.0));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(8.0));
+        stats = sheet.GetStats();
+        ASSERT_EQUAL(stats.evaluations, 3u);
+        ASSERT_EQUAL(stats.cache_hits, 3u);
+
+        sheet.SetCell("A1"_pos, "2");
+        std::ostringstream output;
+        sheet.PrintValues(output);
+        stats = sheet.GetStats();
+        ASSERT_EQUAL(stats.cells_invalidated, 3u);
+        ASSERT_EQUAL(stats.evaluations, 6u);
+        ASSERT_EQUAL(stats.cache_hits, 8u);
+
+        sheet.ResetStats();
+        stats = sheet.GetStats();
+        ASSERT_EQUAL(stats.formulas_parsed, 0u);
+        ASSERT_EQUAL(stats.parse_ns, 0u);
+        ASSERT_EQUAL(stats.cache_hits, 0u);
+        ASSERT_EQUAL(stats.evaluations, 0u);
+        ASSERT_EQUAL(stats.cells_invalidated, 0u);
+        ASSERT_EQUAL(stats.cycle_check_nodes, 0u);
+        ASSERT(stats.storage_bytes > 0);
+
+        // formulas compiled by an import count once per relative form,
+        // those evaluated on other threads count too
+        constexpr int rows = 5000;
+        std::string table = "1\n";
+        for (int row = 1; row < rows; ++row) {
+            table += "=A1+" + std::to_string(row) + "\n";
+        }
+        Sheet imported;
+        imported.ImportTexts(table);
+        imported.SetRecalculationThreads(4, 1);
+        imported.Recalculate();
+        stats = imported.GetStats();
+        ASSERT_EQUAL(stats.formulas_parsed, static_cast<std::uint64_t>(rows - 1));
+        ASSERT_EQUAL(stats.evaluations, static_cast<std::uint64_t>(rows - 1));
+
+        // threads that exit leave their counts, not their blocks
+        StatCounters counters;
+        constexpr int threads = 100;
+        for (int i = 0; i < threads; ++i) {
+            std::thread([&counters]() {
+                counters.Add(StatCounters::CACHE_HITS, 2);
+            }).join();
+        }
+        counters.Add(StatCounters::CACHE_HITS);
+        ASSERT_EQUAL(counters.Get().cache_hits, static_cast<std::uint64_t>(2 * threads + 1));
+        ASSERT_EQUAL(counters.GetBlockCount(), 1u);
+    }
+
+    void TestDependentsAfterManyEdits() {
+        // enough edits for the dependency graph to be rebuilt several
+        // times, values read in between rely on what it invalidates
+        auto print = [](const Sheet& sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            sheet.PrintValues(out);
+            return out.str();
+        };
+        constexpr int rows = 60;
+        constexpr int cols = 8;
+        std::mt19937 random(25);
+        auto pick = [&random](int count) {
+            return std::uniform_int_distribution<int>(0, count - 1)(random);
+        };
+
+        Sheet sheet;
+        for (int edit = 0; edit < 30000; ++edit) {
+            const Position pos{ pick(rows), pick(cols) };
+            const int kind = pick(4);
+            if (kind == 0) {
+                sheet.ClearCell(pos);
+            }
+            else if (kind == 1 || pos.row == 0) {
+                sheet.SetCell(pos, std::to_string(pick(100)));
+            }
+            else {
+                // formulas refer to rows above, so there are no cycles
+                std::string text = "=1";
+                for (int i = pick(3); i >= 0; --i) {
+                    text += "+" + Position{ pick(pos.row), pick(cols) }.ToString();
+                }
+                sheet.SetCell(pos, text);
+            }
+            if (edit % 64 == 0) {
+                sheet.GetCell({ pick(rows), pick(cols) });
+                sheet.RecalculateCell({ pick(rows), pick(cols) });
+            }
+        }
+
+        Sheet fresh;
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                if (const CellInterface* cell = sheet.GetCell({ row, col }); cell && !cell->GetText().empty()) {
+                    fresh.SetCell({ row, col }, cell->GetText());
+                }
+            }
+        }
+        ASSERT_EQUAL(print(sheet), print(fresh));
+
+        // the graph of a snapshot and of a fork are the same
+        std::ostringstream snapshot;
+        sheet.SaveSnapshot(snapshot);
+        const std::string data = snapshot.str();
+        std::unique_ptr<Sheet> copy = Sheet::ReadSnapshot(data);
+        std::unique_ptr<Sheet> fork = Sheet::Fork(Sheet::Freeze(Sheet::ReadSnapshot(data)));
+        for (int col = 0; col < cols; ++col) {
+            const Position pos{ 0, col };
+            fresh.SetCell(pos, "1000");
+            copy->SetCell(pos, "1000");
+            fork->SetCell(pos, "1000");
+        }
+        ASSERT_EQUAL(print(*copy), print(fresh));
+        ASSERT_EQUAL(print(*fork), print(fresh));
+    }
+
+    void TestSetCells() {
+        Sheet sheet;
+        sheet.SetCells({ { "A1"_pos, "=A2+1" }, { "A2"_pos, "=A3+1" }, { "A3"_pos, "4" }, { "A3"_pos, "5" } });
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(7.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 3, 1 }));
+
+        sheet.SetCell("B1"_pos, "=C1");
+        sheet.SetCell("D1"_pos, "=SUM(E1:E10)");
+        auto is_rejected = [&sheet](std::vector<std::pair<Position, std::string>> cells) {
+            const Size size = sheet.GetPrintableSize();
+            try {
+                sheet.SetCells(std::move(cells));
+            }
+            catch (const CircularDependencyException&) {
+            }
+            catch (const FormulaException&) {
+            }
+            catch (const InvalidPositionException&) {
+            }
+            return sheet.GetPrintableSize() == size && sheet.GetCell("A1"_pos)->GetValue() == CellInterface::Value(7.0);
+        };
+        ASSERT(is_rejected({ { "A3"_pos, "1" }, { "C1"_pos, "=B1" } }));
+        ASSERT(is_rejected({ { "A3"_pos, "1" }, { "E5"_pos, "=D1" } }));
+        ASSERT(is_rejected({ { "A3"_pos, "1" }, { "E5"_pos, "=F1" }, { "F1"_pos, "=MAX(E1:E9)" } }));
+        ASSERT(is_rejected({ { "A3"_pos, "1" }, { "G1"_pos, "=1+" } }));
+        ASSERT(is_rejected({ { "A3"_pos, "1" }, { Position{ -1, 0 }, "1" } }));
+
+        // the batch replaces the formulas the cycle would go through
+        sheet.SetCells({ { "B1"_pos, "1" }, { "C1"_pos, "=B1" }, { "D1"_pos, "2" }, { "E5"_pos, "=D1+C1" } });
+        ASSERT_EQUAL(sheet.GetCell("E5"_pos)->GetValue(), CellInterface::Value(3.0));
+        sheet.SetCells({ { "A3"_pos, "0" }, { "E1"_pos, "=SUM(E2:E9)" } });
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(3.0));
+    }
+
+    void TestSetCellsLongChain() {
+        // every cell refers to the next one, so one by one each SetCell
+        // would walk all the cells set before
+        constexpr int size = 100000;
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < size - 1; ++row) {
+            cells.push_back({ { row, 0 }, "=A" + std::to_string(row + 2) + "+1" });
+        }
+        cells.push_back({ { size - 1, 0 }, "1" });
+
+        Sheet sheet;
+        sheet.SetCells(cells);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(double(size)));
+
+        cells.push_back({ { size - 1, 0 }, "=A1" });
+        try {
+            sheet.SetCells(std::move(cells));
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(double(size)));
+    }
+
+    void TestImportTexts() {
+        Sheet sheet;
+        sheet.ImportTexts("1\t=A1+B2\t\ttext\r\n1e3\t2\r\n\t\t'=A1\t=\r\n");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 3, 4 }));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "1e3");
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(1000.0));
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value("=A1"s));
+        ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetText(), "=");
+        ASSERT(sheet.GetCell("C1"_pos) == nullptr || sheet.GetCell("C1"_pos)->GetText().empty());
+
+        // fields aren't quoted, commas of functions would split them
+        sheet.ImportTexts("\t\t=SUM(A1,B1)");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=SUM(A1,B1)");
+        for (char delimiter : { ',', ';', '\n', '=' }) {
+            try {
+                sheet.ImportTexts("1", delimiter);
+                ASSERT(false);
+            }
+            catch (const std::invalid_argument&) {
+            }
+        }
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=SUM(A1,B1)");
+
+        // several chunks, read on several threads
+        constexpr int rows = 100000;
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < rows; ++row) {
+            const std::string n = std::to_string(row + 1);
+            cells.push_back({ { row, 0 }, n });
+            cells.push_back({ { row, 1 }, "=A" + n + "*2+SUM(A" + n + ":A" + std::to_string(row + 2) + ")" });
+            cells.push_back({ { row, 2 }, "cell " + n });
+        }
+        Sheet source;
+        source.SetCells(std::move(cells));
+        std::ostringstream texts;
+        source.PrintTexts(texts);
+        ASSERT(texts.str().size() > 2 * TextImport::CHUNK_SIZE);
+
+        Sheet copy;
+        copy.ImportTexts(texts.str(), '\t', 4);
+        ASSERT_EQUAL(copy.GetFormulas().GetSize(), 1u);
+        std::ostringstream copy_texts;
+        copy.PrintTexts(copy_texts);
+        ASSERT(copy_texts.str() == texts.str());
+        std::ostringstream values;
+        std::ostringstream copy_values;
+        source.PrintValues(values);
+        copy.PrintValues(copy_values);
+        ASSERT(copy_values.str() == values.str());
+
+        // the first error is thrown, nothing is set
+        try {
+            copy.ImportTexts(texts.str() + "1\t=A1+\n=)\n", '\t', 4);
+            ASSERT(false);
+        }
+        catch (const FormulaException&) {
+        }
+        try {
+            copy.ImportTexts("1\t=C1\t=B1", '\t', 4);
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(copy.GetPrintableSize(), (Size{ rows, 3 }));
+        ASSERT_EQUAL(copy.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+    }
+
+    void TestLoadTexts() {
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_load_texts.tsv").string();
+        {
+            std::ofstream out(path, std::ios::binary);
+            out << "1\t=A1/2\n\ttext\n";
+        }
+        Sheet sheet;
+        sheet.LoadTexts(path);
+        std::filesystem::remove(path);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.5));
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "text");
+
+        try {
+            sheet.LoadTexts(path);
+            ASSERT(false);
+        }
+        catch (const std::system_error&) {
+        }
+    }
+
+    void TestSnapshot() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1.5");
+        sheet.SetCell("A2"_pos, "1e3");
+        sheet.SetCell("A3"_pos, "'12");
+        sheet.SetCell("A4"_pos, "text");
+        for (int row = 0; row < 4; ++row) {
+            sheet.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*2");
+        }
+        sheet.SetCell("C1"_pos, "=SUM(A1:B3)+D1");
+        sheet.SetCell("C2"_pos, "=1/0");
+        sheet.SetCell("C3"_pos, "=E9");
+        // cleared, C3 still refers to it
+        sheet.SetCell("E9"_pos, "5");
+        sheet.ClearCell("E9"_pos);
+        sheet.SetCell("D1"_pos, "2");
+        sheet.GetCell("C3"_pos)->GetValue();
+        // C1 stays outdated, B4 has an error
+
+        std::ostringstream snapshot;
+        sheet.SaveSnapshot(snapshot);
+        const std::string data = snapshot.str();
+        std::unique_ptr<Sheet> copy = Sheet::ReadSnapshot(data);
+        ASSERT_EQUAL(copy->GetPrintableSize(), sheet.GetPrintableSize());
+        ASSERT_EQUAL(copy->GetFormulas().GetSize(), 4u);
+
+        auto print = [](const Sheet& sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            sheet.PrintValues(out);
+            return out.str();
+        };
+        ASSERT_EQUAL(print(*copy), print(sheet));
+
+        // dependencies are restored along with the cells
+        copy->SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(copy->GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+        copy->SetCell("E9"_pos, "7");
+        ASSERT_EQUAL(copy->GetCell("C3"_pos)->GetValue(), CellInterface::Value(7.0));
+        copy->SetCell("A3"_pos, "4");
+        ASSERT_EQUAL(copy->GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0 + 1000 + 4 + 6 + 2000 + 8 + 2));
+        try {
+            copy->SetCell("D1"_pos, "=C1");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+
+        // from a file
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_snapshot.bin").string();
+        {
+            std::ofstream out(path, std::ios::binary);
+            sheet.SaveSnapshot(out);
+        }
+        std::unique_ptr<Sheet> loaded = Sheet::LoadSnapshot(path);
+        std::filesystem::remove(path);
+        ASSERT_EQUAL(print(*loaded), print(sheet));
+
+        auto is_rejected = [](std::string data) {
+            try {
+                Sheet::ReadSnapshot(data);
+            }
+            catch (const Snapshot::Error&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(is_rejected(data.substr(0, data.size() - 1)));
+        ASSERT(is_rejected(data.substr(0, 16)));
+        ASSERT(is_rejected("X" + data.substr(1)));
+
+        // A2 given the formula of B2 refers to A1, which refers to it
+        Sheet pair;
+        pair.SetCell("A1"_pos, "=A2");
+        pair.SetCell("A2"_pos, "=A3");
+        pair.SetCell("B2"_pos, "=B1");
+        std::ostringstream pair_snapshot;
+        pair.SaveSnapshot(pair_snapshot);
+        std::string cyclic = pair_snapshot.str();
+        const Snapshot::View view = Snapshot::Open(cyclic);
+        auto find_record = [&view](Position pos) {
+            return std::find_if(view.cells, view.cells + view.header->cells.count, [pos](const auto& record) {
+                return record.row == pos.row && record.col == pos.col;
+            });
+        };
+        const std::uint64_t formula = find_record("B2"_pos)->formula;
+        const size_t offset = reinterpret_cast<const char*>(&find_record("A2"_pos)->formula) - cyclic.data();
+        cyclic.replace(offset, sizeof(formula), reinterpret_cast<const char*>(&formula), sizeof(formula));
+        ASSERT(!is_rejected(pair_snapshot.str()));
+        ASSERT(is_rejected(cyclic));
+
+        // A3 listing B2 rather than A2 as the formula referring to it
+        std::string misled = pair_snapshot.str();
+        size_t child_count = 0;
+        for (size_t i = 0; i < view.header->cells.count; ++i) {
+            child_count += view.cells[i].child_count;
+        }
+        const Snapshot::PositionRecord* child = std::find_if(view.children, view.children + child_count,
+            [](const auto& record) {
+                return record.row == 1 && record.col == 0;
+            });
+        ASSERT(child != view.children + child_count);
+        const Snapshot::PositionRecord b2{ 1, 1 };
+        const size_t child_offset = reinterpret_cast<const char*>(child) - cyclic.data();
+        misled.replace(child_offset, sizeof(b2), reinterpret_cast<const char*>(&b2), sizeof(b2));
+        ASSERT(is_rejected(misled));
+    }
+
     void TestFormulaInvalidPosition() {
         auto sheet = CreateSheet();
         auto try_formula = [&](const std::string& formula) {
@@ -270,9 +1447,9 @@ namespace {
 
         try_formula("=X0");
         try_formula("=ABCD1");
-        try_formula("=A123456");
+        try_formula("=A1234567");
         try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
-        try_formula("=XFD16385");
+        try_formula("=XFD1048577");
         try_formula("=XFE16384");
         try_formula("=R2D2");
     }
@@ -333,8 +1510,125 @@ namespace {
         ASSERT(isIncorrect("A0++"));
         ASSERT(isIncorrect("((1)"));
         ASSERT(isIncorrect("2+4-"));
+        ASSERT(isIncorrect(""));
+        ASSERT(isIncorrect("1."));
+        ASSERT(isIncorrect("."));
+        ASSERT(isIncorrect("1e"));
+        ASSERT(isIncorrect("1e+"));
+        ASSERT(isIncorrect("1.5.2"));
+        ASSERT(isIncorrect("a1"));
+        ASSERT(isIncorrect("SUM"));
+        ASSERT(isIncorrect("SUM1(A1)"));
+        ASSERT(isIncorrect("SUM(A1 B2)"));
+        ASSERT(isIncorrect("SUM(A1:B2+1)"));
+        ASSERT(isIncorrect("1e400"));
+        ASSERT(isIncorrect("A1:B2"));
+        ASSERT(isIncorrect("1 2"));
+    }
+
+    void TestFormulaParsing() {
+        auto expression = [](std::string text) {
+            return ParseFormula(std::move(text))->GetExpression();
+        };
+
+        ASSERT_EQUAL(expression("-1*2"), "-1*2");
+        ASSERT_EQUAL(expression("-(1+2)"), "-(1+2)");
+        ASSERT_EQUAL(expression("1-(2-3)"), "1-(2-3)");
+        ASSERT_EQUAL(expression("(1-2)-3"), "1-2-3");
+        ASSERT_EQUAL(expression("1/(2*3)"), "1/(2*3)");
+        ASSERT_EQUAL(expression("--+1"), "--+1");
+        ASSERT_EQUAL(expression(" \t1 +\r\n2 "), "1+2");
+        ASSERT_EQUAL(expression(".5e1+1E-1+2e+1"), "5+0.1+20");
+        ASSERT_EQUAL(expression("1e-400"), "0");
+        ASSERT_EQUAL(expression("MAX( B2 : A1 , (A1) , -SUM(C3) )"), "MAX(A1:B2,A1,-SUM(C3))");
+
+        ASSERT_EQUAL(std::get<double>(ParseFormula("-1*2+3")->Evaluate(*CreateSheet())), 1.0);
+        ASSERT_EQUAL(std::get<double>(ParseFormula("8/4/2")->Evaluate(*CreateSheet())), 1.0);
+    }
+
+#ifdef SPREADSHEET_ANTLR_ORACLE
+    // Everything the parse gave, numbers bit for bit, or the kind of error
+    std::string DescribeParse(std::string_view text, bool with_antlr) {
+        try {
+            std::istringstream in{ std::string(text) };
+            const FormulaAST ast = with_antlr ? ParseFormulaASTWithAntlr(in) : ParseFormulaAST(in);
+
+            std::ostringstream out;
+            out << std::hexfloat;
+            for (const ASTImpl::Instruction& instr : ast.GetProgram()) {
+                out << static_cast<int>(instr.code) << ' ' << instr.cols << ' ' << instr.count << ' ';
+                if (instr.code == ASTImpl::OpCode::PushNumber) {
+                    out << instr.operand.number;
+                }
+                else if (instr.code == ASTImpl::OpCode::LoadCell || instr.code == ASTImpl::OpCode::LoadRange) {
+                    out << instr.operand.cell.ToString();
+                }
+                out << ';';
+            }
+            out << '|';
+            ast.PrintCells(out);
+            return out.str();
+        }
+        catch (const FormulaException&) {
+            return "invalid position";
+        }
+        catch (...) {
+            return "error";
+        }
+    }
+
+    std::string GenerateFormula(std::mt19937& random, int depth) {
+        auto pick = [&random](int count) {
+            return std::uniform_int_distribution<int>(0, count - 1)(random);
+        };
+        static const char* const atoms[] = { "1", "0.5", ".25", "3e2", "1E-3", "7e+1", "1e-400",
+                                             "A1", "B22", "ZZ9", "XFD1048576", "XFE1" };
+        static const char* const functions[] = { "SUM", "AVERAGE", "MIN", "MAX", "COUNT", "FOO" };
+
+        switch (depth <= 0 ? 0 : pick(5)) {
+            case 0:
+                return atoms[pick(std::size(atoms))];
+            case 1:
+                return "(" + GenerateFormula(random, depth - 1) + ")";
+            case 2:
+                return (pick(2) ? "-" : "+") + GenerateFormula(random, depth - 1);
+            case 3:
+                return GenerateFormula(random, depth - 1) + "+-*/"[pick(4)] + GenerateFormula(random, depth - 1);
+            default: {
+                std::string call = std::string(functions[pick(std::size(functions))]) + "(";
+                for (int arg = pick(3); arg >= 0; --arg) {
+                    call += pick(3) ? GenerateFormula(random, depth - 1) : "B2:A1";
+                    call += arg ? "," : ")";
+                }
+                return call;
+            }
+        }
     }
 
+    void TestFormulaParserMatchesAntlr() {
+        std::mt19937 random(42);
+        const std::string noise = "()+-*/:,.eE1Az ";
+        for (int i = 0; i < 20000; ++i) {
+            std::string text = GenerateFormula(random, 4);
+            // every other formula gets a typo
+            if (i % 2) {
+                const size_t at = random() % (text.size() + 1);
+                switch (random() % 3) {
+                    case 0:
+                        text.insert(at, 1, noise[random() % noise.size()]);
+                        break;
+                    case 1:
+                        text.erase(std::min(at, text.size() - 1), 1);
+                        break;
+                    default:
+                        text.replace(std::min(at, text.size() - 1), 1, 1, noise[random() % noise.size()]);
+                }
+            }
+            ASSERT_EQUAL(DescribeParse(text, false), DescribeParse(text, true));
+        }
+    }
+#endif
+
     void TestCellCircularReferences() {
         auto sheet = CreateSheet();
         sheet->SetCell("E2"_pos, "=E4");
@@ -354,6 +1648,80 @@ namespace {
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
     }
 
+    void TestCircularReferencesAfterOverwrite() {
+        auto sheet = CreateSheet();
+        auto is_circular = [&](Position pos, std::string text) {
+            try {
+                sheet->SetCell(pos, std::move(text));
+            }
+            catch (const CircularDependencyException&) {
+                return true;
+            }
+            return false;
+        };
+
+        sheet->SetCell("B1"_pos, "=A1");
+        sheet->SetCell("A1"_pos, "5");
+        ASSERT(is_circular("A1"_pos, "=B1"));
+
+        sheet->ClearCell("A1"_pos);
+        ASSERT(is_circular("A1"_pos, "=B1"));
+
+        sheet->SetCell("B1"_pos, "7");
+        ASSERT(!is_circular("A1"_pos, "=B1"));
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(7.0));
+    }
+
+    void TestCircularReferencesInDiamonds() {
+        // every level doubles the number of paths from the bottom to the top
+        auto sheet = CreateSheet();
+        constexpr int depth = 60;
+        sheet->SetCell("B1"_pos, "=A1");
+        sheet->SetCell("C1"_pos, "=A1");
+        for (int row = 1; row < depth; ++row) {
+            std::string prev = std::to_string(row);
+            std::string cur = std::to_string(row + 1);
+            sheet->SetCell(Position{ row, 0 }, "=B" + prev + "+C" + prev);
+            sheet->SetCell(Position{ row, 1 }, "=A" + cur);
+            sheet->SetCell(Position{ row, 2 }, "=A" + cur);
+        }
+        sheet->SetCell("D1"_pos, "=A" + std::to_string(depth));
+
+        bool caught = false;
+        try {
+            sheet->SetCell("A1"_pos, "=D1");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        sheet->SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(std::ldexp(1.0, depth - 1)));
+        sheet->SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(std::ldexp(1.0, depth)));
+    }
+
+    void TestUnchangedValueStopsRecalculation() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=A1*0");
+        sheet->SetCell("C1"_pos, "=B1+A2");
+        sheet->SetCell("A2"_pos, "5");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        sheet->SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(5.0));
+        sheet->SetCell("A2"_pos, "6");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        sheet->ClearCell("A2"_pos);
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+        sheet->SetCell("A1"_pos, "text");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Value));
+    }
+
     void TestPrint2() {
         auto sheet = CreateSheet();
         sheet->SetCell("A2"_pos, "meow");
@@ -373,6 +1741,97 @@ namespace {
         sheet->ClearCell("B2"_pos);
         ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 2, 1 }));
     }
+
+    void TestPrintMatchesStreams() {
+        // sparse enough for some tiles to be missing
+        std::mt19937 random(7);
+        std::uniform_int_distribution<int> row_dist(0, 999);
+        std::uniform_int_distribution<int> col_dist(0, 149);
+        std::uniform_real_distribution<double> exponent_dist(-12, 12);
+        auto random_number = [&]() {
+            std::ostringstream number;
+            number.precision(random() % 17 + 1);
+            number << std::pow(10.0, exponent_dist(random)) * (random() % 2 ? -1 : 1);
+            return number.str();
+        };
+        auto random_cell = [&]() {
+            return Position::FromString(std::string(1, 'A' + random() % 26) + std::to_string(row_dist(random) + 1));
+        };
+
+        Sheet sheet;
+        for (int i = 0; i < 20000; ++i) {
+            const Position pos{ row_dist(random), col_dist(random) };
+            std::string text;
+            switch (random() % 6) {
+                case 0:
+                    text = random_number();
+                    break;
+                case 1:
+                    text = "text" + std::to_string(i);
+                    break;
+                case 2:
+                    text = "'" + random_number();
+                    break;
+                case 3:
+                    text = "=" + random_number() + "/" + random_cell().ToString();
+                    break;
+                case 4:
+                    text = "=SUM(" + random_cell().ToString() + ":" + random_cell().ToString() + ")*" + random_number();
+                    break;
+                default:
+                    text = "=-(" + random_cell().ToString() + "+" + random_number() + ")";
+            }
+            try {
+                sheet.SetCell(pos, text);
+            }
+            catch (const CircularDependencyException&) {
+            }
+        }
+
+        std::ostringstream expected_values;
+        std::ostringstream expected_texts;
+        const Size size = sheet.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                if (const Cell* cell = sheet.FindCell({ row, col })) {
+                    expected_values << cell->GetValue();
+                    expected_texts << cell->GetText();
+                }
+                if (col < size.cols - 1) {
+                    expected_values << '\t';
+                    expected_texts << '\t';
+                }
+            }
+            expected_values << '\n';
+            expected_texts << '\n';
+        }
+
+        for (size_t threads : { 1, 3 }) {
+            sheet.SetPrintThreads(threads);
+            std::ostringstream values;
+            std::ostringstream texts;
+            sheet.PrintValues(values);
+            sheet.PrintTexts(texts);
+            ASSERT(values.str() == expected_values.str());
+            ASSERT(texts.str() == expected_texts.str());
+        }
+    }
+
+    void TestFarCells() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=XFD1048576*2");
+        sheet->SetCell("XFD1048576"_pos, "21");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ Position::MAX_ROWS, Position::MAX_COLS }));
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(42.0));
+
+        sheet->ClearCell("XFD1048576"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1, 1 }));
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        sheet->SetCell("A1"_pos, "5");
+        ASSERT(sheet->GetCell("XFD1048576"_pos) == nullptr);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1, 1 }));
+    }
 }  // namespace
 
 int main() {
@@ -384,19 +1843,54 @@ int main() {
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
     RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestGetCellDoesNotCreateCells);
+    RUN_TEST(tr, TestFarCells);
+    RUN_TEST(tr, TestNumberTexts);
+    RUN_TEST(tr, TestReadNumberMatchesStreams);
+    RUN_TEST(tr, TestNumericColumns);
+    RUN_TEST(tr, TestPositionMap);
     RUN_TEST(tr, TestFormulaArithmetic);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
+    RUN_TEST(tr, TestFormulaNestedExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorDiv0);
+    RUN_TEST(tr, TestErrorPropagation);
+    RUN_TEST(tr, TestDeeplyNestedFormula);
+    RUN_TEST(tr, TestRecalculateChain);
+    RUN_TEST(tr, TestParallelRecalculate);
+    RUN_TEST(tr, TestPublishedVersions);
+    RUN_TEST(tr, TestConcurrentReaders);
+    RUN_TEST(tr, TestForks);
+    RUN_TEST(tr, TestSheetHistory);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
     RUN_TEST(tr, TestFormulaInvalidPosition);
+    RUN_TEST(tr, TestAggregateFunctions);
+    RUN_TEST(tr, TestAggregateLongColumn);
+    RUN_TEST(tr, TestLargeRanges);
+    RUN_TEST(tr, TestRelativeFormulas);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestDependentsAfterManyEdits);
+    RUN_TEST(tr, TestSetCells);
+    RUN_TEST(tr, TestSetCellsLongChain);
+    RUN_TEST(tr, TestImportTexts);
+    RUN_TEST(tr, TestLoadTexts);
+    RUN_TEST(tr, TestSnapshot);
     RUN_TEST(tr, TestPrint);
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
+    RUN_TEST(tr, TestFormulaParsing);
+#ifdef SPREADSHEET_ANTLR_ORACLE
+    RUN_TEST(tr, TestFormulaParserMatchesAntlr);
+#endif
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestCircularReferencesAfterOverwrite);
+    RUN_TEST(tr, TestCircularReferencesInDiamonds);
+    RUN_TEST(tr, TestUnchangedValueStopsRecalculation);
     RUN_TEST(tr, TestPrint2);
+    RUN_TEST(tr, TestPrintMatchesStreams);
 
 
     {
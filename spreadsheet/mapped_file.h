@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Contents of a file, read-only. The file is memory-mapped, so pages are
+// read as they are touched and nothing is copied; on systems without mmap
+// it is read into memory as a whole.
+class MappedFile {
+public:
+    // Throws std::system_error if the file can't be opened or mapped
+    explicit MappedFile(const std::string& path);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    std::string_view GetData() const {
+        return { data_, size_ };
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    std::string buffer_;
+#endif
+};
@@ -0,0 +1,249 @@
+#include "numeric_columns.h"
+
+#include "copy_on_write.h"
+
+#include <bitset>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define AVX2_KERNEL
+#define AVX2_TARGET __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && defined(__AVX2__)
+#define AVX2_KERNEL
+#define AVX2_TARGET
+#endif
+
+#ifdef AVX2_KERNEL
+#include <immintrin.h>
+#endif
+
+namespace {
+using Block = NumericColumns::Block;
+
+constexpr int WORD_BITS = NumericColumns::WORD_BITS;
+constexpr double INF = std::numeric_limits<double>::infinity();
+
+// The sum is accumulated in LANES lanes chosen by the row modulo LANES,
+// the same way in both kernels, so they give exactly the same result.
+constexpr int LANES = 4;
+
+struct Partial {
+    double lanes[LANES] = {};
+    double min = INF;
+    double max = -INF;
+};
+
+void AddRow(const Block& block, int row, Partial& partial) {
+    // rows without a number hold 0, adding it changes nothing
+    partial.lanes[row % LANES] += block.values[row];
+    if (block.IsNumber(row)) {
+        partial.min = std::min(partial.min, block.values[row]);
+        partial.max = std::max(partial.max, block.values[row]);
+    }
+}
+
+void AggregateScalar(const Block& block, int begin, int end, Partial& partial) {
+    for (int row = begin; row < end; ++row) {
+        AddRow(block, row, partial);
+    }
+}
+
+#ifdef AVX2_KERNEL
+AVX2_TARGET void AggregateAvx2(const Block& block, int begin, int end, Partial& partial) {
+    int row = begin;
+    for (; row < end && row % LANES != 0; ++row) {
+        AddRow(block, row, partial);
+    }
+
+    __m256d sum = _mm256_loadu_pd(partial.lanes);
+    __m256d min = _mm256_set1_pd(partial.min);
+    __m256d max = _mm256_set1_pd(partial.max);
+    const __m256d pos_inf = _mm256_set1_pd(INF);
+    const __m256d neg_inf = _mm256_set1_pd(-INF);
+    const __m256i lane_bits = _mm256_setr_epi64x(1, 2, 4, 8);
+    for (; row + LANES <= end; row += LANES) {
+        const __m256d values = _mm256_loadu_pd(&block.values[row]);
+        sum = _mm256_add_pd(sum, values);
+
+        // rows of a group are in one bitmap word, as LANES divides WORD_BITS
+        const long long bits = (block.is_number[row / WORD_BITS] >> (row % WORD_BITS)) & 0xF;
+        const __m256i selected = _mm256_and_si256(_mm256_set1_epi64x(bits), lane_bits);
+        const __m256d is_number = _mm256_castsi256_pd(_mm256_cmpeq_epi64(selected, lane_bits));
+        min = _mm256_min_pd(min, _mm256_blendv_pd(pos_inf, values, is_number));
+        max = _mm256_max_pd(max, _mm256_blendv_pd(neg_inf, values, is_number));
+    }
+
+    _mm256_storeu_pd(partial.lanes, sum);
+    double mins[LANES];
+    double maxs[LANES];
+    _mm256_storeu_pd(mins, min);
+    _mm256_storeu_pd(maxs, max);
+    for (int lane = 0; lane < LANES; ++lane) {
+        partial.min = std::min(partial.min, mins[lane]);
+        partial.max = std::max(partial.max, maxs[lane]);
+    }
+
+    for (; row < end; ++row) {
+        AddRow(block, row, partial);
+    }
+}
+
+bool HasAvx2() {
+#if defined(__GNUC__) || defined(__clang__)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+#else
+    // compiled with /arch:AVX2, so the CPU has to have it anyway
+    return true;
+#endif
+}
+#endif
+
+size_t CountBits(const Block::Bitmap& bitmap, int begin, int end) {
+    size_t count = 0;
+    for (int word = begin / WORD_BITS; word * WORD_BITS < end; ++word) {
+        std::uint64_t bits = bitmap[word];
+        const int word_start = word * WORD_BITS;
+        if (begin > word_start) {
+            bits &= ~std::uint64_t{ 0 } << (begin - word_start);
+        }
+        if (end < word_start + WORD_BITS) {
+            bits &= ~(~std::uint64_t{ 0 } << (end - word_start));
+        }
+        count += std::bitset<WORD_BITS>(bits).count();
+    }
+    return count;
+}
+}  // namespace
+
+NumericColumns::Block& NumericColumns::GetBlock(Position pos) {
+    auto& columns = Unshare(columns_);
+    if (pos.col >= static_cast<int>(columns.size())) {
+        columns.resize(pos.col + 1);
+    }
+    if (!columns[pos.col]) {
+        columns[pos.col] = std::make_shared<Column>();
+    }
+    Column& column = Unshare(columns[pos.col]);
+    const int index = pos.row / BLOCK_ROWS;
+    if (index >= static_cast<int>(column.size())) {
+        column.resize(index + 1);
+    }
+    if (!column[index]) {
+        column[index] = std::make_shared<Block>();
+    }
+    return Unshare(column[index]);
+}
+
+bool NumericColumns::Unmark(Block::Bitmap& bitmap, int row) {
+    const std::uint64_t bit = std::uint64_t{ 1 } << (row % WORD_BITS);
+    if (!(bitmap[row / WORD_BITS] & bit)) {
+        return false;
+    }
+    bitmap[row / WORD_BITS] &= ~bit;
+    return true;
+}
+
+void NumericColumns::ReleaseIfEmpty(Position pos) {
+    // owned by these columns alone, GetBlock has copied it
+    auto& block = (*(*columns_)[pos.col])[pos.row / BLOCK_ROWS];
+    if (block->count == 0) {
+        block.reset();
+    }
+}
+
+void NumericColumns::Set(Position pos, double value) {
+    Block& block = GetBlock(pos);
+    const int row = pos.row % BLOCK_ROWS;
+    if (Unmark(block.is_formula, row)) {
+        --block.count;
+    }
+    if (!block.IsNumber(row)) {
+        block.is_number[row / WORD_BITS] |= std::uint64_t{ 1 } << (row % WORD_BITS);
+        ++block.count;
+    }
+    block.values[row] = value;
+}
+
+void NumericColumns::SetFormula(Position pos) {
+    Block& block = GetBlock(pos);
+    const int row = pos.row % BLOCK_ROWS;
+    if (Unmark(block.is_number, row)) {
+        block.values[row] = 0;
+        --block.count;
+    }
+    if (!block.IsFormula(row)) {
+        block.is_formula[row / WORD_BITS] |= std::uint64_t{ 1 } << (row % WORD_BITS);
+        ++block.count;
+    }
+}
+
+void NumericColumns::Erase(Position pos) {
+    if (!FindBlock(pos.col, pos.row / BLOCK_ROWS)) {
+        return;
+    }
+
+    Block& block = GetBlock(pos);
+    const int row = pos.row % BLOCK_ROWS;
+    if (Unmark(block.is_number, row)) {
+        block.values[row] = 0;
+        --block.count;
+    }
+    if (Unmark(block.is_formula, row)) {
+        --block.count;
+    }
+    ReleaseIfEmpty(pos);
+}
+
+std::optional<double> NumericColumns::Get(Position pos) const {
+    const Block* block = FindBlock(pos.col, pos.row / BLOCK_ROWS);
+    const int row = pos.row % BLOCK_ROWS;
+    if (!block || !block->IsNumber(row)) {
+        return std::nullopt;
+    }
+    return block->values[row];
+}
+
+size_t NumericColumns::GetMemoryUsage() const {
+    size_t bytes = columns_->capacity() * sizeof(std::shared_ptr<Column>);
+    for (const auto& column : *columns_) {
+        if (!column) {
+            continue;
+        }
+        bytes += column->capacity() * sizeof(std::shared_ptr<Block>);
+        for (const auto& block : *column) {
+            if (block) {
+                bytes += sizeof(Block);
+            }
+        }
+    }
+    return bytes;
+}
+
+const NumericColumns::Block* NumericColumns::FindBlock(int col, int index) const {
+    const auto& columns = *columns_;
+    if (col >= static_cast<int>(columns.size()) || !columns[col] || index >= static_cast<int>(columns[col]->size())) {
+        return nullptr;
+    }
+    return (*columns[col])[index].get();
+}
+
+void NumericColumns::Aggregate(int col, int first_row, int last_row, RangeStats& stats) const {
+    auto kernel = AggregateScalar;
+#ifdef AVX2_KERNEL
+    if (HasAvx2()) {
+        kernel = AggregateAvx2;
+    }
+#endif
+
+    Partial partial;
+    size_t count = 0;
+    ForEachBlock(col, first_row, last_row, [&](int /* block_start */, const Block& block, int begin, int end) {
+        kernel(block, begin, end, partial);
+        count += CountBits(block.is_number, begin, end);
+    });
+
+    stats.sum += (partial.lanes[0] + partial.lanes[1]) + (partial.lanes[2] + partial.lanes[3]);
+    stats.min = std::min(stats.min, partial.min);
+    stats.max = std::max(stats.max, partial.max);
+    stats.count += count;
+}
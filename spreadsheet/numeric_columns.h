@@ -0,0 +1,116 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+// Numeric values of the sheet stored by columns. Each column is split
+// into blocks of BLOCK_ROWS rows, a block keeps the values of its rows
+// in one contiguous array and marks the rows holding numbers in a bitmap.
+// Blocks are allocated once they hold a number, so a single value far
+// down a column doesn't cost the whole column.
+//
+// Formulas are only marked in a second bitmap: their values change during
+// recalculation, so aggregates take them from the cells.
+//
+// Copies share the columns and the blocks until they change them, so
+// copying costs O(1) and a change copies only its block and column.
+class NumericColumns {
+public:
+    static constexpr int BLOCK_ROWS = 4096;
+    static constexpr int WORD_BITS = 64;
+
+    struct Block {
+        using Bitmap = std::array<std::uint64_t, BLOCK_ROWS / WORD_BITS>;
+
+        // rows without a number hold 0
+        std::array<double, BLOCK_ROWS> values{};
+        Bitmap is_number{};
+        Bitmap is_formula{};
+        // rows marked in either bitmap
+        int count = 0;
+
+        bool IsNumber(int row) const {
+            return (is_number[row / WORD_BITS] >> (row % WORD_BITS)) & 1;
+        }
+
+        bool IsFormula(int row) const {
+            return (is_formula[row / WORD_BITS] >> (row % WORD_BITS)) & 1;
+        }
+    };
+
+    void Set(Position pos, double value);
+    void SetFormula(Position pos);
+    void Erase(Position pos);
+    std::optional<double> Get(Position pos) const;
+
+    // Bytes of the blocks and the columns, those shared with copies included
+    size_t GetMemoryUsage() const;
+
+    // Block holding rows [index * BLOCK_ROWS, (index + 1) * BLOCK_ROWS)
+    // of the column, nullptr if there are no numbers or formulas in them
+    const Block* FindBlock(int col, int index) const;
+
+    // Adds the numbers in rows [first_row, last_row] of the column to stats.
+    // Uses AVX2 if the CPU has it, the result is the same either way.
+    void Aggregate(int col, int first_row, int last_row, RangeStats& stats) const;
+
+    // Calls func(row, value) for every number in rows [first_row, last_row]
+    // of the column, in order of rows
+    template <typename Func>
+    void ForEach(int col, int first_row, int last_row, Func func) const {
+        ForEachBlock(col, first_row, last_row, [&func](int block_start, const Block& block, int begin, int end) {
+            for (int row = begin; row < end; ++row) {
+                if (block.IsNumber(row)) {
+                    func(block_start + row, block.values[row]);
+                }
+            }
+        });
+    }
+
+    // Calls func(row) for every formula in rows [first_row, last_row]
+    // of the column, in order of rows
+    template <typename Func>
+    void ForEachFormula(int col, int first_row, int last_row, Func func) const {
+        ForEachBlock(col, first_row, last_row, [&func](int block_start, const Block& block, int begin, int end) {
+            for (int row = begin; row < end; ++row) {
+                if (block.IsFormula(row)) {
+                    func(block_start + row);
+                }
+            }
+        });
+    }
+
+private:
+    using Column = std::vector<std::shared_ptr<Block>>;
+
+    // Calls func(block_start, block, begin, end) for blocks of the column
+    // overlapping rows [first_row, last_row], [begin, end) is the overlap
+    // relative to the block
+    template <typename Func>
+    void ForEachBlock(int col, int first_row, int last_row, Func func) const {
+        for (int index = first_row / BLOCK_ROWS; index <= last_row / BLOCK_ROWS; ++index) {
+            const Block* block = FindBlock(col, index);
+            if (!block) {
+                continue;
+            }
+            const int block_start = index * BLOCK_ROWS;
+            const int begin = std::max(first_row, block_start) - block_start;
+            const int end = std::min(last_row + 1, block_start + BLOCK_ROWS) - block_start;
+            func(block_start, *block, begin, end);
+        }
+    }
+
+    Block& GetBlock(Position pos);
+    // Unmarks the row in the bitmap, returns false if it wasn't marked
+    static bool Unmark(Block::Bitmap& bitmap, int row);
+    void ReleaseIfEmpty(Position pos);
+
+    // columns are nullptr until they hold a block
+    std::shared_ptr<std::vector<std::shared_ptr<Column>>> columns_ = std::make_shared<std::vector<std::shared_ptr<Column>>>();
+};
@@ -0,0 +1,69 @@
+#include "parallel.h"
+
+#include <utility>
+
+WorkerPool& WorkerPool::Get() {
+    static WorkerPool pool;
+    return pool;
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& thread : threads_) {
+        thread.join();
+    }
+}
+
+void WorkerPool::Run(size_t copy_count, const std::function<void()>& task) {
+    copy_count = std::min(copy_count, GetMaxThreadCount());
+    if (copy_count == 0) {
+        return;
+    }
+    {
+        std::lock_guard lock(mutex_);
+        while (threads_.size() < copy_count) {
+            threads_.emplace_back([this]() {
+                Work();
+            });
+        }
+        tasks_.insert(tasks_.end(), copy_count, task);
+    }
+    if (copy_count == 1) {
+        wake_.notify_one();
+    }
+    else {
+        wake_.notify_all();
+    }
+}
+
+size_t WorkerPool::GetThreadCount() const {
+    std::lock_guard lock(mutex_);
+    return threads_.size();
+}
+
+size_t WorkerPool::GetMaxThreadCount() {
+    // hardware_concurrency is 0 if it isn't known, one worker then
+    static const size_t max_count = std::max<size_t>(std::thread::hardware_concurrency(), 2) - 1;
+    return max_count;
+}
+
+void WorkerPool::Work() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        wake_.wait(lock, [this]() {
+            return stopping_ || !tasks_.empty();
+        });
+        if (tasks_.empty()) {
+            return;
+        }
+        std::function<void()> task = std::move(tasks_.front());
+        tasks_.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads shared by the whole process, started as they are first needed
+// and kept until exit, so that work split over and over, as a level of
+// a recalculation or a round of printing is, doesn't start threads each
+// time. Any thread may add tasks.
+class WorkerPool {
+public:
+    static WorkerPool& Get();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+    ~WorkerPool();
+
+    // Runs task on copy_count workers, at most GetMaxThreadCount of them,
+    // starting threads so that there are that many. The task must not throw.
+    void Run(size_t copy_count, const std::function<void()>& task);
+
+    size_t GetThreadCount() const;
+    // One less than the threads the hardware runs at once, the thread
+    // handing out the work being the other one
+    static size_t GetMaxThreadCount();
+
+private:
+    WorkerPool() = default;
+
+    void Work();
+
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::function<void()>> tasks_;
+    std::vector<std::thread> threads_;
+    bool stopping_ = false;
+};
+
+// Calls func(i) for every i in [0, count) using up to thread_count threads,
+// the calling thread included, the others from WorkerPool, so no more
+// than the hardware runs at once. Indices are handed out in batches of
+// batch_size, small enough for uneven work to still spread evenly;
+// use 1 for coarse work items. func must not throw.
+template <typename Func>
+void ParallelFor(size_t count, size_t thread_count, Func func, size_t batch_size = 64) {
+    thread_count = std::min(thread_count, (count + batch_size - 1) / batch_size);
+    if (thread_count <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            func(i);
+        }
+        return;
+    }
+
+    // a worker may only get to the job once all of it is done and
+    // this call has returned: then it takes no batch and leaves func be
+    struct Job {
+        std::atomic<size_t> next_batch{ 0 };
+        std::atomic<size_t> done{ 0 };
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    auto job = std::make_shared<Job>();
+    auto work = [job, count, batch_size, &func]() {
+        for (size_t begin = job->next_batch.fetch_add(batch_size); begin < count;
+             begin = job->next_batch.fetch_add(batch_size)) {
+            size_t end = std::min(begin + batch_size, count);
+            for (size_t i = begin; i < end; ++i) {
+                func(i);
+            }
+            if (job->done.fetch_add(end - begin) + (end - begin) == count) {
+                std::lock_guard lock(job->mutex);
+                job->finished.notify_all();
+            }
+        }
+    };
+
+    WorkerPool::Get().Run(thread_count - 1, work);
+    work();
+    std::unique_lock lock(job->mutex);
+    job->finished.wait(lock, [&job, count]() {
+        return job->done.load() == count;
+    });
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Allocates objects of one type from slabs holding SLAB_SIZE of them.
+// Freed slots are kept in a list and reused, slabs are released
+// together with the pool. Objects still alive at that point aren't
+// destroyed, the owner has to Delete them first. Not thread-safe.
+template <typename T>
+class ObjectPool {
+public:
+    static constexpr size_t SLAB_SIZE = 1024;
+
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    template <typename... Args>
+    T* New(Args&&... args) {
+        if (!free_) {
+            AddSlab();
+        }
+        Slot* slot = free_;
+        Slot* next = slot->next;
+        T* object = new (slot->storage) T(std::forward<Args>(args)...);
+        free_ = next;
+        return object;
+    }
+
+    void Delete(T* object) {
+        object->~T();
+        Slot* slot = reinterpret_cast<Slot*>(object);
+        slot->next = free_;
+        free_ = slot;
+    }
+
+    // Bytes of the slabs, free slots included
+    size_t GetMemoryUsage() const {
+        return slabs_.size() * SLAB_SIZE * sizeof(Slot);
+    }
+
+private:
+    union Slot {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    void AddSlab() {
+        slabs_.push_back(std::make_unique<Slot[]>(SLAB_SIZE));
+        Slot* slab = slabs_.back().get();
+        for (size_t i = 0; i + 1 < SLAB_SIZE; ++i) {
+            slab[i].next = &slab[i + 1];
+        }
+        slab[SLAB_SIZE - 1].next = free_;
+        free_ = slab;
+    }
+
+    std::vector<std::unique_ptr<Slot[]>> slabs_;
+    Slot* free_ = nullptr;
+};
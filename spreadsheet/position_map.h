@@ -0,0 +1,157 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Map from positions to small values in a single open-addressed table,
+// for the states of walks over the cells and the positions a fork has
+// cleared. Clear takes O(1): a slot keeps the generation it was filled
+// in and those of older generations are empty, so a map reused from
+// walk to walk allocates only for a walk larger than those before it.
+// Not thread-safe.
+template <typename Value>
+class PositionMap {
+public:
+    // The value of pos and whether it was added now, as Value{}
+    std::pair<Value*, bool> Insert(Position pos) {
+        if ((size_ + 1) * 2 > slots_.size()) {
+            Grow();
+        }
+        const std::uint64_t key = GetKey(pos);
+        size_t i = GetHome(key);
+        for (; IsFull(slots_[i]); i = (i + 1) & mask_) {
+            if (slots_[i].key == key) {
+                return { &slots_[i].value, false };
+            }
+        }
+        slots_[i] = { key, generation_, Value{} };
+        ++size_;
+        return { &slots_[i].value, true };
+    }
+
+    Value* Find(Position pos) {
+        const size_t i = FindSlot(GetKey(pos));
+        return i != NOT_FOUND ? &slots_[i].value : nullptr;
+    }
+    const Value* Find(Position pos) const {
+        return const_cast<PositionMap*>(this)->Find(pos);
+    }
+    bool Contains(Position pos) const {
+        return FindSlot(GetKey(pos)) != NOT_FOUND;
+    }
+
+    // Returns false if pos wasn't there
+    bool Erase(Position pos) {
+        size_t i = FindSlot(GetKey(pos));
+        if (i == NOT_FOUND) {
+            return false;
+        }
+        // the slots after it that would no longer be found move up,
+        // so that lookups still stop at the first empty slot
+        for (size_t j = (i + 1) & mask_; IsFull(slots_[j]); j = (j + 1) & mask_) {
+            const size_t home = GetHome(slots_[j].key);
+            const bool stays = i <= j ? i < home && home <= j : i < home || home <= j;
+            if (!stays) {
+                slots_[i] = slots_[j];
+                i = j;
+            }
+        }
+        slots_[i].generation = generation_ - 1;
+        --size_;
+        return true;
+    }
+
+    void Clear() {
+        size_ = 0;
+        if (++generation_ == 0) {
+            // every slot may be of the generation that comes next
+            for (Slot& slot : slots_) {
+                slot.generation = 0;
+            }
+            generation_ = 1;
+        }
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+    // Calls func(Position, const Value&) for every position, in no
+    // particular order
+    template <typename Func>
+    void ForEach(Func func) const {
+        for (const Slot& slot : slots_) {
+            if (IsFull(slot)) {
+                func(Position{ static_cast<int>(slot.key >> 32), static_cast<int>(slot.key & 0xFFFFFFFF) }, slot.value);
+            }
+        }
+    }
+
+private:
+    static constexpr size_t MIN_CAPACITY = 16;
+    static constexpr size_t NOT_FOUND = static_cast<size_t>(-1);
+
+    struct Slot {
+        std::uint64_t key;
+        // of the Clear the slot was filled after, 0 for never
+        std::uint32_t generation;
+        Value value;
+    };
+
+    static std::uint64_t GetKey(Position pos) {
+        return (static_cast<std::uint64_t>(pos.row) << 32) | static_cast<std::uint32_t>(pos.col);
+    }
+
+    // Fibonacci hashing: the high bits of the product mix rows and columns
+    size_t GetHome(std::uint64_t key) const {
+        return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> shift_);
+    }
+
+    bool IsFull(const Slot& slot) const {
+        return slot.generation == generation_;
+    }
+
+    size_t FindSlot(std::uint64_t key) const {
+        if (size_ == 0) {
+            return NOT_FOUND;
+        }
+        for (size_t i = GetHome(key); IsFull(slots_[i]); i = (i + 1) & mask_) {
+            if (slots_[i].key == key) {
+                return i;
+            }
+        }
+        return NOT_FOUND;
+    }
+
+    void Grow() {
+        std::vector<Slot> old_slots = std::move(slots_);
+        slots_.assign(std::max(old_slots.size() * 2, MIN_CAPACITY), Slot{ 0, 0, Value{} });
+        mask_ = slots_.size() - 1;
+        shift_ = 64;
+        for (size_t capacity = slots_.size(); capacity > 1; capacity /= 2) {
+            --shift_;
+        }
+        const std::uint32_t old_generation = generation_;
+        generation_ = 1;
+        for (const Slot& slot : old_slots) {
+            if (slot.generation == old_generation) {
+                size_t i = GetHome(slot.key);
+                while (IsFull(slots_[i])) {
+                    i = (i + 1) & mask_;
+                }
+                slots_[i] = { slot.key, generation_, slot.value };
+            }
+        }
+    }
+
+    std::vector<Slot> slots_;
+    size_t size_ = 0;
+    size_t mask_ = 0;
+    int shift_ = 64;
+    std::uint32_t generation_ = 1;
+};
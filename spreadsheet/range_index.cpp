@@ -0,0 +1,39 @@
+#include "range_index.h"
+
+#include <algorithm>
+
+RangeIndex::NodeKey RangeIndex::GetNodeKey(int band, std::uint32_t node) {
+    return (static_cast<NodeKey>(band) << 32) | node;
+}
+
+void RangeIndex::Add(Position formula, Range range) {
+    ForEachNode(range, [this, formula, range](NodeKey key) {
+        nodes_[key].push_back({ range, formula });
+    });
+}
+
+void RangeIndex::Remove(Position formula, Range range) {
+    ForEachNode(range, [this, formula, range](NodeKey key) {
+        auto it = nodes_.find(key);
+        if (it == nodes_.end()) {
+            return;
+        }
+
+        std::vector<Entry>& entries = it->second;
+        auto entry = std::find_if(entries.begin(), entries.end(), [formula, range](const Entry& entry) {
+            return entry.formula == formula && entry.range == range;
+        });
+        if (entry == entries.end()) {
+            return;
+        }
+        *entry = entries.back();
+        entries.pop_back();
+        if (entries.empty()) {
+            nodes_.erase(it);
+        }
+    });
+}
+
+bool RangeIndex::IsEmpty() const {
+    return nodes_.empty();
+}
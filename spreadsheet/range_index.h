@@ -0,0 +1,79 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Finds the formulas whose ranges contain a cell without storing
+// an edge per cell of every range.
+//
+// Columns are split into bands of BAND_COLS columns, each band has
+// a segment tree over rows. A range is kept in the nodes of the
+// canonical decomposition of its rows, O(log MAX_ROWS) of them in
+// every band it overlaps. A lookup visits the nodes on the path from
+// the root to the cell's row, so it takes O(log MAX_ROWS) probes.
+// Only nodes holding ranges are allocated.
+class RangeIndex {
+public:
+    static constexpr int BAND_COLS = 64;
+
+    void Add(Position formula, Range range);
+    void Remove(Position formula, Range range);
+
+    // Calls func(formula) for every range containing pos, so a formula
+    // with several such ranges is reported several times
+    template <typename Func>
+    void ForEachDependent(Position pos, Func func) const {
+        if (nodes_.empty()) {
+            return;
+        }
+        for (std::uint32_t node = LEAF_OFFSET + pos.row; node > 0; node /= 2) {
+            auto it = nodes_.find(GetNodeKey(pos.col / BAND_COLS, node));
+            if (it == nodes_.end()) {
+                continue;
+            }
+            for (const Entry& entry : it->second) {
+                if (entry.range.Contains(pos)) {
+                    func(entry.formula);
+                }
+            }
+        }
+    }
+
+    bool IsEmpty() const;
+
+private:
+    // number of leaves, rows are leaves [LEAF_OFFSET, 2 * LEAF_OFFSET)
+    static constexpr std::uint32_t LEAF_OFFSET = Position::MAX_ROWS;
+    static_assert((LEAF_OFFSET & (LEAF_OFFSET - 1)) == 0, "MAX_ROWS has to be a power of two");
+
+    struct Entry {
+        Range range;
+        Position formula;
+    };
+
+    using NodeKey = std::uint64_t;
+
+    static NodeKey GetNodeKey(int band, std::uint32_t node);
+
+    // Calls func(key) for the nodes the range is kept in
+    template <typename Func>
+    static void ForEachNode(Range range, Func func) {
+        for (int band = range.first.col / BAND_COLS; band <= range.last.col / BAND_COLS; ++band) {
+            std::uint32_t left = LEAF_OFFSET + range.first.row;
+            std::uint32_t right = LEAF_OFFSET + range.last.row + 1;
+            for (; left < right; left /= 2, right /= 2) {
+                if (left & 1) {
+                    func(GetNodeKey(band, left++));
+                }
+                if (right & 1) {
+                    func(GetNodeKey(band, --right));
+                }
+            }
+        }
+    }
+
+    std::unordered_map<NodeKey, std::vector<Entry>> nodes_;
+};
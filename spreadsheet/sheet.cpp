@@ -2,11 +2,21 @@
 
 #include "cell.h"
 #include "common.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "snapshot.h"
+#include "text_import.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <forward_list>
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
 
 using namespace std::literals;
 
@@ -20,80 +30,575 @@ bool IsInsidePrintZone(Position pos, Size size) {
 	return pos.row < size.rows&& pos.col < size.cols;
 }
 
+std::uint64_t GetSegmentKey(Position pos) {
+	return (static_cast<std::uint64_t>(pos.row) << 32) | static_cast<std::uint32_t>(pos.col / CellStorage::TILE_SIZE);
+}
+
 void Sheet::CheckPosition(Position pos) const {
 	if (!PositionIsCorrect(pos)) {
 		throw InvalidPositionException("Invalid position!"s);
 	}
 }
 
-void Sheet::CheckCircularDependency(Position pos, const CellInterface* cell) const {
-	if (cell == nullptr) {
-		return;
+Cell* Sheet::FindCell(Position pos) const {
+	if (Cell* cell = cells_.Get(pos)) {
+		return cell;
 	}
+	return base_ && !cleared_.Contains(pos) ? base_->FindCell(pos) : nullptr;
+}
 
-	for (const Position& parent_pos : cell->GetReferencedCells()) {
-		if (pos == parent_pos) {
-			throw CircularDependencyException("Circular dependency found!");
-		}
-		CheckCircularDependency(pos, GetCell(parent_pos));
+Cell* Sheet::FindOwnCell(Position pos) {
+	if (Cell* cell = cells_.Get(pos); cell || !base_) {
+		return cell;
+	}
+	const Cell* base_cell = FindCell(pos);
+	if (!base_cell) {
+		return nullptr;
+	}
+	// numbers and formula marks are the same in the fork's columns
+	CellStorage::CellPtr cell = cells_.MakeCell(*this, pos);
+	cell->CopyFrom(*base_cell);
+	for (const Range& range : cell->GetRanges()) {
+		range_dependents_.Add(pos, range);
 	}
+	Cell& result = *cell;
+	cells_.Put(pos, std::move(cell));
+	return &result;
 }
 
-void Sheet::SetChildCells(Position pos, std::unique_ptr<Cell>& cell) {
-	for (const Position& parent_pos : cell->GetReferencedCells()) {
-		if (!GetCell(parent_pos)) {
-			SetCell(parent_pos, {});
+bool Sheet::HasChanged(Position pos) const {
+	return cells_.Get(pos) || cleared_.Contains(pos);
+}
+
+bool Sheet::IsChangedAbove(const Sheet* base, Position pos) const {
+	for (const Sheet* sheet = this; sheet != base; sheet = sheet->base_.get()) {
+		if (sheet->HasChanged(pos)) {
+			return true;
 		}
-		dynamic_cast<Cell*>(GetCell(parent_pos))->SetChildCell(pos);
 	}
+	return false;
 }
 
-void Sheet::ResizeTable(Position pos) {
-	if (pos.row >= static_cast<int>(sheet_.size())) {
-		sheet_.resize(pos.row + 1);
+void Sheet::CheckCircularDependency(Position pos, const Cell& cell) const {
+	const AnchoredList<Position> referenced_cells = cell.GetParentCells();
+	const AnchoredList<Range> ranges = cell.GetRanges();
+	if (referenced_cells.empty() && ranges.empty()) {
+		return;
 	}
-	if (pos.col >= static_cast<int>(sheet_.at(pos.row).size())) {
-		sheet_.at(pos.row).resize(pos.col + 1);
+
+	// sorted, as the parent cells are
+	const std::vector<Position> sorted_cells(referenced_cells.begin(), referenced_cells.end());
+	auto is_referenced = [&](Position cell_pos) {
+		return std::binary_search(sorted_cells.begin(), sorted_cells.end(), cell_pos)
+			|| std::any_of(ranges.begin(), ranges.end(), [cell_pos](const Range& range) {
+			return range.Contains(cell_pos);
+				});
+	};
+	if (is_referenced(pos)) {
+		throw CircularDependencyException("Circular dependency found!");
 	}
+
+	// A cycle needs a path from pos back to itself, so the new formula
+	// closes one if it refers to a cell depending on pos. Ranges aren't
+	// expanded: the walk goes over dependents, each visited once.
+	visited_.Clear();
+	visited_.Insert(pos);
+	std::vector<Position> stack{ pos };
+	while (!stack.empty()) {
+		const Position current = stack.back();
+		stack.pop_back();
+		stats_.Add(StatCounters::CYCLE_CHECK_NODES);
+		ForEachDependent(current, [&](Position dependent) {
+			if (is_referenced(dependent)) {
+				throw CircularDependencyException("Circular dependency found!");
+			}
+			if (visited_.Insert(dependent).second) {
+				stack.push_back(dependent);
+			}
+			});
+	}
+}
+
+void Sheet::SetChildCells(Position pos, const Cell& cell) {
+	for (const Position& parent_pos : cell.GetParentCells()) {
+		dependents_.Add(parent_pos, pos);
+	}
+	for (const Range& range : cell.GetRanges()) {
+		range_dependents_.Add(pos, range);
+	}
+}
+
+void Sheet::RemoveChildCells(Position pos, const Cell& cell) {
+	for (const Position& parent_pos : cell.GetParentCells()) {
+		dependents_.Remove(parent_pos, pos);
+	}
+	for (const Range& range : cell.GetRanges()) {
+		range_dependents_.Remove(pos, range);
+	}
+}
+
+void Sheet::ResizeTable(Position pos) {
 	size_.cols = std::max(size_.cols, pos.col + 1);
 	size_.rows = std::max(size_.rows, pos.row + 1);
 }
 
-std::unique_ptr<Cell>& Sheet::AddNewCellToSheet(Position pos, std::unique_ptr<Cell>&& new_cell) {
-	auto& cell = sheet_.at(pos.row).at(pos.col);
+Cell& Sheet::AddNewCellToSheet(Position pos, CellStorage::CellPtr&& new_cell) {
+	Cell* cell = FindOwnCell(pos);
 	if (cell) {
+		RemoveChildCells(pos, *cell);
 		cell->Clear();
 	}
 	else {
-		++non_empty_cols[pos.col];
-		++non_empty_rows[pos.row];
+		// formulas referring to the empty position are outdated,
+		// the graph keeps them for the new cell
+		InvalidateDependents(pos);
+		cleared_.Erase(pos);
+		non_empty_cols.Add(pos.col);
+		non_empty_rows.Add(pos.row);
+	}
+	MarkUnpublished(pos);
+
+	if (std::optional<double> number = new_cell->GetNumber()) {
+		numbers_.Set(pos, *number);
+	}
+	else if (new_cell->IsFormula()) {
+		numbers_.SetFormula(pos);
 	}
-	cell = std::move(new_cell);
-	return cell;
+	else {
+		numbers_.Erase(pos);
+	}
+
+	Cell& result = *new_cell;
+	cells_.Put(pos, std::move(new_cell));
+	return result;
 }
 
 void Sheet::SetCell(Position pos, std::string text) {
 	CheckPosition(pos);
+	++revision_;
 
-	auto temp_cell = std::make_unique<Cell>(*this);
+	CellStorage::CellPtr temp_cell = cells_.MakeCell(*this, pos);
 	temp_cell->Set(text);
-	CheckCircularDependency(pos, temp_cell.get());
+	CheckCircularDependency(pos, *temp_cell);
 	ResizeTable(pos);
-	std::unique_ptr<Cell>& new_cell = AddNewCellToSheet(pos, std::move(temp_cell));
+	Cell& new_cell = AddNewCellToSheet(pos, std::move(temp_cell));
 	SetChildCells(pos, new_cell);
+	++edit_count_;
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+	for (const auto& [pos, text] : cells) {
+		CheckPosition(pos);
+	}
+
+	// the last edit of a position wins
+	std::stable_sort(cells.begin(), cells.end(), [](const auto& lhs, const auto& rhs) {
+		return lhs.first < rhs.first;
+		});
+	auto last_edits = std::unique(cells.rbegin(), cells.rend(), [](const auto& lhs, const auto& rhs) {
+		return lhs.first == rhs.first;
+		});
+	cells.erase(cells.begin(), last_edits.base());
+	++revision_;
+
+	// parsing may throw, nothing is changed until all cells are made
+	Batch batch;
+	batch.reserve(cells.size());
+	for (auto& [pos, text] : cells) {
+		CellStorage::CellPtr cell = cells_.MakeCell(*this, pos);
+		cell->Set(std::move(text));
+		batch.emplace_back(pos, std::move(cell));
+	}
+	ApplyBatch(std::move(batch));
+}
+
+void Sheet::ImportTexts(std::string_view table, char delimiter, size_t thread_count) {
+	std::vector<TextImport::Chunk> chunks = TextImport::ReadTable(table, delimiter, thread_count);
+	++revision_;
+
+	Batch batch;
+	size_t field_count = 0;
+	for (const TextImport::Chunk& chunk : chunks) {
+		field_count += chunk.fields.size();
+	}
+	batch.reserve(field_count);
+	for (TextImport::Chunk& chunk : chunks) {
+		stats_.Add(StatCounters::FORMULAS_PARSED, chunk.parsed);
+		stats_.Add(StatCounters::PARSE_NS, chunk.parse_ns);
+		for (const TextImport::Field& field : chunk.fields) {
+			CellStorage::CellPtr cell = cells_.MakeCell(*this, field.pos);
+			if (const double* number = std::get_if<double>(&field.content)) {
+				cell->SetNumber(*number);
+			}
+			else if (const auto* formula = std::get_if<const TextImport::CompiledFormula*>(&field.content)) {
+				cell->SetFormula(formulas_.Intern((*formula)->first, (*formula)->second));
+			}
+			else {
+				cell->Set(std::string(std::get<std::string_view>(field.content)));
+			}
+			batch.emplace_back(field.pos, std::move(cell));
+		}
+		// the formulas are held by the cells now
+		chunk = {};
+	}
+	ApplyBatch(std::move(batch));
+}
+
+void Sheet::LoadTexts(const std::string& path, char delimiter, size_t thread_count) {
+	const MappedFile file(path);
+	ImportTexts(file.GetData(), delimiter, thread_count);
+}
+
+void Sheet::SaveSnapshot(std::ostream& output) const {
+	Snapshot::Writer writer(size_);
+
+	// formulas are saved with the forms they are interned by,
+	// those of a fork's cells copied from the base by the base
+	std::unordered_map<const FormulaAST*, std::uint64_t> formula_indexes;
+	for (const Sheet* sheet = this; sheet; sheet = sheet->base_.get()) {
+		sheet->formulas_.ForEach([&](const std::string& form, const FormulaInterner::FormulaPtr& formula) {
+			if (!formula_indexes.count(formula.get())) {
+				formula_indexes.emplace(formula.get(), writer.AddFormula(*formula, form));
+			}
+			});
+	}
+
+	ForEachCell([&](Position pos, const Cell& cell) {
+		Snapshot::CellRecord record{};
+		record.row = pos.row;
+		record.col = pos.col;
+		if (const FormulaAST* formula = cell.GetFormulaAST()) {
+			record.kind = Snapshot::CellKind::Formula;
+			auto it = formula_indexes.find(formula);
+			if (it == formula_indexes.end()) {
+				// a formula copied from a base flattened away, see Flatten
+				const std::string form = ToRelativeForm(cell.GetText().substr(1), pos);
+				it = formula_indexes.emplace(formula, writer.AddFormula(*formula, form)).first;
+			}
+			record.formula = it->second;
+			if (std::optional<FormulaInterface::Value> value = cell.GetCachedValue()) {
+				record.flags |= Snapshot::CACHED;
+				if (const double* number = std::get_if<double>(&*value)) {
+					record.number = *number;
+				}
+				else {
+					record.error = static_cast<std::uint8_t>(std::get<FormulaError>(*value).GetCategory()) + 1;
+				}
+			}
+		}
+		else if (cell.IsNumber()) {
+			record.kind = Snapshot::CellKind::Number;
+			record.number = *cell.GetNumber();
+		}
+		else if (!cell.IsEmpty()) {
+			std::optional<double> number = cell.GetNumber();
+			record.kind = number ? Snapshot::CellKind::NumericText : Snapshot::CellKind::Text;
+			record.number = number.value_or(0);
+			record.text = writer.AddText(cell.GetText());
+		}
+		const DependencyGraph::Dependents children = dependents_.Get(pos);
+		writer.AddCell(record, children.begin(), children.end());
+		});
+	dependents_.ForEach([&](Position pos, DependencyGraph::Dependents children) {
+		if (FindCell(pos)) {
+			return;
+		}
+		Snapshot::CellRecord record{};
+		record.row = pos.row;
+		record.col = pos.col;
+		record.flags = Snapshot::CLEARED;
+		writer.AddCell(record, children.begin(), children.end());
+		});
+
+	writer.Write(output);
+}
+
+std::unique_ptr<Sheet> Sheet::ReadSnapshot(std::string_view snapshot) {
+	const Snapshot::View view = Snapshot::Open(snapshot);
+	auto sheet = std::make_unique<Sheet>();
+
+	std::vector<FormulaInterner::FormulaPtr> formulas(view.header->formulas.count);
+	for (size_t i = 0; i < formulas.size(); ++i) {
+		ASTImpl::Program program = view.GetProgram(i);
+		std::forward_list<Position> cells;
+		for (const ASTImpl::Instruction& instr : program) {
+			if (instr.code == ASTImpl::OpCode::LoadCell) {
+				cells.push_front(instr.operand.cell);
+			}
+		}
+		auto formula = std::make_shared<const FormulaAST>(std::move(program), std::move(cells));
+		formulas[i] = sheet->formulas_.Intern(std::string(view.GetText(view.formulas[i].form)), std::move(formula));
+	}
+
+	// cells by rows and columns of the printable area, counted first
+	// to fill the line counts at once
+	std::vector<int> row_counts(view.header->rows);
+	std::vector<int> col_counts(view.header->cols);
+	const Snapshot::PositionRecord* children = view.children;
+	DependencyGraph::Builder dependents;
+	Batch cells;
+	cells.reserve(view.header->cells.count);
+	std::vector<Position> cleared;
+	// (cell, formula referring to it) as the children list them and as
+	// the formulas do, to be the same
+	std::vector<std::pair<Position, Position>> child_links;
+	std::vector<std::pair<Position, Position>> formula_links;
+	for (size_t i = 0; i < view.header->cells.count; ++i) {
+		const Snapshot::CellRecord& record = view.cells[i];
+		const Position pos{ record.row, record.col };
+		std::vector<Position> child_cells(record.child_count);
+		for (Position& child_pos : child_cells) {
+			child_pos = { children->row, children->col };
+			child_links.emplace_back(pos, child_pos);
+			++children;
+		}
+
+		// a cleared cell only records the formulas referring to it
+		if (record.flags & Snapshot::CLEARED) {
+			if (record.kind != Snapshot::CellKind::Empty) {
+				throw Snapshot::Error("Snapshot cell is malformed");
+			}
+			dependents.Add(pos, std::move(child_cells));
+			cleared.push_back(pos);
+			continue;
+		}
+
+		CellStorage::CellPtr cell = sheet->cells_.MakeCell(*sheet, pos);
+		switch (record.kind) {
+			case Snapshot::CellKind::Number:
+				cell->SetNumber(record.number);
+				break;
+			case Snapshot::CellKind::NumericText:
+			case Snapshot::CellKind::Text:
+				cell->SetText(std::string(view.GetText(record.text)), record.kind == Snapshot::CellKind::NumericText);
+				break;
+			case Snapshot::CellKind::Formula: {
+				const FormulaInterner::FormulaPtr& formula = formulas[record.formula];
+				if (!formula->IsValidAt(pos)) {
+					throw Snapshot::Error("Snapshot formula is out of the sheet");
+				}
+				cell->SetFormula(formula);
+				if (record.flags & Snapshot::CACHED) {
+					cell->SetCachedValue(record.error == 0 ? FormulaInterface::Value(record.number)
+						: FormulaError(static_cast<FormulaError::Category>(record.error - 1)));
+				}
+				for (const Range& range : cell->GetRanges()) {
+					sheet->range_dependents_.Add(pos, range);
+				}
+				for (const Position& parent_pos : cell->GetParentCells()) {
+					formula_links.emplace_back(parent_pos, pos);
+				}
+				break;
+			}
+			default:
+				break;
+		}
+		dependents.Add(pos, std::move(child_cells));
+
+		if (record.kind == Snapshot::CellKind::Number || record.kind == Snapshot::CellKind::NumericText) {
+			sheet->numbers_.Set(pos, record.number);
+		}
+		else if (record.kind == Snapshot::CellKind::Formula) {
+			sheet->numbers_.SetFormula(pos);
+		}
+		if (pos.row >= view.header->rows || pos.col >= view.header->cols) {
+			throw Snapshot::Error("Snapshot cell is out of the printable area");
+		}
+		else {
+			++row_counts[pos.row];
+			++col_counts[pos.col];
+		}
+		cells.emplace_back(pos, std::move(cell));
+	}
+
+	// cells are put once they are known to be there once and to refer
+	// to each other without cycles, which a corrupt snapshot may have
+	std::sort(cells.begin(), cells.end(), [](const auto& lhs, const auto& rhs) {
+		return lhs.first < rhs.first;
+		});
+	std::sort(cleared.begin(), cleared.end());
+	auto is_cell = [&cells](Position pos) {
+		auto it = std::lower_bound(cells.begin(), cells.end(), pos, [](const auto& cell, Position pos) {
+			return cell.first < pos;
+			});
+		return it != cells.end() && it->first == pos;
+	};
+	auto same_positions = [](const auto& lhs, const auto& rhs) {
+		return lhs.first == rhs.first;
+	};
+	if (std::adjacent_find(cells.begin(), cells.end(), same_positions) != cells.end()
+		|| std::adjacent_find(cleared.begin(), cleared.end()) != cleared.end()
+		|| std::any_of(cleared.begin(), cleared.end(), is_cell)) {
+		throw Snapshot::Error("Snapshot has a cell twice");
+	}
+	try {
+		sheet->CheckCircularDependencies(cells);
+	}
+	catch (const CircularDependencyException&) {
+		throw Snapshot::Error("Snapshot formulas have a circular dependency");
+	}
+	// a formula missing from the children of a cell it refers to isn't
+	// recalculated when the cell changes, an extra child is for nothing
+	std::sort(child_links.begin(), child_links.end());
+	child_links.erase(std::unique(child_links.begin(), child_links.end()), child_links.end());
+	std::sort(formula_links.begin(), formula_links.end());
+	if (child_links != formula_links) {
+		throw Snapshot::Error("Snapshot children don't match the formulas");
+	}
+	for (auto& [pos, cell] : cells) {
+		sheet->cells_.Put(pos, std::move(cell));
+	}
+
+	auto fill_counts = [](const std::vector<int>& counts, LineCounts& non_empty) {
+		for (size_t i = 0; i < counts.size(); ++i) {
+			if (counts[i] > 0) {
+				non_empty.Add(static_cast<int>(i), counts[i]);
+			}
+		}
+	};
+	fill_counts(row_counts, sheet->non_empty_rows);
+	fill_counts(col_counts, sheet->non_empty_cols);
+	sheet->dependents_ = dependents.Build();
+	sheet->size_ = { view.header->rows, view.header->cols };
+	return sheet;
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(const std::string& path) {
+	const MappedFile file(path);
+	return ReadSnapshot(file.GetData());
+}
+
+void Sheet::ApplyBatch(Batch batch) {
+	CheckCircularDependencies(batch);
+
+	// dependents are added once all the cells are in place, so putting
+	// a cell doesn't walk the formulas of the batch referring to it
+	std::vector<std::pair<Position, Cell*>> new_cells;
+	new_cells.reserve(batch.size());
+	for (auto& [pos, cell] : batch) {
+		ResizeTable(pos);
+		new_cells.emplace_back(pos, &AddNewCellToSheet(pos, std::move(cell)));
+	}
+	for (const auto& [pos, cell] : new_cells) {
+		SetChildCells(pos, *cell);
+	}
+	if (!new_cells.empty()) {
+		++edit_count_;
+	}
+}
+
+void Sheet::CheckCircularDependencies(const Batch& batch) const {
+	auto find_in_batch = [&batch](Position pos) -> const Cell* {
+		auto it = std::lower_bound(batch.begin(), batch.end(), pos, [](const auto& edit, Position pos) {
+			return edit.first < pos;
+			});
+		return it != batch.end() && it->first == pos ? it->second.get() : nullptr;
+	};
+	// cells as they will be once the batch is applied
+	auto find_cell = [&](Position pos) -> const Cell* {
+		const Cell* cell = find_in_batch(pos);
+		return cell ? cell : FindCell(pos);
+	};
+
+	// formulas of the batch by columns, to find those in ranges
+	std::vector<Position> batch_formulas;
+	for (const auto& [pos, cell] : batch) {
+		if (cell->IsFormula()) {
+			batch_formulas.push_back(pos);
+		}
+	}
+	auto by_columns = [](Position lhs, Position rhs) {
+		return std::tie(lhs.col, lhs.row) < std::tie(rhs.col, rhs.row);
+	};
+	std::sort(batch_formulas.begin(), batch_formulas.end(), by_columns);
+
+	auto for_each_precedent = [&](const Cell& cell, auto func) {
+		for (const Position& parent_pos : cell.GetParentCells()) {
+			func(parent_pos);
+		}
+		for (const Range& range : cell.GetRanges()) {
+			for (int col = range.first.col; col <= range.last.col; ++col) {
+				numbers_.ForEachFormula(col, range.first.row, range.last.row, [&](int row) {
+					// the batch decides for the cells it sets
+					if (!find_in_batch({ row, col })) {
+						func(Position{ row, col });
+					}
+					});
+			}
+			auto it = std::lower_bound(batch_formulas.begin(), batch_formulas.end(), range.first, by_columns);
+			while (it != batch_formulas.end() && it->col <= range.last.col) {
+				if (it->row > range.last.row) {
+					it = std::lower_bound(it, batch_formulas.end(), Position{ range.first.row, it->col + 1 }, by_columns);
+				}
+				else if (it->row < range.first.row) {
+					it = std::lower_bound(it, batch_formulas.end(), Position{ range.first.row, it->col }, by_columns);
+				}
+				else {
+					func(*it++);
+				}
+			}
+		}
+	};
+
+	// Iterative DFS over precedents from the formulas of the batch.
+	// The sheet had no cycles, so a new one goes through the batch.
+	// A cell is on the current path until all of its precedents are done.
+	// Cells of the batch keep their state by index, others in a map.
+	using State = WalkState;
+	std::vector<State> batch_states(batch.size(), State::New);
+	walk_states_.Clear();
+	// the state is used before the next is looked up, which may move it
+	auto get_state = [&](Position pos) -> State& {
+		auto it = std::lower_bound(batch.begin(), batch.end(), pos, [](const auto& edit, Position pos) {
+			return edit.first < pos;
+			});
+		if (it != batch.end() && it->first == pos) {
+			return batch_states[it - batch.begin()];
+		}
+		return *walk_states_.Insert(pos).first;
+	};
+
+	std::vector<std::pair<Position, bool>> stack;
+	for (Position root : batch_formulas) {
+		stack.push_back({ root, false });
+		while (!stack.empty()) {
+			auto [pos, expanded] = stack.back();
+			stack.pop_back();
+			State& state = get_state(pos);
+			if (expanded) {
+				state = State::Done;
+				continue;
+			}
+			if (state == State::OnPath) {
+				throw CircularDependencyException("Circular dependency found!");
+			}
+			if (state == State::Done) {
+				continue;
+			}
+
+			state = State::OnPath;
+			stats_.Add(StatCounters::CYCLE_CHECK_NODES);
+			stack.push_back({ pos, true });
+			for_each_precedent(*find_cell(pos), [&](Position parent_pos) {
+				// only formulas have precedents to follow
+				const Cell* parent = find_cell(parent_pos);
+				if (parent && parent->IsFormula()) {
+					stack.push_back({ parent_pos, false });
+				}
+				});
+		}
+	}
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
 	CheckPosition(pos);
 
-	if (pos.row < static_cast<int>(sheet_.size()) && pos.col < static_cast<int>(sheet_.at(pos.row).size())
-		&& sheet_.at(pos.row).at(pos.col)) {
-		return sheet_.at(pos.row).at(pos.col).get();
-
+	if (Cell* cell = FindCell(pos)) {
+		return cell;
 	}
 	else if (IsInsidePrintZone(pos, size_)) {
-		const_cast<Sheet*>(this)->SetCell(pos, {});
-		return sheet_.at(pos.row).at(pos.col).get();
+		// a read doesn't create cells, empty ones all look the same
+		return &empty_cell_;
 	}
 	else {
 		return nullptr;
@@ -105,71 +610,425 @@ CellInterface* Sheet::GetCell(Position pos) {
 
 void Sheet::ClearCell(Position pos) {
 	CheckPosition(pos);
+	++revision_;
 
-	if (pos.row < static_cast<int>(sheet_.size()) && pos.col < static_cast<int>(sheet_.at(pos.row).size())) {
-		sheet_.at(pos.row).at(pos.col)->Clear();
-		--non_empty_cols[pos.col];
-		--non_empty_rows[pos.row];
+	Cell* cell = FindOwnCell(pos);
+	if (!cell) {
+		return;
+	}
 
-		if (non_empty_cols[pos.col] == 0) {
-			non_empty_cols.erase(pos.col);
-		}
+	RemoveChildCells(pos, *cell);
+	cell->Clear();
+	numbers_.Erase(pos);
+	MarkUnpublished(pos);
+	// formulas referring to pos stay in the graph
+	if (base_) {
+		cleared_.Insert(pos);
+	}
+	cells_.Take(pos);
+	RemoveFromPrintableArea(pos);
+	++edit_count_;
+}
 
-		if (non_empty_rows[pos.row] == 0) {
-			non_empty_rows.erase(pos.row);
-		}
+void Sheet::RemoveFromPrintableArea(Position pos) {
+	non_empty_cols.Remove(pos.col);
+	non_empty_rows.Remove(pos.row);
+	size_ = { non_empty_rows.GetEnd(), non_empty_cols.GetEnd() };
+}
 
-		if (non_empty_cols.empty() || non_empty_rows.empty()) {
-			sheet_.clear();
-			size_ = { 0, 0 };
-			return;
+Size Sheet::GetPrintableSize() const {
+	return size_;
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+	// values are brought up to date first, so formatting them
+	// only reads the cells
+	const_cast<Sheet*>(this)->Recalculate();
+	Print(output, &Cell::AppendValue);
+}
+void Sheet::PrintTexts(std::ostream& output) const {
+	Print(output, &Cell::AppendText);
+}
+
+void Sheet::SetPrintThreads(size_t thread_count) {
+	print_threads_ = std::max<size_t>(thread_count, 1);
+}
+
+void Sheet::Print(std::ostream& output, AppendFunc append) const {
+	// Blocks of rows are formatted into buffers, a buffer per thread
+	// reused from round to round, and written in order after each round
+	const int block_count = (size_.rows + PRINT_BLOCK_ROWS - 1) / PRINT_BLOCK_ROWS;
+	std::vector<std::string> buffers(std::min<size_t>(print_threads_, block_count));
+	for (int first_block = 0; first_block < block_count; first_block += static_cast<int>(buffers.size())) {
+		const size_t round_size = std::min<size_t>(buffers.size(), block_count - first_block);
+		ParallelFor(round_size, print_threads_, [&](size_t i) {
+			const int first_row = (first_block + static_cast<int>(i)) * PRINT_BLOCK_ROWS;
+			buffers[i].clear();
+			PrintRows(buffers[i], first_row, std::min(first_row + PRINT_BLOCK_ROWS, size_.rows), append);
+			}, 1);
+		for (size_t i = 0; i < round_size; ++i) {
+			output.write(buffers[i].data(), buffers[i].size());
 		}
+	}
+}
 
-		if (pos.row == size_.rows - 1 && !non_empty_rows.count(pos.row)) {
-			int new_height = 1 + non_empty_rows.rbegin()->first;
-			sheet_.resize(new_height);
-			size_.rows = new_height;
+void Sheet::PrintRows(std::string& out, int first_row, int last_row, AppendFunc append) const {
+	constexpr int TILE_SIZE = CellStorage::TILE_SIZE;
+	const int tile_cols = (size_.cols + TILE_SIZE - 1) / TILE_SIZE;
+	std::vector<const CellStorage::Tile*> band(tile_cols);
+	// values of formulas found up to date are counted once for
+	// the rows rather than a counter update per cell
+	const bool prints_values = append == &Cell::AppendValue;
+	std::uint64_t cache_hits = 0;
+	for (int row = first_row; row < last_row; ++row) {
+		// tiles are looked up once per band of TILE_SIZE rows
+		if (row == first_row || row % TILE_SIZE == 0) {
+			for (int tile_col = 0; tile_col < tile_cols; ++tile_col) {
+				band[tile_col] = cells_.FindTile(row / TILE_SIZE, tile_col);
+			}
+		}
+		// each column is followed by a tab, the last one is replaced
+		for (int tile_col = 0; tile_col < tile_cols; ++tile_col) {
+			const int first_col = tile_col * TILE_SIZE;
+			const int last_col = std::min(first_col + TILE_SIZE, size_.cols);
+			const CellStorage::Tile* tile = band[tile_col];
+			if (!tile && !base_) {
+				out.append(last_col - first_col, '\t');
+				continue;
+			}
+			for (int col = first_col; col < last_col; ++col) {
+				// a fork looks up what it hasn't changed in the base
+				const Cell* cell = base_ ? FindCell({ row, col }) : tile->Get(row % TILE_SIZE, col % TILE_SIZE);
+				if (cell) {
+					cache_hits += prints_values && cell->IsFormula() && !cell->IsDirty();
+					(cell->*append)(out);
+				}
+				out += '\t';
+			}
+		}
+		if (size_.cols > 0) {
+			out.back() = '\n';
 		}
+		else {
+			out += '\n';
+		}
+	}
+	if (cache_hits > 0) {
+		stats_.Add(StatCounters::CACHE_HITS, cache_hits);
+	}
+}
+
+RangeStats Sheet::GetRangeStats(Range range) const {
+	RangeStats stats;
+	for (int col = range.first.col; col <= range.last.col && !stats.error; ++col) {
+		numbers_.Aggregate(col, range.first.row, range.last.row, stats);
+		numbers_.ForEachFormula(col, range.first.row, range.last.row, [&](int row) {
+			if (stats.error) {
+				return;
+			}
+			const CellInterface::Value value = FindCell({ row, col })->GetValue();
+			if (const double* number = std::get_if<double>(&value)) {
+				stats.Add(*number);
+			}
+			else {
+				stats.error = std::get<FormulaError>(value);
+			}
+			});
+	}
+	return stats;
+}
 
-		if (pos.col == size_.cols - 1 && !non_empty_cols.count(pos.col)) {
-			int new_width = 1 + non_empty_cols.rbegin()->first;
+void Sheet::Publish() {
+	if (!published_once_) {
+		Recalculate();
+		ForEachCell([this](Position pos, const Cell&) {
+			unpublished_segments_.insert(GetSegmentKey(pos));
+			});
+	}
 
-			for (auto& row : sheet_) {
-				if (static_cast<int>(row.size()) > new_width) {
-					row.resize(new_width);
+	// the marked segments hold every cell edited or outdated since
+	// the last publication, so only their formulas may be outdated
+	constexpr int TILE_SIZE = CellStorage::TILE_SIZE;
+	auto for_each_cell = [this](std::uint64_t key, auto func) {
+		const int row = static_cast<int>(key >> 32);
+		const int tile_col = static_cast<int>(key & 0xFFFFFFFF);
+		if (base_) {
+			for (int col = tile_col * TILE_SIZE; col < (tile_col + 1) * TILE_SIZE; ++col) {
+				if (const Cell* cell = FindCell({ row, col })) {
+					func(*cell, Position{ row, col });
+				}
+			}
+		}
+		else if (const CellStorage::Tile* tile = cells_.FindTile(row / TILE_SIZE, tile_col)) {
+			for (int col = 0; col < TILE_SIZE; ++col) {
+				if (const Cell* cell = tile->Get(row % TILE_SIZE, col)) {
+					func(*cell, Position{ row, tile_col * TILE_SIZE + col });
 				}
 			}
-			size_.cols = new_width;
 		}
+	};
+	std::vector<Position> dirty_cells;
+	for (std::uint64_t key : unpublished_segments_) {
+		for_each_cell(key, [&dirty_cells](const Cell& cell, Position pos) {
+			if (cell.IsDirty()) {
+				dirty_cells.push_back(pos);
+			}
+			});
+	}
+	Recalculate(dirty_cells);
+
+	const std::shared_ptr<const SheetVersion> last = GetPublished();
+	SheetVersion::Builder builder(published_once_ ? last.get() : nullptr);
+	for (std::uint64_t key : unpublished_segments_) {
+		SheetVersion::Segment segment;
+		for_each_cell(key, [&segment](const Cell& cell, Position pos) {
+			segment.emplace_back(cell, pos);
+			});
+		builder.SetSegment(static_cast<int>(key >> 32), static_cast<int>(key & 0xFFFFFFFF), std::move(segment));
 	}
+	// clear() would go over every bucket, as many as the first
+	// publication needed for all the segments of the sheet
+	std::unordered_set<std::uint64_t>().swap(unpublished_segments_);
+	published_once_ = true;
+	std::atomic_store(&published_, builder.Build(size_, revision_));
 }
 
-Size Sheet::GetPrintableSize() const {
-	return size_;
+std::shared_ptr<const SheetVersion> Sheet::GetPublished() const {
+	return std::atomic_load(&published_);
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-	Print(output, &Cell::GetValue);
+std::shared_ptr<const Sheet> Sheet::Freeze(std::unique_ptr<Sheet> sheet) {
+	// forks never evaluate the base's formulas, they copy them first
+	sheet->Recalculate();
+	if (sheet->fork_depth_ > MAX_FORK_DEPTH) {
+		sheet->Flatten();
+	}
+	// forks copy the graph, with the delta compacted they only share its rows
+	sheet->dependents_.Compact();
+	sheet->frozen_ = true;
+	return sheet;
 }
-void Sheet::PrintTexts(std::ostream& output) const {
-	Print(output, &Cell::GetText);
+
+std::unique_ptr<Sheet> Sheet::Fork(std::shared_ptr<const Sheet> base) {
+	if (!base->frozen_) {
+		throw std::invalid_argument("Only a frozen sheet can be forked");
+	}
+	auto sheet = std::make_unique<Sheet>();
+	// the columns and the line counts are shared until changed
+	sheet->numbers_ = base->numbers_;
+	sheet->dependents_ = base->dependents_;
+	sheet->non_empty_cols = base->non_empty_cols;
+	sheet->non_empty_rows = base->non_empty_rows;
+	sheet->size_ = base->size_;
+	sheet->revision_ = base->revision_;
+	sheet->edit_count_ = base->edit_count_;
+	sheet->recalculation_threads_ = base->recalculation_threads_;
+	sheet->parallel_threshold_ = base->parallel_threshold_;
+	sheet->print_threads_ = base->print_threads_;
+	sheet->fork_depth_ = base->fork_depth_ + 1;
+	sheet->base_ = std::move(base);
+	return sheet;
 }
 
-std::unique_ptr<SheetInterface> CreateSheet() {
-	return std::make_unique<Sheet>();
+size_t Sheet::GetForkDepth() const {
+	return fork_depth_;
+}
+
+void Sheet::Flatten() {
+	std::shared_ptr<const Sheet> first = base_;
+	while (first->base_) {
+		first = first->base_;
+	}
+	// bases from the nearest one, what the sheet has by then hides the rest;
+	// their formulas are evaluated, frozen as they are
+	for (const Sheet* sheet = base_.get(); sheet != first.get(); sheet = sheet->base_.get()) {
+		sheet->cells_.ForEach([&](Position pos, const Cell& base_cell) {
+			if (HasChanged(pos)) {
+				return;
+			}
+			CellStorage::CellPtr cell = cells_.MakeCell(*this, pos);
+			cell->CopyFrom(base_cell);
+			for (const Range& range : cell->GetRanges()) {
+				range_dependents_.Add(pos, range);
+			}
+			cells_.Put(pos, std::move(cell));
+			});
+		sheet->cleared_.ForEach([&](Position pos, bool) {
+			if (!HasChanged(pos)) {
+				cleared_.Insert(pos);
+			}
+			});
+	}
+	// the bases in between are freed unless other sheets refer to them
+	base_ = std::move(first);
+	fork_depth_ = 1;
 }
 
-void PrintEmpty(std::ostream& output, int num) {
-	for (int i = 0; i < num - 1; ++i) {
-		output << '\t';
+void Sheet::MarkUnpublished(Position pos) {
+	if (published_once_) {
+		unpublished_segments_.insert(GetSegmentKey(pos));
 	}
 }
 
+std::unique_ptr<SheetInterface> CreateSheet() {
+	return std::make_unique<Sheet>();
+}
+
 void Sheet::ClearCellCache(Position pos) {
 	CheckPosition(pos);
 
-	if (pos.row < static_cast<int>(sheet_.size()) && pos.col < static_cast<int>(sheet_.at(pos.row).size())
-		&& sheet_.at(pos.row).at(pos.col)) {
-		sheet_.at(pos.row).at(pos.col)->ClearCache();
+	if (Cell* cell = FindOwnCell(pos)) {
+		cell->ClearCache();
+		MarkUnpublished(pos);
+	}
+}
+
+void Sheet::InvalidateDependents(Position pos) {
+	// each outdated formula is visited once however many
+	// paths lead to it, and deep chains don't recurse
+	std::vector<Position> stack;
+	auto push = [&stack](Position dependent) {
+		stack.push_back(dependent);
+	};
+	ForEachDependent(pos, push);
+	while (!stack.empty()) {
+		const Position current = stack.back();
+		stack.pop_back();
+		Cell* cell = FindCell(current);
+		if (cell && base_ && !cell->IsDirty()) {
+			// a formula of the base is copied to be marked
+			cell = FindOwnCell(current);
+		}
+		if (cell && cell->Invalidate()) {
+			stats_.Add(StatCounters::CELLS_INVALIDATED);
+			MarkUnpublished(current);
+			ForEachDependent(current, push);
+		}
+	}
+}
+
+const NumericColumns& Sheet::GetNumbers() const {
+	return numbers_;
+}
+
+FormulaInterner& Sheet::GetFormulas() {
+	return formulas_;
+}
+
+SheetStats Sheet::GetStats() const {
+	SheetStats stats = stats_.Get();
+	// formulas parsed by SetCell are counted by the interner
+	stats.formulas_parsed += formulas_.GetParsed();
+	stats.parse_ns += formulas_.GetParseNanoseconds();
+	stats.storage_bytes = cells_.GetMemoryUsage() + numbers_.GetMemoryUsage() + dependents_.GetMemoryUsage();
+	return stats;
+}
+
+void Sheet::ResetStats() {
+	stats_.Reset();
+	formulas_.ResetCounters();
+}
+
+Cell::Revision Sheet::GetRevision() const {
+	return revision_;
+}
+
+size_t Sheet::GetEditCount() const {
+	return edit_count_;
+}
+
+std::vector<Cell*> Sheet::GetRecalculationOrder(const std::vector<Position>& roots) const {
+	// Iterative post-order DFS over outdated precedents, so that
+	// long dependency chains don't exhaust the native stack.
+	// A cell is emitted after all of its precedents.
+	std::vector<Cell*> order;
+	visited_.Clear();
+	std::vector<std::pair<Position, bool>> stack;
+	for (auto it = roots.rbegin(); it != roots.rend(); ++it) {
+		stack.push_back({ *it, false });
+	}
+
+	while (!stack.empty()) {
+		auto [pos, expanded] = stack.back();
+		stack.pop_back();
+
+		if (expanded) {
+			order.push_back(FindCell(pos));
+			continue;
+		}
+		if (!visited_.Insert(pos).second) {
+			continue;
+		}
+
+		const Cell* cell = FindCell(pos);
+		if (!cell || !cell->IsDirty()) {
+			continue;
+		}
+		stack.push_back({ pos, true });
+		ForEachPrecedent(*cell, [&](Position parent_pos) {
+			if (!visited_.Contains(parent_pos)) {
+				stack.push_back({ parent_pos, false });
+			}
+			});
+	}
+	return order;
+}
+
+void Sheet::Recalculate() {
+	std::vector<Position> dirty_cells;
+	cells_.ForEach([&dirty_cells](Position pos, const Cell& cell) {
+		if (cell.IsDirty()) {
+			dirty_cells.push_back(pos);
+		}
+		});
+	Recalculate(dirty_cells);
+}
+
+void Sheet::Recalculate(const std::vector<Position>& dirty_cells) {
+	std::vector<Cell*> order = GetRecalculationOrder(dirty_cells);
+	if (recalculation_threads_ <= 1 || order.size() < parallel_threshold_) {
+		for (Cell* cell : order) {
+			cell->Evaluate();
+		}
+		return;
+	}
+
+	for (const std::vector<Cell*>& level : SplitIntoLevels(order)) {
+		ParallelFor(level.size(), recalculation_threads_, [&level](size_t i) {
+			level[i]->Evaluate();
+			});
+	}
+}
+
+std::vector<std::vector<Cell*>> Sheet::SplitIntoLevels(const std::vector<Cell*>& order) {
+	// A cell's level is one more than the highest level of its outdated
+	// precedents, so cells of one level don't depend on each other.
+	std::unordered_map<const Cell*, size_t> cell_levels;
+	std::vector<std::vector<Cell*>> levels;
+	for (Cell* cell : order) {
+		size_t level = 0;
+		ForEachPrecedent(*cell, [&](Position parent_pos) {
+			auto it = cell_levels.find(FindCell(parent_pos));
+			if (it != cell_levels.end()) {
+				level = std::max(level, it->second + 1);
+			}
+			});
+		cell_levels[cell] = level;
+		if (level == levels.size()) {
+			levels.emplace_back();
+		}
+		levels[level].push_back(cell);
+	}
+	return levels;
+}
+
+void Sheet::SetRecalculationThreads(size_t thread_count, size_t min_cells) {
+	recalculation_threads_ = std::max<size_t>(thread_count, 1);
+	parallel_threshold_ = min_cells;
+}
+
+void Sheet::RecalculateCell(Position pos) {
+	for (Cell* cell : GetRecalculationOrder({ pos })) {
+		cell->Evaluate();
 	}
 }
\ No newline at end of file
@@ -1,11 +1,26 @@
 #pragma once
 
 #include "cell.h"
+#include "cell_storage.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "formula_interner.h"
+#include "line_counts.h"
+#include "numeric_columns.h"
+#include "position_map.h"
+#include "range_index.h"
+#include "sheet_stats.h"
+#include "sheet_version.h"
 
+#include <cstdint>
 #include <functional>
-#include <map>
+#include <memory>
 #include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 using namespace std::literals;
 
@@ -18,13 +33,36 @@ inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value
 	return output;
 }
 
-void PrintEmpty(std::ostream& output, int num);
-
 class Sheet : public SheetInterface {
 public:
 	~Sheet();
 
 	void SetCell(Position pos, std::string text) override;
+	// Sets the cells as SetCell would one by one, a later edit of
+	// a position wins. Cycles are looked for once, in the resulting
+	// dependencies: if a position is invalid, a formula is incorrect
+	// or there is a cycle, throws and the sheet is left as it was.
+	void SetCells(std::vector<std::pair<Position, std::string>> cells);
+	// Sets the cells of a table of texts in the layout PrintTexts writes,
+	// fields separated by tabs, as SetCells would. Formulas are compiled
+	// on up to thread_count threads. Cells of empty fields are left as
+	// they are. Throws std::invalid_argument for another delimiter:
+	// fields aren't quoted, so formulas would be split at their commas.
+	void ImportTexts(std::string_view table, char delimiter = '\t', size_t thread_count = 1);
+	// The same for a file, which is memory-mapped rather than read.
+	// Throws std::system_error if the file can't be read.
+	void LoadTexts(const std::string& path, char delimiter = '\t', size_t thread_count = 1);
+
+	// Writes a binary snapshot of the sheet, see snapshot.h: the cells
+	// with their compiled formulas, cached values and dependencies,
+	// so that a sheet read from it parses and checks nothing again.
+	void SaveSnapshot(std::ostream& output) const;
+	// The sheet of a snapshot in memory aligned to 8 bytes, read in place.
+	// Throws Snapshot::Error if the snapshot is corrupt.
+	static std::unique_ptr<Sheet> ReadSnapshot(std::string_view snapshot);
+	// The same for a file, which is memory-mapped rather than read.
+	// Throws std::system_error if the file can't be read.
+	static std::unique_ptr<Sheet> LoadSnapshot(const std::string& path);
 
 	const CellInterface* GetCell(Position pos) const override;
 	CellInterface* GetCell(Position pos) override;
@@ -36,40 +74,222 @@ public:
 	void PrintValues(std::ostream& output) const override;
 	void PrintTexts(std::ostream& output) const override;
 
+	// Numbers are read from the numeric columns, only formulas
+	// in the range are looked up one by one.
+	RangeStats GetRangeStats(Range range) const override;
+
 	void ClearCellCache(Position pos);
+	// Marks formulas depending on the cell outdated, directly
+	// or through ranges, stopping at those already outdated.
+	void InvalidateDependents(Position pos);
+	Cell::Revision GetRevision() const;
+	// Edits that changed cells, those rejected or changing nothing
+	// aren't counted. A fork starts with the count of its base.
+	size_t GetEditCount() const;
+	Cell* FindCell(Position pos) const;
+	// Numbers held by non-formula cells and marks of formula cells
+	const NumericColumns& GetNumbers() const;
+	// Compiled formulas shared by the cells
+	FormulaInterner& GetFormulas();
+	// Counters of GetStats, the cells count in them too
+	StatCounters& GetStatCounters() const {
+		return stats_;
+	}
+
+	// Evaluates all formulas with outdated values. Each one is
+	// evaluated once, after the cells it refers to, so GetValue
+	// afterwards only reads cached results.
+	void Recalculate();
+	// The same for a single cell and its outdated precedents.
+	void RecalculateCell(Position pos);
+
+	// Recalculate() evaluates independent formulas on up to thread_count
+	// threads once at least min_cells formulas are outdated; smaller sets
+	// are evaluated serially. By default everything is serial. More
+	// threads than the hardware runs at once aren't used, see WorkerPool.
+	void SetRecalculationThreads(size_t thread_count, size_t min_cells = DEFAULT_PARALLEL_THRESHOLD);
+
+	static constexpr size_t DEFAULT_PARALLEL_THRESHOLD = 4096;
+
+	// PrintValues and PrintTexts format blocks of PRINT_BLOCK_ROWS rows
+	// on up to thread_count threads, as many as for recalculation at
+	// most, the output is the same. By default everything is serial.
+	void SetPrintThreads(size_t thread_count);
+
+	static constexpr int PRINT_BLOCK_ROWS = 256;
+
+	// Brings formula values up to date and publishes the state of
+	// the sheet as a new version for readers on other threads. Only
+	// rows of tiles with cells changed since the last publication are
+	// built again, the rest is shared with the last version.
+	void Publish();
+	// The last published version, an empty sheet before the first
+	// Publish. Any thread may call it while the sheet is edited and
+	// read the version it gets for as long as it holds it.
+	std::shared_ptr<const SheetVersion> GetPublished() const;
+
+	// Brings formula values up to date and makes the sheet a base for
+	// forks, which refer to its cells: it can't be changed anymore.
+	// A fork deeper than MAX_FORK_DEPTH takes over the cells of its
+	// bases but the first one, which becomes its base, so lookups go
+	// through a bounded chain however many times sheets are forked.
+	static std::shared_ptr<const Sheet> Freeze(std::unique_ptr<Sheet> sheet);
+	// A sheet starting as the frozen base, made in O(1): it refers to the
+	// base for the cells it hasn't changed. An edit copies from the base
+	// the cells it changes and the formulas it outdates, the rest stays
+	// shared, as do the rows of the dependency graph. Forks of a base don't
+	// see each other and may be used on different threads. A frozen fork
+	// may be forked again, cells are then looked up through the chain.
+	// Throws std::invalid_argument if the base isn't frozen.
+	static std::unique_ptr<Sheet> Fork(std::shared_ptr<const Sheet> base);
+	// Bases the sheet refers to through its chain, 0 if it isn't a fork
+	size_t GetForkDepth() const;
+
+	static constexpr size_t MAX_FORK_DEPTH = 8;
+
+	// What the sheet has done since it was made or since ResetStats,
+	// see SheetStats. The counters are always on and any thread may
+	// read them. Values a fork reads from cells it shares with its base
+	// are counted by the base.
+	SheetStats GetStats() const;
+	void ResetStats();
 
 private:
-	using Row = std::vector <std::unique_ptr<Cell>>;
-	using Id = int;
-
-	template<typename T>
-	void Print(std::ostream& output, T(Cell::*ty)() const) const {
-		for (auto& row : sheet_) {
-			for (size_t i = 0; i < row.size(); ++i) {
-				auto& cell = row[i];
-				if (cell) {
-					const CellInterface::Value val = (*cell.*ty)();
-					output << val;
+	using Batch = std::vector<std::pair<Position, CellStorage::CellPtr>>;
+
+	// Cell::AppendValue or Cell::AppendText
+	using AppendFunc = void (Cell::*)(std::string&) const;
+
+	void Print(std::ostream& output, AppendFunc append) const;
+	// Appends the rows [first_row, last_row) of the printable area
+	void PrintRows(std::string& out, int first_row, int last_row, AppendFunc append) const;
+
+	// Calls func(pos) for the formulas referring to the cell on its own
+	// or through a range, a formula may be reported more than once
+	template <typename Func>
+	void ForEachDependent(Position pos, Func func) const {
+		for (const Position& child_pos : dependents_.Get(pos)) {
+			func(child_pos);
+		}
+		ForEachRangeDependent(pos, func);
+	}
+
+	// Those referring to the cell through a range. The index of a fork
+	// holds the formulas it has changed, the bases' the rest.
+	template <typename Func>
+	void ForEachRangeDependent(Position pos, Func func) const {
+		for (const Sheet* sheet = this; sheet; sheet = sheet->base_.get()) {
+			sheet->range_dependents_.ForEachDependent(pos, [&](Position dependent) {
+				if (!IsChangedAbove(sheet, dependent)) {
+					func(dependent);
 				}
-				if (static_cast<int>(i) < size_.cols - 1) {
-					output << '\t';
+				});
+		}
+	}
+
+	// Calls func(pos, cell) for every cell, in no particular order
+	template <typename Func>
+	void ForEachCell(Func func) const {
+		for (const Sheet* sheet = this; sheet; sheet = sheet->base_.get()) {
+			sheet->cells_.ForEach([&](Position pos, const Cell& cell) {
+				if (!IsChangedAbove(sheet, pos)) {
+					func(pos, cell);
 				}
+				});
+		}
+	}
+
+	// Calls func(pos) for the cells the formula refers to on their own
+	// and for formulas in its ranges: other cells of ranges are never
+	// outdated, so they don't matter for the order of evaluation
+	template <typename Func>
+	void ForEachPrecedent(const Cell& cell, Func func) const {
+		for (const Position& parent_pos : cell.GetParentCells()) {
+			func(parent_pos);
+		}
+		for (const Range& range : cell.GetRanges()) {
+			for (int col = range.first.col; col <= range.last.col; ++col) {
+				numbers_.ForEachFormula(col, range.first.row, range.last.row, [&func, col](int row) {
+					func(Position{ row, col });
+					});
 			}
-			if (static_cast<int>(static_cast<int>(row.size())) < size_.cols) {
-				PrintEmpty(output, size_.cols - static_cast<int>(row.size()));
-			}
-			output << '\n';
 		}
 	}
 
 	void CheckPosition(Position pos) const;
-	void CheckCircularDependency(Position pos, const CellInterface* cell) const;
-	void SetChildCells(Position pos, std::unique_ptr<Cell>& cell);
+	// FindCell for a change: a cell of the base is copied into the fork
+	Cell* FindOwnCell(Position pos);
+	// The cell at pos is the sheet's own or was cleared in it
+	bool HasChanged(Position pos) const;
+	// A fork from this sheet down to base, base excluded, has changed
+	// the cell at pos, so what base has there doesn't count
+	bool IsChangedAbove(const Sheet* base, Position pos) const;
+	// Copies into the sheet what its bases but the first have changed
+	// and makes that one its base, see Freeze
+	void Flatten();
+	// Evaluates the outdated formulas among dirty_cells and
+	// the outdated formulas they refer to
+	void Recalculate(const std::vector<Position>& dirty_cells);
+	std::vector<Cell*> GetRecalculationOrder(const std::vector<Position>& roots) const;
+	std::vector<std::vector<Cell*>> SplitIntoLevels(const std::vector<Cell*>& order);
+	void CheckCircularDependency(Position pos, const Cell& cell) const;
+	// batch sorted by positions, without repetitions
+	void CheckCircularDependencies(const Batch& batch) const;
+	// Puts the cells of the batch into the sheet unless they make a cycle
+	void ApplyBatch(Batch batch);
+	void SetChildCells(Position pos, const Cell& cell);
+	void RemoveChildCells(Position pos, const Cell& cell);
 	void ResizeTable(Position pos);
-	std::unique_ptr<Cell>& AddNewCellToSheet(Position pos, std::unique_ptr<Cell>&& cell);
+	Cell& AddNewCellToSheet(Position pos, CellStorage::CellPtr&& cell);
+	void RemoveFromPrintableArea(Position pos);
+	// The next Publish builds the row segment of pos again
+	void MarkUnpublished(Position pos);
 
-	std::vector<Row> sheet_;
+	CellStorage cells_;
+	NumericColumns numbers_;
+	// formulas by the ranges they refer to
+	RangeIndex range_dependents_;
+	FormulaInterner formulas_;
+	// formulas referring to positions on their own, with cells or not:
+	// referring to a position doesn't create a cell there, nor does
+	// clearing a referenced cell keep it. A fork starts with a copy
+	// of the base's, which shares its rows.
+	DependencyGraph dependents_;
+	// positions a fork has cleared, hiding the base's cells
+	PositionMap<bool> cleared_;
+	// what GetCell gives for the printable area without cells,
+	// never changed
+	Cell empty_cell_{ *this, Position::NONE };
 	Size size_;
-	std::map<Id, int> non_empty_cols;
-	std::map<Id, int> non_empty_rows;
+	LineCounts non_empty_cols;
+	LineCounts non_empty_rows;
+	Cell::Revision revision_ = 0;
+	size_t edit_count_ = 0;
+
+	size_t recalculation_threads_ = 1;
+	size_t parallel_threshold_ = DEFAULT_PARALLEL_THRESHOLD;
+	size_t print_threads_ = 1;
+
+	// accessed with std::atomic_load and std::atomic_store
+	std::shared_ptr<const SheetVersion> published_ = std::make_shared<const SheetVersion>();
+	// until the first Publish nothing is marked, it publishes every cell
+	bool published_once_ = false;
+	// rows of tiles changed since the last Publish, row << 32 | tile column
+	std::unordered_set<std::uint64_t> unpublished_segments_;
+
+	// the sheet a fork refers to for the cells it hasn't changed
+	std::shared_ptr<const Sheet> base_;
+	// length of the chain of bases
+	size_t fork_depth_ = 0;
+	// set by Freeze, only a frozen sheet may be a base
+	bool frozen_ = false;
+
+	// counted on any thread, also by the const methods
+	mutable StatCounters stats_;
+	// states of the walks over the cells of the const methods, which
+	// edits and recalculations make one at a time: kept from walk to
+	// walk, they allocate only for a walk larger than those before
+	enum class WalkState : std::uint8_t { New, OnPath, Done };
+	mutable PositionMap<bool> visited_;
+	mutable PositionMap<WalkState> walk_states_;
 };
\ No newline at end of file
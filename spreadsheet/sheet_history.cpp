@@ -0,0 +1,47 @@
+#include "sheet_history.h"
+
+#include <utility>
+
+SheetHistory::SheetHistory(std::unique_ptr<Sheet> sheet) {
+    checkpoints_.push_back(Sheet::Freeze(std::move(sheet)));
+    sheet_ = Sheet::Fork(checkpoints_.back());
+}
+
+Sheet& SheetHistory::GetSheet() {
+    return *sheet_;
+}
+
+void SheetHistory::Checkpoint() {
+    if (!HasChanged()) {
+        return;
+    }
+    checkpoints_.erase(checkpoints_.begin() + position_ + 1, checkpoints_.end());
+    checkpoints_.push_back(Sheet::Freeze(std::move(sheet_)));
+    position_ = checkpoints_.size() - 1;
+    sheet_ = Sheet::Fork(checkpoints_.back());
+}
+
+bool SheetHistory::Undo() {
+    if (!HasChanged()) {
+        if (position_ == 0) {
+            return false;
+        }
+        --position_;
+    }
+    sheet_ = Sheet::Fork(checkpoints_[position_]);
+    return true;
+}
+
+bool SheetHistory::Redo() {
+    if (HasChanged() || position_ + 1 == checkpoints_.size()) {
+        return false;
+    }
+    ++position_;
+    sheet_ = Sheet::Fork(checkpoints_[position_]);
+    return true;
+}
+
+bool SheetHistory::HasChanged() const {
+    // the revision moves on for rejected edits too, the count doesn't
+    return sheet_->GetEditCount() != checkpoints_[position_]->GetEditCount();
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <memory>
+#include <vector>
+
+// Undo and redo over checkpoints of a sheet. A checkpoint freezes the
+// sheet and editing goes on in a fork of it, so a checkpoint, an undo
+// and a redo each take O(1) whatever the size of the sheet. Cells left
+// as they were are looked up through a fork per checkpoint after them,
+// at most Sheet::MAX_FORK_DEPTH of them: a checkpoint deeper than that
+// takes over what the ones before it changed, see Sheet::Freeze.
+class SheetHistory {
+public:
+    explicit SheetHistory(std::unique_ptr<Sheet> sheet = std::make_unique<Sheet>());
+
+    // The sheet to edit, another one after Checkpoint, Undo and Redo
+    Sheet& GetSheet();
+
+    // Keeps the sheet as it is to come back to, unless it hasn't changed
+    // since the last checkpoint. Checkpoints undone before are dropped.
+    void Checkpoint();
+    // Goes back to the last checkpoint, or to the one before it if
+    // the sheet hasn't changed since. Returns false at the first one.
+    bool Undo();
+    // Goes forward to the checkpoint undone last. Returns false if there
+    // is none or the sheet has changed since the last Undo.
+    bool Redo();
+
+private:
+    bool HasChanged() const;
+
+    std::vector<std::shared_ptr<const Sheet>> checkpoints_;
+    // the checkpoint sheet_ is a fork of
+    size_t position_ = 0;
+    std::unique_ptr<Sheet> sheet_;
+};
@@ -0,0 +1,96 @@
+#include "sheet_stats.h"
+
+#include <algorithm>
+
+namespace {
+
+std::atomic<std::uint64_t> next_counters_id{ 1 };
+
+}  // namespace
+
+StatCounters::StatCounters()
+    : id_(next_counters_id.fetch_add(1, std::memory_order_relaxed)) {
+}
+
+StatCounters::~StatCounters() {
+    shared_->alive.store(false, std::memory_order_relaxed);
+}
+
+StatCounters::ThreadBlocks::~ThreadBlocks() {
+    for (const auto& [shared, block] : blocks_) {
+        std::lock_guard lock(shared->mutex);
+        for (size_t i = 0; i < shared->exited.size(); ++i) {
+            shared->exited[i] += block->values[i].load(std::memory_order_relaxed);
+        }
+        auto it = std::find_if(shared->blocks.begin(), shared->blocks.end(), [block = block](const auto& owned) {
+            return owned.get() == block;
+        });
+        shared->blocks.erase(it);
+    }
+}
+
+StatCounters::Block& StatCounters::ThreadBlocks::Find(const std::shared_ptr<Shared>& shared) {
+    blocks_.erase(std::remove_if(blocks_.begin(), blocks_.end(), [](const auto& entry) {
+        return !entry.first->alive.load(std::memory_order_relaxed);
+    }), blocks_.end());
+    auto it = std::find_if(blocks_.begin(), blocks_.end(), [&shared](const auto& entry) {
+        return entry.first == shared;
+    });
+    if (it != blocks_.end()) {
+        return *it->second;
+    }
+
+    auto block = std::make_unique<Block>();
+    Block& result = *block;
+    {
+        std::lock_guard lock(shared->mutex);
+        shared->blocks.push_back(std::move(block));
+    }
+    blocks_.emplace_back(shared, &result);
+    return result;
+}
+
+StatCounters::Block& StatCounters::FindBlock() {
+    Block& block = thread_blocks_.Find(shared_);
+    // the least recently found block makes room
+    std::move_backward(cached_blocks_.begin(), std::prev(cached_blocks_.end()), cached_blocks_.end());
+    cached_blocks_.front() = { id_, &block };
+    return block;
+}
+
+StatCounters::Values StatCounters::Sum() const {
+    Values sums = shared_->exited;
+    for (const auto& block : shared_->blocks) {
+        for (size_t i = 0; i < sums.size(); ++i) {
+            sums[i] += block->values[i].load(std::memory_order_relaxed);
+        }
+    }
+    return sums;
+}
+
+SheetStats StatCounters::Get() const {
+    std::lock_guard lock(shared_->mutex);
+    Values counts = Sum();
+    for (size_t i = 0; i < counts.size(); ++i) {
+        counts[i] -= reset_at_[i];
+    }
+
+    SheetStats stats;
+    stats.formulas_parsed = counts[FORMULAS_PARSED];
+    stats.parse_ns = counts[PARSE_NS];
+    stats.cache_hits = counts[CACHE_HITS];
+    stats.evaluations = counts[EVALUATIONS];
+    stats.cells_invalidated = counts[CELLS_INVALIDATED];
+    stats.cycle_check_nodes = counts[CYCLE_CHECK_NODES];
+    return stats;
+}
+
+void StatCounters::Reset() {
+    std::lock_guard lock(shared_->mutex);
+    reset_at_ = Sum();
+}
+
+size_t StatCounters::GetBlockCount() const {
+    std::lock_guard lock(shared_->mutex);
+    return shared_->blocks.size();
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// What a sheet has done since it was made or its statistics were
+// last reset, see Sheet::GetStats
+struct SheetStats {
+    // formulas parsed rather than found compiled, and the time it took
+    std::uint64_t formulas_parsed = 0;
+    std::uint64_t parse_ns = 0;
+    // reads of formula values found up to date, by GetValue or printing,
+    // and formulas executed to bring their values up to date
+    std::uint64_t cache_hits = 0;
+    std::uint64_t evaluations = 0;
+    // formulas marked outdated by edits of cells they depend on
+    std::uint64_t cells_invalidated = 0;
+    // cells visited looking for circular dependencies
+    std::uint64_t cycle_check_nodes = 0;
+    // memory held by the cells, the numeric columns and the dependency
+    // graph at the moment of GetStats, not a counter, so a reset leaves
+    // it as it is. A fork counts its own cells, but the column blocks
+    // and graph rows it shares with its base count for both sheets.
+    std::uint64_t storage_bytes = 0;
+};
+
+// The counters of SheetStats, always on. A thread counts in a block of
+// its own with a relaxed load and store rather than an atomic
+// read-modify-write, so counting costs about an increment even while
+// formulas are evaluated on several threads or forks read the cells
+// of their base on theirs. Get adds up the blocks of all threads.
+// A thread exiting adds its block to a total of exited threads and
+// frees it, so there are only blocks of threads still running.
+class StatCounters {
+public:
+    enum Counter {
+        FORMULAS_PARSED,
+        PARSE_NS,
+        CACHE_HITS,
+        EVALUATIONS,
+        CELLS_INVALIDATED,
+        CYCLE_CHECK_NODES,
+        COUNTER_COUNT,
+    };
+
+    StatCounters();
+    StatCounters(const StatCounters&) = delete;
+    StatCounters& operator=(const StatCounters&) = delete;
+    ~StatCounters();
+
+    void Add(Counter counter, std::uint64_t count = 1) {
+        std::atomic<std::uint64_t>& value = GetBlock().values[counter];
+        value.store(value.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    }
+
+    // The counts since the last Reset, storage_bytes left 0
+    SheetStats Get() const;
+    // Counts start again from 0. The blocks of the threads are left
+    // as they are, Get subtracts what they held at the reset.
+    void Reset();
+
+    // Blocks of threads that have counted and are still running
+    size_t GetBlockCount() const;
+
+private:
+    using Values = std::array<std::uint64_t, COUNTER_COUNT>;
+
+    // a cache line of its own, threads don't write each other's
+    struct alignas(64) Block {
+        std::array<std::atomic<std::uint64_t>, COUNTER_COUNT> values{};
+    };
+
+    // Blocks a thread used last, by the ids of their counters: ids
+    // aren't reused, so the block of counters destroyed meanwhile
+    // is never found. Zero-initialized, as thread_local, id 0 is no one's.
+    struct CachedBlock {
+        std::uint64_t id;
+        Block* block;
+    };
+    static constexpr size_t CACHED_BLOCKS = 4;
+    inline static thread_local std::array<CachedBlock, CACHED_BLOCKS> cached_blocks_;
+
+    // What the counters and the threads counting share: a thread may
+    // exit after the counters are gone
+    struct Shared {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Block>> blocks;
+        // sums of the blocks of exited threads
+        Values exited{};
+        // false once the counters are gone
+        std::atomic<bool> alive{ true };
+    };
+
+    // The blocks of a thread, folded into the totals when it exits
+    class ThreadBlocks {
+    public:
+        ThreadBlocks() = default;
+        ThreadBlocks(const ThreadBlocks&) = delete;
+        ThreadBlocks& operator=(const ThreadBlocks&) = delete;
+        ~ThreadBlocks();
+
+        // Finds or makes the block of the thread, blocks of counters
+        // gone are dropped on the way
+        Block& Find(const std::shared_ptr<Shared>& shared);
+
+    private:
+        std::vector<std::pair<std::shared_ptr<Shared>, Block*>> blocks_;
+    };
+    inline static thread_local ThreadBlocks thread_blocks_;
+
+    Block& GetBlock() {
+        for (const CachedBlock& cached : cached_blocks_) {
+            if (cached.id == id_) {
+                return *cached.block;
+            }
+        }
+        return FindBlock();
+    }
+    // Finds or makes the block of the thread and caches it
+    Block& FindBlock();
+    // Sums of the blocks and of exited threads, the mutex held
+    Values Sum() const;
+
+    const std::uint64_t id_;
+    const std::shared_ptr<Shared> shared_ = std::make_shared<Shared>();
+    // the sums at the last Reset, guarded by the mutex
+    Values reset_at_{};
+};
@@ -0,0 +1,198 @@
+#include "sheet_version.h"
+
+#include "FormulaAST.h"
+
+#include <algorithm>
+#include <utility>
+#include <variant>
+
+SheetVersion::PublishedCell::PublishedCell(const Cell& cell, Position pos)
+    : pos_(pos)
+    , text_(cell.GetText())
+    , is_text_(cell.IsText())
+    , formula_(cell.GetSharedFormulaAST()) {
+    if (!is_text_) {
+        value_ = cell.GetValue();
+    }
+}
+
+CellInterface::Value SheetVersion::PublishedCell::GetValue() const {
+    if (is_text_) {
+        return text_.substr(text_.front() == ESCAPE_SIGN ? 1 : 0);
+    }
+    return value_;
+}
+
+std::string SheetVersion::PublishedCell::GetText() const {
+    return text_;
+}
+
+std::vector<Position> SheetVersion::PublishedCell::GetReferencedCells() const {
+    return formula_ ? formula_->GetReferencedCells(pos_) : std::vector<Position>{};
+}
+
+int SheetVersion::PublishedCell::GetCol() const {
+    return pos_.col;
+}
+
+void SheetVersion::PublishedCell::AppendValue(std::string& out) const {
+    if (is_text_) {
+        out.append(text_, text_.front() == ESCAPE_SIGN ? 1 : 0);
+    }
+    else if (const double* number = std::get_if<double>(&value_)) {
+        AppendPrintedNumber(out, *number);
+    }
+    else if (const FormulaError* error = std::get_if<FormulaError>(&value_)) {
+        out += error->ToString();
+    }
+    else {
+        out += std::get<std::string>(value_);
+    }
+}
+
+void SheetVersion::PublishedCell::AppendText(std::string& out) const {
+    out += text_;
+}
+
+SheetVersion::TileKey SheetVersion::GetTileKey(int tile_row, int tile_col) {
+    return (static_cast<TileKey>(tile_row) << 32) | static_cast<std::uint32_t>(tile_col);
+}
+
+const SheetVersion::Tile* SheetVersion::FindTile(int tile_row, int tile_col) const {
+    const size_t block_index = tile_row / BLOCK_ROWS;
+    if (block_index >= blocks_.size() || !blocks_[block_index]) {
+        return nullptr;
+    }
+    const Block& block = *blocks_[block_index];
+    auto it = block.tiles.find(GetTileKey(tile_row, tile_col));
+    return it != block.tiles.end() ? it->second.get() : nullptr;
+}
+
+const SheetVersion::Segment* SheetVersion::FindSegment(int row, int tile_col) const {
+    const Tile* tile = FindTile(row / TILE_SIZE, tile_col);
+    return tile ? tile->rows[row % TILE_SIZE].get() : nullptr;
+}
+
+const CellInterface* SheetVersion::GetCell(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position!");
+    }
+    if (pos.row >= size_.rows || pos.col >= size_.cols) {
+        return nullptr;
+    }
+
+    static const PublishedCell empty_cell;
+    const Segment* segment = FindSegment(pos.row, pos.col / TILE_SIZE);
+    if (!segment) {
+        return &empty_cell;
+    }
+    auto it = std::lower_bound(segment->begin(), segment->end(), pos.col, [](const PublishedCell& cell, int col) {
+        return cell.GetCol() < col;
+    });
+    return it != segment->end() && it->GetCol() == pos.col ? &*it : &empty_cell;
+}
+
+Size SheetVersion::GetPrintableSize() const {
+    return size_;
+}
+
+Cell::Revision SheetVersion::GetRevision() const {
+    return revision_;
+}
+
+void SheetVersion::PrintValues(std::ostream& output) const {
+    Print(output, &PublishedCell::AppendValue);
+}
+
+void SheetVersion::PrintTexts(std::ostream& output) const {
+    Print(output, &PublishedCell::AppendText);
+}
+
+void SheetVersion::Print(std::ostream& output, void (PublishedCell::*append)(std::string&) const) const {
+    // a row at a time, each column followed by a tab and
+    // the last one replaced, as Sheet::Print does
+    const int tile_cols = (size_.cols + TILE_SIZE - 1) / TILE_SIZE;
+    std::string line;
+    for (int row = 0; row < size_.rows; ++row) {
+        line.clear();
+        for (int tile_col = 0; tile_col < tile_cols; ++tile_col) {
+            const int first_col = tile_col * TILE_SIZE;
+            const int last_col = std::min(first_col + TILE_SIZE, size_.cols);
+            int col = first_col;
+            if (const Segment* segment = FindSegment(row, tile_col)) {
+                for (const PublishedCell& cell : *segment) {
+                    if (cell.GetCol() >= last_col) {
+                        break;
+                    }
+                    line.append(cell.GetCol() - col, '\t');
+                    (cell.*append)(line);
+                    col = cell.GetCol();
+                }
+            }
+            line.append(last_col - col, '\t');
+        }
+        if (size_.cols > 0) {
+            line.back() = '\n';
+        }
+        else {
+            line += '\n';
+        }
+        output.write(line.data(), line.size());
+    }
+}
+
+SheetVersion::Builder::Builder(const SheetVersion* base)
+    : version_(std::make_shared<SheetVersion>()) {
+    if (base) {
+        version_->blocks_ = base->blocks_;
+    }
+}
+
+void SheetVersion::Builder::SetSegment(int row, int tile_col, Segment cells) {
+    const TileKey key = GetTileKey(row / TILE_SIZE, tile_col);
+    auto own = own_tiles_.find(key);
+    if (own == own_tiles_.end()) {
+        // the tile of the base is shared, it is copied once
+        const Tile* base = version_->FindTile(row / TILE_SIZE, tile_col);
+        auto tile = base ? std::make_shared<Tile>(*base) : std::make_shared<Tile>();
+        own = own_tiles_.emplace(key, std::move(tile)).first;
+    }
+    own->second->rows[row % TILE_SIZE] = cells.empty() ? nullptr : std::make_shared<const Segment>(std::move(cells));
+}
+
+std::shared_ptr<const SheetVersion> SheetVersion::Builder::Build(Size size, Cell::Revision revision) {
+    // blocks of the changed tiles are copied once as well
+    std::vector<std::shared_ptr<const Block>>& blocks = version_->blocks_;
+    std::unordered_map<size_t, std::shared_ptr<Block>> own_blocks;
+    for (auto& [key, tile] : own_tiles_) {
+        const size_t block_index = (key >> 32) / BLOCK_ROWS;
+        auto own = own_blocks.find(block_index);
+        if (own == own_blocks.end()) {
+            const bool in_base = block_index < blocks.size() && blocks[block_index];
+            auto block = in_base ? std::make_shared<Block>(*blocks[block_index]) : std::make_shared<Block>();
+            own = own_blocks.emplace(block_index, std::move(block)).first;
+        }
+        const bool empty = std::none_of(tile->rows.begin(), tile->rows.end(), [](const auto& segment) {
+            return segment != nullptr;
+        });
+        if (empty) {
+            own->second->tiles.erase(key);
+        }
+        else {
+            own->second->tiles[key] = std::move(tile);
+        }
+    }
+    own_tiles_.clear();
+    for (auto& [block_index, block] : own_blocks) {
+        if (block_index >= blocks.size()) {
+            blocks.resize(block_index + 1);
+        }
+        blocks[block_index] = block->tiles.empty() ? nullptr : std::move(block);
+    }
+    while (!blocks.empty() && !blocks.back()) {
+        blocks.pop_back();
+    }
+    version_->size_ = size;
+    version_->revision_ = revision;
+    return std::move(version_);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "cell.h"
+#include "cell_storage.h"
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A state of a sheet published by Sheet::Publish for concurrent readers.
+// A version never changes once built: it holds the texts and the values
+// of the cells, formulas evaluated, so reading it evaluates nothing.
+//
+// Cells are kept in tiles of CellStorage::TILE_SIZE, each made of row
+// segments, found through blocks of BLOCK_ROWS rows of tiles. A version
+// shares the blocks, tiles and segments left as they were with the
+// version it was built from, so publishing copies the segments with
+// changed cells, their tiles and blocks and the list of blocks. Threads
+// holding a version read it without locks while the sheet is edited,
+// and it is freed when the last of them lets it go.
+class SheetVersion {
+public:
+    class PublishedCell final : public CellInterface {
+    public:
+        PublishedCell() = default;
+        PublishedCell(const Cell& cell, Position pos);
+
+        Value GetValue() const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+
+        int GetCol() const;
+        // As Cell::AppendValue and Cell::AppendText
+        void AppendValue(std::string& out) const;
+        void AppendText(std::string& out) const;
+
+    private:
+        Position pos_;
+        std::string text_;
+        // the value, but of a text cell, which is taken from text_
+        Value value_;
+        bool is_text_ = false;
+        // shared with the sheet, GetReferencedCells expands its
+        // ranges only when it is asked for them
+        std::shared_ptr<const FormulaAST> formula_;
+    };
+
+    // Cells of a row of a tile sorted by column
+    using Segment = std::vector<PublishedCell>;
+
+    class Builder;
+
+    // An empty sheet
+    SheetVersion() = default;
+
+    // As Sheet::GetCell: throws InvalidPositionException for positions
+    // out of the sheet, gives nullptr outside the printable area and
+    // an empty cell for positions without cells inside it
+    const CellInterface* GetCell(Position pos) const;
+    Size GetPrintableSize() const;
+    // Sheet::GetRevision when the version was published
+    Cell::Revision GetRevision() const;
+
+    void PrintValues(std::ostream& output) const;
+    void PrintTexts(std::ostream& output) const;
+
+private:
+    static constexpr int TILE_SIZE = CellStorage::TILE_SIZE;
+
+    struct Tile {
+        // nullptr for rows without cells
+        std::array<std::shared_ptr<const Segment>, TILE_SIZE> rows;
+    };
+
+    using TileKey = std::uint64_t;
+    static TileKey GetTileKey(int tile_row, int tile_col);
+
+    // rows of tiles of a block, a list of blocks is short enough
+    // to be copied for every version
+    static constexpr int BLOCK_ROWS = 16;
+
+    struct Block {
+        // of the tiles with cells
+        std::unordered_map<TileKey, std::shared_ptr<const Tile>> tiles;
+    };
+
+    const Tile* FindTile(int tile_row, int tile_col) const;
+    const Segment* FindSegment(int row, int tile_col) const;
+    void Print(std::ostream& output, void (PublishedCell::*append)(std::string&) const) const;
+
+    // by the first row of tiles, nullptr for blocks without cells
+    std::vector<std::shared_ptr<const Block>> blocks_;
+    Size size_;
+    Cell::Revision revision_ = 0;
+};
+
+// Builds a version from another one by replacing segments
+class SheetVersion::Builder {
+public:
+    // Starts with the cells of base, nothing if it is nullptr
+    explicit Builder(const SheetVersion* base);
+
+    // Replaces the cells of the row in the columns of the tile,
+    // cells sorted by column, none to remove them
+    void SetSegment(int row, int tile_col, Segment cells);
+
+    std::shared_ptr<const SheetVersion> Build(Size size, Cell::Revision revision);
+
+private:
+    std::shared_ptr<SheetVersion> version_;
+    // tiles copied from the base for this version, changed in place
+    std::unordered_map<TileKey, std::shared_ptr<Tile>> own_tiles_;
+};
@@ -0,0 +1,247 @@
+#include "snapshot.h"
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace Snapshot {
+namespace {
+
+constexpr std::uint64_t ALIGNMENT = 8;
+
+std::uint64_t Align(std::uint64_t offset) {
+    return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+template <typename Record>
+const Record* GetSection(std::string_view data, Section section, const char* name) {
+    static_assert(std::is_trivially_copyable_v<Record> && alignof(Record) <= ALIGNMENT);
+    if (section.offset % ALIGNMENT != 0 || section.offset > data.size()
+        || section.count > (data.size() - section.offset) / sizeof(Record)) {
+        throw Error(std::string("Snapshot section out of bounds: ") + name);
+    }
+    return reinterpret_cast<const Record*>(data.data() + section.offset);
+}
+
+void CheckText(const View& view, TextRef ref) {
+    if (ref.offset > view.arena.size() || ref.length > view.arena.size() - ref.offset) {
+        throw Error("Snapshot text out of bounds");
+    }
+}
+
+// Simulates the value and argument stacks of FormulaAST::Execute
+void CheckProgram(const View& view, const FormulaRecord& formula) {
+    using ASTImpl::OpCode;
+
+    if (formula.instruction_count == 0) {
+        throw Error("Snapshot formula is empty");
+    }
+    std::uint64_t values = 0;
+    std::uint64_t arguments = 0;
+    for (std::uint64_t i = 0; i < formula.instruction_count; ++i) {
+        const InstructionRecord& instr = view.instructions[formula.first_instruction + i];
+        if (instr.code > static_cast<std::uint8_t>(OpCode::Count)) {
+            throw Error("Snapshot formula has an unknown operation");
+        }
+        bool valid = true;
+        switch (static_cast<OpCode>(instr.code)) {
+            case OpCode::PushNumber:
+            case OpCode::LoadCell:
+                ++values;
+                break;
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Multiply:
+            case OpCode::Divide:
+                valid = values >= 2;
+                --values;
+                break;
+            case OpCode::UnaryPlus:
+            case OpCode::UnaryMinus:
+                valid = values >= 1;
+                break;
+            case OpCode::LoadRange:
+                valid = instr.cols > 0 && instr.count > 0;
+                ++arguments;
+                break;
+            case OpCode::Collect:
+                valid = values >= 1;
+                --values;
+                ++arguments;
+                break;
+            default:
+                valid = instr.count > 0 && arguments >= instr.count;
+                arguments -= instr.count;
+                ++values;
+        }
+        if (!valid) {
+            throw Error("Snapshot formula is malformed");
+        }
+    }
+    if (values != 1 || arguments != 0) {
+        throw Error("Snapshot formula is malformed");
+    }
+}
+
+}  // namespace
+
+ASTImpl::Program View::GetProgram(std::uint64_t index) const {
+    const FormulaRecord& formula = formulas[index];
+    ASTImpl::Program program;
+    program.reserve(formula.instruction_count);
+    for (std::uint64_t i = 0; i < formula.instruction_count; ++i) {
+        const InstructionRecord& record = instructions[formula.first_instruction + i];
+        ASTImpl::Instruction instr;
+        instr.code = static_cast<ASTImpl::OpCode>(record.code);
+        instr.cols = record.cols;
+        instr.count = record.count;
+        if (instr.code == ASTImpl::OpCode::PushNumber) {
+            instr.operand.number = record.number;
+        }
+        else {
+            instr.operand.cell = { record.row, record.col };
+        }
+        program.push_back(instr);
+    }
+    return program;
+}
+
+View Open(std::string_view data) {
+    if (reinterpret_cast<std::uintptr_t>(data.data()) % ALIGNMENT != 0) {
+        throw Error("Snapshot data isn't aligned");
+    }
+    if (data.size() < sizeof(Header)) {
+        throw Error("Snapshot is truncated");
+    }
+
+    View view;
+    view.header = reinterpret_cast<const Header*>(data.data());
+    const Header& header = *view.header;
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw Error("Not a sheet snapshot");
+    }
+    if (header.byte_order != BYTE_ORDER_MARK) {
+        throw Error("Snapshot is of another byte order");
+    }
+    if (header.version != VERSION) {
+        throw Error("Snapshot version " + std::to_string(header.version) + " isn't supported");
+    }
+    if (header.rows < 0 || header.rows > Position::MAX_ROWS || header.cols < 0 || header.cols > Position::MAX_COLS) {
+        throw Error("Snapshot size is out of the sheet");
+    }
+
+    view.formulas = GetSection<FormulaRecord>(data, header.formulas, "formulas");
+    view.instructions = GetSection<InstructionRecord>(data, header.instructions, "instructions");
+    view.cells = GetSection<CellRecord>(data, header.cells, "cells");
+    view.children = GetSection<PositionRecord>(data, header.children, "children");
+    view.arena = data.substr(GetSection<char>(data, header.arena, "arena") - data.data(), header.arena.count);
+
+    for (std::uint64_t i = 0; i < header.formulas.count; ++i) {
+        const FormulaRecord& formula = view.formulas[i];
+        if (formula.first_instruction > header.instructions.count
+            || formula.instruction_count > header.instructions.count - formula.first_instruction) {
+            throw Error("Snapshot formula out of bounds");
+        }
+        CheckText(view, formula.form);
+        CheckProgram(view, formula);
+    }
+
+    std::uint64_t child_count = 0;
+    for (std::uint64_t i = 0; i < header.cells.count; ++i) {
+        const CellRecord& cell = view.cells[i];
+        if (!Position{ cell.row, cell.col }.IsValid() || cell.kind > CellKind::Formula) {
+            throw Error("Snapshot cell is malformed");
+        }
+        if (cell.kind == CellKind::NumericText || cell.kind == CellKind::Text) {
+            CheckText(view, cell.text);
+        }
+        if (cell.kind == CellKind::Formula && cell.formula >= header.formulas.count) {
+            throw Error("Snapshot formula index out of bounds");
+        }
+        if (cell.error > static_cast<std::uint8_t>(FormulaError::Category::Div0) + 1) {
+            throw Error("Snapshot cell is malformed");
+        }
+        child_count += cell.child_count;
+    }
+    if (child_count != header.children.count) {
+        throw Error("Snapshot children don't match the cells");
+    }
+    for (std::uint64_t i = 0; i < header.children.count; ++i) {
+        if (!Position{ view.children[i].row, view.children[i].col }.IsValid()) {
+            throw Error("Snapshot child is out of the sheet");
+        }
+    }
+    return view;
+}
+
+Writer::Writer(Size size) {
+    std::memcpy(header_.magic, MAGIC, sizeof(MAGIC));
+    header_.version = VERSION;
+    header_.byte_order = BYTE_ORDER_MARK;
+    header_.rows = size.rows;
+    header_.cols = size.cols;
+}
+
+std::uint64_t Writer::AddFormula(const FormulaAST& formula, std::string_view form) {
+    const ASTImpl::Program& program = formula.GetProgram();
+    formulas_.push_back({ instructions_.size(), program.size(), AddText(form) });
+    for (const ASTImpl::Instruction& instr : program) {
+        InstructionRecord record{};
+        record.code = static_cast<std::uint8_t>(instr.code);
+        record.cols = instr.cols;
+        record.count = instr.count;
+        if (instr.code == ASTImpl::OpCode::PushNumber) {
+            record.number = instr.operand.number;
+        }
+        else if (instr.code == ASTImpl::OpCode::LoadCell || instr.code == ASTImpl::OpCode::LoadRange) {
+            record.row = instr.operand.cell.row;
+            record.col = instr.operand.cell.col;
+        }
+        instructions_.push_back(record);
+    }
+    return formulas_.size() - 1;
+}
+
+void Writer::AddCell(CellRecord record, const Position* first_child, const Position* last_child) {
+    record.child_count = static_cast<std::uint32_t>(last_child - first_child);
+    cells_.push_back(record);
+    for (const Position* child = first_child; child != last_child; ++child) {
+        children_.push_back({ child->row, child->col });
+    }
+}
+
+TextRef Writer::AddText(std::string_view text) {
+    const TextRef ref{ arena_.size(), text.size() };
+    arena_ += text;
+    return ref;
+}
+
+void Writer::Write(std::ostream& output) const {
+    Header header = header_;
+    std::uint64_t offset = Align(sizeof(Header));
+    auto place = [&offset](Section& section, size_t count, size_t record_size) {
+        section = { offset, count };
+        offset = Align(offset + count * record_size);
+    };
+    place(header.formulas, formulas_.size(), sizeof(FormulaRecord));
+    place(header.instructions, instructions_.size(), sizeof(InstructionRecord));
+    place(header.cells, cells_.size(), sizeof(CellRecord));
+    place(header.children, children_.size(), sizeof(PositionRecord));
+    place(header.arena, arena_.size(), 1);
+
+    std::uint64_t written = 0;
+    auto write = [&output, &written](const void* data, size_t size) {
+        static constexpr char PADDING[ALIGNMENT] = {};
+        output.write(PADDING, Align(written) - written);
+        output.write(static_cast<const char*>(data), size);
+        written = Align(written) + size;
+    };
+    write(&header, sizeof(header));
+    write(formulas_.data(), formulas_.size() * sizeof(FormulaRecord));
+    write(instructions_.data(), instructions_.size() * sizeof(InstructionRecord));
+    write(cells_.data(), cells_.size() * sizeof(CellRecord));
+    write(children_.data(), children_.size() * sizeof(PositionRecord));
+    write(arena_.data(), arena_.size());
+}
+
+}  // namespace Snapshot
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "FormulaAST.h"
+#include "common.h"
+
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Binary snapshot of a sheet, see Sheet::SaveSnapshot. A snapshot is
+// a header followed by arrays of fixed-size records, each aligned to
+// 8 bytes, so a mapped file is read in place:
+//   formulas      compiled formulas shared by the cells, by index
+//   instructions  their programs, positions relative to the cell
+//   cells         every cell with its content and cached value
+//   children      cells referring to each cell, sorted, CSR-style:
+//                 a cell's children follow those of the cell before
+//   arena         texts of the cells and relative forms of formulas
+// Records are in the byte order of the machine that wrote them,
+// a snapshot of another byte order is rejected.
+namespace Snapshot {
+
+inline constexpr char MAGIC[8] = { 'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P' };
+inline constexpr std::uint32_t VERSION = 1;
+inline constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+// The snapshot is truncated, corrupt or of another version
+class Error : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+struct Section {
+    std::uint64_t offset = 0;
+    std::uint64_t count = 0;
+};
+
+struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    // printable size
+    std::int32_t rows;
+    std::int32_t cols;
+    Section formulas;
+    Section instructions;
+    Section cells;
+    Section children;
+    Section arena;
+};
+
+struct TextRef {
+    std::uint64_t offset;
+    std::uint64_t length;
+};
+
+struct FormulaRecord {
+    std::uint64_t first_instruction;
+    std::uint64_t instruction_count;
+    TextRef form;
+};
+
+struct InstructionRecord {
+    std::uint8_t code;
+    std::uint8_t reserved;
+    std::uint16_t cols;
+    std::uint32_t count;
+    // the number or the position of ASTImpl::Instruction
+    double number;
+    std::int32_t row;
+    std::int32_t col;
+};
+
+enum class CellKind : std::uint8_t {
+    Empty,
+    // a number kept as double
+    Number,
+    // a text read as a number, CellRecord::number
+    NumericText,
+    Text,
+    Formula,
+};
+
+// CellRecord::flags
+inline constexpr std::uint8_t CLEARED = 1;  // no cell, only formulas referring to it
+inline constexpr std::uint8_t CACHED = 2;   // the formula value is up to date
+
+struct CellRecord {
+    std::int32_t row;
+    std::int32_t col;
+    CellKind kind;
+    std::uint8_t flags;
+    // FormulaError::Category + 1 of a cached error, 0 for a number
+    std::uint8_t error;
+    std::uint8_t reserved;
+    std::uint32_t child_count;
+    // Number, NumericText: the number, Formula: the cached number
+    double number;
+    // NumericText, Text
+    TextRef text;
+    // Formula: index of the formula
+    std::uint64_t formula;
+};
+
+struct PositionRecord {
+    std::int32_t row;
+    std::int32_t col;
+};
+
+// Sections of a snapshot viewed in place
+struct View {
+    const Header* header = nullptr;
+    const FormulaRecord* formulas = nullptr;
+    const InstructionRecord* instructions = nullptr;
+    const CellRecord* cells = nullptr;
+    const PositionRecord* children = nullptr;
+    std::string_view arena;
+
+    std::string_view GetText(TextRef ref) const {
+        return arena.substr(ref.offset, ref.length);
+    }
+
+    // Program of the formula at index
+    ASTImpl::Program GetProgram(std::uint64_t index) const;
+};
+
+// Checks the header, the bounds of the sections and of the references
+// between them, and that programs are well-formed. The data must be
+// aligned to 8 bytes. Throws Snapshot::Error.
+View Open(std::string_view data);
+
+// Collects the sections and writes them with the header
+class Writer {
+public:
+    explicit Writer(Size size);
+
+    // Returns the index of the formula
+    std::uint64_t AddFormula(const FormulaAST& formula, std::string_view form);
+    // children [first_child, last_child) sorted without repetitions
+    void AddCell(CellRecord record, const Position* first_child, const Position* last_child);
+    TextRef AddText(std::string_view text);
+
+    void Write(std::ostream& output) const;
+
+private:
+    Header header_{};
+    std::vector<FormulaRecord> formulas_;
+    std::vector<InstructionRecord> instructions_;
+    std::vector<CellRecord> cells_;
+    std::vector<PositionRecord> children_;
+    std::string arena_;
+};
+
+}  // namespace Snapshot
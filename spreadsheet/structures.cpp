@@ -1,8 +1,9 @@
 #include "common.h"
 
 #include <cctype>
-#include <sstream>
+#include <charconv>
 #include <algorithm>
+#include <system_error>
 
 const int LETTERS = 26;
 const int MAX_POSITION_LENGTH = 17;
@@ -59,8 +60,9 @@ Position Position::FromString(std::string_view str) {
     }
 
     int row;
-    std::istringstream row_in{ std::string{digits} };
-    if (!(row_in >> row) || !row_in.eof()) {
+    const char* digits_end = digits.data() + digits.size();
+    const auto [row_end, error] = std::from_chars(digits.data(), digits_end, row);
+    if (error != std::errc() || row_end != digits_end) {
         return Position::NONE;
     }
 
@@ -75,4 +77,68 @@ Position Position::FromString(std::string_view str) {
 
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
+}
+
+bool Range::operator==(Range rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return first.row <= pos.row && pos.row <= last.row && first.col <= pos.col && pos.col <= last.col;
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+    if (first == last) {
+        return first.ToString();
+    }
+    return first.ToString() + ':' + last.ToString();
+}
+
+Range Range::FromCorners(Position a, Position b) {
+    return { { std::min(a.row, b.row), std::min(a.col, b.col) },
+             { std::max(a.row, b.row), std::max(a.col, b.col) } };
+}
+
+void RangeStats::Add(double value) {
+    sum += value;
+    min = std::min(min, value);
+    max = std::max(max, value);
+    ++count;
+}
+
+void RangeStats::Merge(const RangeStats& other) {
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    count += other.count;
+    if (!error) {
+        error = other.error;
+    }
+}
+
+RangeStats SheetInterface::GetRangeStats(Range range) const {
+    RangeStats stats;
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            const CellInterface* cell = GetCell({ row, col });
+            if (!cell) {
+                continue;
+            }
+            CellInterface::Value value = cell->GetValue();
+            if (const double* number = std::get_if<double>(&value)) {
+                stats.Add(*number);
+            } else if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+                stats.error = *error;
+                return stats;
+            }
+        }
+    }
+    return stats;
 }
\ No newline at end of file
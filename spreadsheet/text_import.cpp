@@ -0,0 +1,157 @@
+#include "text_import.h"
+
+#include "cell.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <stdexcept>
+
+namespace TextImport {
+namespace {
+
+struct ChunkText {
+    std::string_view text;
+    int first_row = 0;
+};
+
+// Chunks of about CHUNK_SIZE bytes made of whole lines
+std::vector<ChunkText> SplitIntoChunks(std::string_view table) {
+    std::vector<ChunkText> chunks;
+    size_t begin = 0;
+    while (begin < table.size()) {
+        size_t end = std::min(begin + CHUNK_SIZE, table.size());
+        if (end < table.size()) {
+            const size_t line_end = table.find('\n', end - 1);
+            end = line_end == std::string_view::npos ? table.size() : line_end + 1;
+        }
+        chunks.push_back({ table.substr(begin, end - begin) });
+        begin = end;
+    }
+    return chunks;
+}
+
+FormulaPtr CompileFormula(std::string_view expression, Position pos) {
+    FormulaAST ast = ParseFormulaAST(expression);
+    ast.Rebase(pos);
+    return std::make_shared<const FormulaAST>(std::move(ast));
+}
+
+class ChunkReader {
+public:
+    ChunkReader(Chunk& chunk, char delimiter)
+        : chunk_(chunk)
+        , delimiter_(delimiter) {
+    }
+
+    void Read(ChunkText text) {
+        int row = text.first_row;
+        std::string_view rest = text.text;
+        while (!rest.empty()) {
+            size_t line_end = rest.find('\n');
+            std::string_view line = rest.substr(0, line_end);
+            rest.remove_prefix(line_end == std::string_view::npos ? rest.size() : line_end + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            ReadLine(line, row++);
+        }
+    }
+
+private:
+    void ReadLine(std::string_view line, int row) {
+        int col = 0;
+        for (;;) {
+            const size_t field_end = line.find(delimiter_);
+            const std::string_view field = line.substr(0, field_end);
+            if (!field.empty()) {
+                ReadField(field, { row, col });
+            }
+            if (field_end == std::string_view::npos) {
+                return;
+            }
+            line.remove_prefix(field_end + 1);
+            ++col;
+        }
+    }
+
+    void ReadField(std::string_view text, Position pos) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Invalid position!");
+        }
+
+        if (text.front() == FORMULA_SIGN && text.size() > 1) {
+            chunk_.fields.push_back({ pos, ReadFormula(text.substr(1), pos) });
+        }
+        else if (std::optional<double> number = Cell::ParseNumber(text)) {
+            chunk_.fields.push_back({ pos, *number });
+        }
+        else {
+            chunk_.fields.push_back({ pos, text });
+        }
+    }
+
+    const CompiledFormula* ReadFormula(std::string_view expression, Position pos) {
+        try {
+            form_.clear();
+            AppendRelativeForm(form_, expression, pos);
+            auto it = chunk_.formulas.find(form_);
+            if (it == chunk_.formulas.end()) {
+                const auto parse_start = std::chrono::steady_clock::now();
+                it = chunk_.formulas.emplace(form_, CompileFormula(expression, pos)).first;
+                ++chunk_.parsed;
+                chunk_.parse_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - parse_start).count();
+            }
+            return &*it;
+        }
+        catch (...) {
+            throw FormulaException("Incorrect formula!");
+        }
+    }
+
+    Chunk& chunk_;
+    char delimiter_;
+    // reused for the relative forms of formulas
+    std::string form_;
+};
+
+}  // namespace
+
+std::vector<Chunk> ReadTable(std::string_view table, char delimiter, size_t thread_count) {
+    if (delimiter != DELIMITER) {
+        throw std::invalid_argument("Only tab separated tables can be read");
+    }
+    std::vector<ChunkText> texts = SplitIntoChunks(table);
+
+    // rows of a chunk are numbered after the lines of those before it
+    std::vector<int> line_counts(texts.size());
+    ParallelFor(texts.size(), thread_count, [&](size_t i) {
+        const std::string_view text = texts[i].text;
+        line_counts[i] = static_cast<int>(std::count(text.begin(), text.end(), '\n'));
+    }, 1);
+    for (size_t i = 1; i < texts.size(); ++i) {
+        texts[i].first_row = texts[i - 1].first_row + line_counts[i - 1];
+    }
+
+    std::vector<Chunk> chunks(texts.size());
+    std::vector<std::exception_ptr> errors(texts.size());
+    ParallelFor(texts.size(), thread_count, [&](size_t i) {
+        try {
+            ChunkReader(chunks[i], delimiter).Read(texts[i]);
+        }
+        catch (...) {
+            errors[i] = std::current_exception();
+        }
+    }, 1);
+
+    // the first error of the table
+    for (const std::exception_ptr& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    return chunks;
+}
+
+}  // namespace TextImport
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "FormulaAST.h"
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Reading of tables of texts in the layout Sheet::PrintTexts writes:
+// a line per row ending with '\n' or "\r\n", fields separated by '\t'
+// without quoting. The first line is row 1, the first field column A,
+// empty fields are cells left as they are. Other delimiters aren't
+// supported: ',' or ';' appear in formulas, which aren't quoted.
+//
+// The table is split into chunks of whole rows, which are read on
+// several threads: fields are viewed in place, numbers are read with
+// from_chars and formulas compiled, each relative form once per chunk.
+namespace TextImport {
+
+using FormulaPtr = std::shared_ptr<const FormulaAST>;
+// a formula compiled in a chunk by its relative form
+using CompiledFormula = std::pair<const std::string, FormulaPtr>;
+
+struct Field {
+    Position pos;
+    // the number of a numeric text printed back as it is, see
+    // Cell::ParseNumber, a formula or any other text as is
+    std::variant<double, const CompiledFormula*, std::string_view> content;
+};
+
+struct Chunk {
+    // in the order of positions
+    std::vector<Field> fields;
+    std::unordered_map<std::string, FormulaPtr> formulas;
+    // formulas compiled and the time parsing them took
+    size_t parsed = 0;
+    std::uint64_t parse_ns = 0;
+};
+
+inline constexpr size_t CHUNK_SIZE = 1 << 20;
+
+inline constexpr char DELIMITER = '\t';
+
+// Reads the fields of the table on up to thread_count threads, texts
+// of the fields are views of the table. Throws std::invalid_argument
+// if the delimiter isn't DELIMITER, InvalidPositionException if the
+// table doesn't fit into the sheet and FormulaException for the first
+// incorrect formula, like Sheet::SetCell.
+std::vector<Chunk> ReadTable(std::string_view table, char delimiter, size_t thread_count);
+
+}  // namespace TextImport